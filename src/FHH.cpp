@@ -5,134 +5,87 @@
 #include <cassert>
 #include <vector>
 #include "image.h"
+#include "feature_cache.h"
+#include "fast_hessian.h"
+#include "cornerness.h"
+#include "feature_registry.h"
 
 using namespace std;
 
-// Calcola la matrice Hessiana
-Image compute_hessian(const Image& im, float sigma) {
-    Image smoothed = smooth_image(im, sigma); // Sfocatura
+// Metodo 0: Hessiana veloce (SURF) con filtri a scatola sull'immagine integrale, su
+// tutte le scale. Il descrittore e' preso dall'immagine ridotta dell'ottava del keypoint,
+// quindi la finestra copre window * 2^ottava pixel dell'immagine.
+static vector<Descriptor> detect_fast_hessian_keypoints(const Image& im, float sigma, float thresh, int window) {
+    Image gray = (im.c == 1) ? im : rgb_to_grayscale(im);
+    vector<ScaleKeypoint> keypoints = fast_hessian_extrema(gray, sigma, thresh);
 
-    Image fx = make_gx_filter(); // Filtro sobel x
-    Image fy = make_gy_filter(); // Filtro sobel y
+    // Immagini ridotte delle ottave che hanno keypoint
+    int octaves = 0;
+    for (auto& k : keypoints) octaves = max(octaves, k.octave + 1);
+    vector<Image> reduced(octaves);
+    parallel_for(1, octaves, [&](int o) { reduced[o] = box_downsample(im, 1 << o); });
 
-    Image Ix = convolve_image(smoothed, fx, true); // Derivata prima rispetto a x
-    Image Ixx = convolve_image(Ix, fx, true); // Derivata seconda rispetto a x
-
-    Image Iy = convolve_image(smoothed, fy, true); // Derivata prima rispetto a y
-    Image Iyy = convolve_image(Iy, fy, true); // Derivata seconda rispetto a y
-
-    Image Ixy = convolve_image(Ix, fy, true); // Derivata mista
-
-    Image H(im.w, im.h, 3);
-    for(int y = 0; y < im.h; y++) {
-        for(int x = 0; x < im.w; x++) {
-            H(x,y,0) = Ixx(x,y,0);  // Componente Ixx
-            H(x,y,1) = Iyy(x,y,0);  // Componente Iyy
-            H(x,y,2) = Ixy(x,y,0);  // Componente Ixy
-        }
-    }
-    return H;
+    vector<Descriptor> d(keypoints.size());
+    parallel_for(0, keypoints.size(), [&](int i) {
+        const ScaleKeypoint& k = keypoints[i];
+        d[i] = describe_index(k.octave ? reduced[k.octave] : im, lround(k.ox), lround(k.oy), window);
+        d[i].p = Point(k.x, k.y);
+        d[i].scale = k.sigma;
+    });
+    return d;
 }
 
 // Rileva punti caratteristici utilizzando diversi metodi
-vector<Descriptor> fhh_detector(const Image& im, int method, float sigma, 
-                                float thresh, int window, int nms_window) {
-    Image R(im.w, im.h, 1);
-
-    if (method == 0) {  
-        // Metodo Hessian
-        Image H = compute_hessian(im, sigma);
-        for(int y = 0; y < H.h; y++) {
-            for(int x = 0; x < H.w; x++) {
-                float Ixx = H(x,y,0);
-                float Iyy = H(x,y,1);
-                float Ixy = H(x,y,2);
-                float det = Ixx * Iyy - Ixy * Ixy; // Determinante dell'Hessiana
-                R(x,y,0) = det;
-            }
-        }
-    } else {
-        // Metodo Förstner, Harris o Ibrido
-        Image S = structure_matrix(im, sigma);
-        for(int y = 0; y < S.h; y++) {
-            for(int x = 0; x < S.w; x++) {
-                float a = S(x,y,0);  // Ix^2
-                float b = S(x,y,1);  // Iy^2
-                float c = S(x,y,2);  // IxIy
-                float trace = a + b;
-                float det = a * b - c * c;
-                float forstner_weight, harris_weight;
+static vector<Descriptor> detect_fhh_keypoints(const Image& im, int method, float sigma, 
+                                               float thresh, int window, int nms_window, int budget, int selection, bool subpixel) {
+    if (method == 0) return detect_fast_hessian_keypoints(im, sigma, thresh, window);
 
-                switch(method) {
-                    case 1:  // Förstner
-                        R(x,y,0) = det / (trace + 1e-8f);
-                        break;
-                    case 2:  // Harris
-                        R(x,y,0) = det - 0.04f * powf(trace, 2);
-                        break;
-                    case 3:  // Ibrido
-                        forstner_weight = det / (trace + 1e-8f);
-                        harris_weight = det - 0.04f * powf(trace, 2);
-                        R(x,y,0) = 0.5f * (forstner_weight + harris_weight);
-                        break;
-                    default:
-                        fprintf(stderr, "Errore: metodo non valido. Metodi: 0, 1, 2, 3\n");
-                        exit(EXIT_FAILURE);
-                }
-            }
-        }
+    // Metodo Förstner, Harris o Ibrido: il metodo e' scelto una volta, non per pixel.
+    // La risposta e' sogliata e soppressa mentre viene calcolata, senza tenerla tutta
+    Image S = structure_matrix(im, sigma);
+    vector<Corner> c;
+    switch(method) {
+        case 1:  // Förstner
+            c = cornerness_candidates(S, ForstnerMeasure(1e-8f), thresh, nms_window);
+            break;
+        case 2:  // Harris
+            c = cornerness_candidates(S, HarrisMeasure(0.04f), thresh, nms_window);
+            break;
+        case 3:  // Ibrido
+            c = cornerness_candidates(S, HybridMeasure(1e-8f, 0.04f), thresh, nms_window);
+            break;
+        default:
+            fprintf(stderr, "Errore: metodo non valido. Metodi: 0, 1, 2, 3\n");
+            exit(EXIT_FAILURE);
     }
 
-    Image Rnms = nms_image(R, nms_window); 
-    return detect_corners(im, Rnms, thresh, window); 
+    if (budget > 0) c = select_corners(c, budget, selection, im.w, im.h);
+    return describe_corners(im, c, window, subpixel);
 }
 
-// Rileva e disegna i punti caratteristici sull'immagine
-Image detect_and_draw_fhh(const Image& im, int method, float sigma, 
-                          float thresh, int window, int nms_window) {
-    TIME(1);
-    vector<Descriptor> corners = fhh_detector(im, method, sigma, thresh, window, nms_window);
-    printf("Numero di Descrittori: %ld\n", corners.size());
-    return mark_corners(im, corners);
-}
-
-// Trova e disegna le corrispondenze tra due immagini
-Image find_and_draw_fhh_matches(const Image& a, const Image& b,
-                                int method, float sigma, float thresh, 
-                                int window, int nms_window) {
-    TIME(1);
-    vector<Descriptor> ad = fhh_detector(a, method, sigma, thresh, window, nms_window);
-    vector<Descriptor> bd = fhh_detector(b, method, sigma, thresh, window, nms_window);
-    vector<Match> m = match_descriptors(ad, bd);
-    printf("Numero di Match: %ld\n", m.size());
-    Image A = mark_corners(a, ad);
-    Image B = mark_corners(b, bd);
-    Image lines = draw_matches(A, B, m, {});
-    return lines;
+// Punti caratteristici, presi dalla cache delle feature se ci sono gia'
+vector<Descriptor> fhh_detector(const Image& im, int method, float sigma, 
+                                float thresh, int window, int nms_window, int budget, int selection, bool subpixel) {
+    // il metodo 0 non ha ne' budget ne' raffinamento: i keypoint sono gli estremi di tutte le scale
+    vector<double> params = {(double)method, sigma, thresh, (double)window, (double)nms_window};
+    if (method && (budget > 0 || subpixel)) { params.push_back(budget); params.push_back(selection); }
+    if (method && subpixel) params.push_back(1);
+    return cached_features(im, method ? "fhh" : "fhh-surf", params,
+                           [&]() { return detect_fhh_keypoints(im, method, sigma, thresh, window, nms_window, budget, selection, subpixel); });
 }
 
-// Disegna le corrispondenze inlier tra due immagini
-Image draw_fhh_inliers(const Image& a, const Image& b,
-                       int method, float sigma, float thresh, 
-                       int window, int nms_window,
-                       float inlier_thresh, int iters, int cutoff) {
-    TIME(1);
-    vector<Descriptor> ad = fhh_detector(a, method, sigma, thresh, window, nms_window);
-    vector<Descriptor> bd = fhh_detector(b, method, sigma, thresh, window, nms_window);
-    vector<Match> m = match_descriptors(ad, bd);
-    Matrix Hba = RANSAC(m, inlier_thresh, iters, cutoff);
-    return draw_inliers(a, b, Hba, m, inlier_thresh);
-}
+// Hessiana veloce, Förstner, Harris o Ibrido nel registro dei rilevatori ("fhh", method: il metodo)
+class FhhDetector : public FeatureDetector {
+public:
+    explicit FhhDetector(const DetectorParams& p) : p(p) {}
+    using FeatureDetector::detect;
+    vector<Descriptor> detect(const Image& im) const override {
+        return fhh_detector(im, p.method, p.sigma, p.thresh, p.window, p.nms, p.budget, p.selection, p.subpixel);
+    }
+private:
+    DetectorParams p;
+};
 
-Image panorama_image_fhh(const Image& a, const Image& b,
-                                     int method, float sigma, float thresh, 
-                                     int window, int nms_window,
-                                     float inlier_thresh, int iters, int cutoff, float acoeff) {
-    TIME(1);
-    vector<Descriptor> ad = fhh_detector(a, method, sigma, thresh, window, nms_window);
-    vector<Descriptor> bd = fhh_detector(b, method, sigma, thresh, window, nms_window);
-    
-    vector<Match> m = match_descriptors(ad, bd);
-    Matrix Hba = RANSAC(m, inlier_thresh, iters, cutoff);
-    return combine_images(a, b, Hba, acoeff);
-}
+static DetectorRegistration fhh_registration("fhh", [](const DetectorParams& p) {
+    return unique_ptr<FeatureDetector>(new FhhDetector(p));
+});
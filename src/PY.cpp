@@ -1,112 +1,83 @@
 #include <vector>
 #include <cmath>
 #include "image.h"
-
-// Crea il descrittore per il keypoint in x,y
-Descriptor describe_index(const Image& im, int x, int y, int w) {
-    Descriptor d;
-    d.p = {(double)x, (double)y};
-    d.data.reserve(w * w * im.c);
-
-    for (int c = 0; c < im.c; c++) {
-        float cval = im.clamped_pixel(x, y, c);
-        for (int dx = -w / 2; dx <= w / 2; dx++) {
-            for (int dy = -w / 2; dy <= w / 2; dy++) {
-                d.data.push_back(im.clamped_pixel(x + dx, y + dy, c) - cval);
-            }
-        }
-    }
-    return d;
-}
+#include "feature_cache.h"
+#include "scale_space.h"
+#include "feature_registry.h"
+#include "cornerness.h"
 
 // Rileva punti chiave nello spazio delle scale
-vector<Descriptor> detect_scale_space_keypoints(const Image& im, float base_sigma, float thresh, int window, int nms, int num_octaves = 4, int scales_per_octave = 3) {
-    vector<Descriptor> keypoints;
-    vector<Image> scale_space, responses;
-    float scale_factor = pow(2.0f, 1.0f / scales_per_octave);
-    Image current = im;
-    float current_sigma = base_sigma;
-
-    // Costruisce lo spazio delle scale
-    for (int octave = 0; octave < num_octaves; ++octave) {
-        for (int scale = 0; scale < scales_per_octave; ++scale) {
-            Image smoothed = smooth_image(current, current_sigma);
-            scale_space.push_back(smoothed);
-
-            Image S = structure_matrix(smoothed, current_sigma);
-            Image R = cornerness_response(S, 1);
-            responses.push_back(R);
-
-            current_sigma *= scale_factor;
-        }
-        if (octave < num_octaves - 1) {
-            current = bilinear_resize(current, current.w / 2, current.h / 2);
-            current_sigma = base_sigma;
-        }
-    }
+static vector<Descriptor> detect_scale_space_keypoints_uncached(const Image& im, float base_sigma, float thresh, int window, int nms, int num_octaves, int scales_per_octave) {
+    // Spazio delle scale condiviso con gli altri rilevatori: ogni livello e' sfocato
+    // partendo dal precedente, e ogni ottava parte dalla precedente decimata
+    auto ss = ScaleSpace::get(im, base_sigma, scales_per_octave, num_octaves);
+    int octaves = min(num_octaves, ss->octaves());
+    int n = scales_per_octave + 2;
 
-    // Selezione dei keypoint
-    for (int octave = 0; octave < num_octaves; ++octave) {
-        for (int scale = 0; scale < scales_per_octave; ++scale) {
-            int idx = octave * scales_per_octave + scale;
-            if (idx == 0 || idx >= responses.size() - 1) continue;
+    // Riga y della risposta del livello 'scale', dalla sua matrice di struttura S.
+    // Normalizzata per la scala: senza, la risposta cala con la sfocatura e un livello
+    // non e' quasi mai piu' forte dei vicini. Al livello 0 resta com'e' (stessa soglia)
+    auto response_row = [&](const Image& S, int scale, int y, float* r) {
+        cornerness_row(S, y, ShiTomasiMeasure(), r);
+        float norm = powf(ss->level_sigma(scale) / base_sigma, 2);
+        for (int x = 0; x < S.w; x++) r[x] *= norm;
+    };
 
-            Image current_response = responses[idx];
-            Image prev_response = responses[idx - 1];
-            Image next_response = responses[idx + 1];
+    // Le risposte non vengono mai salvate intere: di ogni ottava si tengono le matrici di
+    // struttura dei livelli 0..scales_per_octave+1, calcolate in parallelo
+    vector<vector<Descriptor>> found(octaves * scales_per_octave);
+    parallel_for(0, octaves, [&](int octave) {
+        vector<Image> S(n);
+        parallel_for(0, n, [&](int scale) { S[scale] = structure_matrix(ss->level(octave, scale), ss->level_sigma(scale)); });
+        float scale_multiplier = 1 << octave;
 
-            Image nms_result = nms_image(current_response, nms);
+        parallel_for(1, scales_per_octave + 1, [&](int scale) {
+            // Soglia e Non-Maximum Suppression del livello mentre la sua risposta viene calcolata
+            vector<Corner> c = stream_nms(S[scale].w, S[scale].h, nms, thresh, [&](int y, float* r) { response_row(S[scale], scale, y, r); });
 
-            for (int y = 0; y < nms_result.h; ++y) {
-                for (int x = 0; x < nms_result.w; ++x) {
-                    float current_val = nms_result(x, y, 0);
-                    if (current_val <= thresh) continue;
-                    if (current_val <= prev_response.clamped_pixel(x, y, 0) || current_val <= next_response.clamped_pixel(x, y, 0)) continue;
-                    
-                    Descriptor d = describe_index(scale_space[idx], x, y, window);
-                    float scale_multiplier = pow(2.0f, octave);
-                    d.p.x = x * scale_multiplier;
-                    d.p.y = y * scale_multiplier;
-                    keypoints.push_back(d);
+            // Massimi anche rispetto alle scale vicine della stessa ottava: delle loro risposte
+            // servono solo le righe con dei candidati (che arrivano in ordine di riga)
+            vector<float> prev(S[scale].w), next(S[scale].w);
+            int row = -1;
+            for (auto& k : c) {
+                if (k.y != row) {
+                    row = k.y;
+                    response_row(S[scale - 1], scale - 1, row, prev.data());
+                    response_row(S[scale + 1], scale + 1, row, next.data());
                 }
+                if (k.response <= prev[k.x] || k.response <= next[k.x]) continue;
+
+                Descriptor d = describe_index(ss->level(octave, scale), k.x, k.y, window);
+                d.p.x = k.x * scale_multiplier;
+                d.p.y = k.y * scale_multiplier;
+                found[octave * scales_per_octave + scale - 1].push_back(d);
             }
-        }
-    }
-    return keypoints;
-}
+        });
+    });
 
-// Rileva e disegna i punti chiave
-Image detect_and_draw_scale_space_keypoints(const Image& im, float base_sigma, float thresh, int window, int nms, int num_octaves = 4, int scales_per_octave = 3) {
-    TIME(1);
-    std::vector<Descriptor> keypoints = detect_scale_space_keypoints(im, base_sigma, thresh, window, nms, num_octaves, scales_per_octave);
-    printf("Numero di Descrittori: %zu\n", keypoints.size());
-    return mark_corners(im, keypoints);
+    vector<Descriptor> keypoints;
+    for (auto& level : found) keypoints.insert(keypoints.end(), level.begin(), level.end());
+    return keypoints;
 }
 
-// Trova e disegna i match tra due immagini
-Image find_and_draw_scale_matches(const Image& a, const Image& b, float sigma, float thresh, int window, int nms_window, int num_octaves = 4, int scales_per_octave = 3) {
-    TIME(1);
-    auto ad = detect_scale_space_keypoints(a, sigma, thresh, window, nms_window, num_octaves, scales_per_octave);
-    auto bd = detect_scale_space_keypoints(b, sigma, thresh, window, nms_window, num_octaves, scales_per_octave);
-    auto m = match_descriptors(ad, bd);
-    printf("Numero di Match: %ld\n", m.size());
-    return draw_matches(mark_corners(a, ad), mark_corners(b, bd), m, {});
+// Punti chiave nello spazio delle scale, presi dalla cache delle feature se ci sono gia'
+vector<Descriptor> detect_scale_space_keypoints(const Image& im, float base_sigma, float thresh, int window, int nms, int num_octaves, int scales_per_octave) {
+    return cached_features(im, "scale-space-v2", {base_sigma, thresh, (double)window, (double)nms, (double)num_octaves, (double)scales_per_octave},
+                           [&]() { return detect_scale_space_keypoints_uncached(im, base_sigma, thresh, window, nms, num_octaves, scales_per_octave); });
 }
 
-// Disegna gli inliers trovati con RANSAC
-Image draw_scale_inliers(const Image& a, const Image& b, float sigma, float thresh, int window, int nms_window, float inlier_thresh, int iters, int cutoff, int num_octaves=4, int scales_per_octave=3) {
-    auto ad = detect_scale_space_keypoints(a, sigma, thresh, window, nms_window, num_octaves, scales_per_octave);
-    auto bd = detect_scale_space_keypoints(b, sigma, thresh, window, nms_window, num_octaves, scales_per_octave);
-    auto m = match_descriptors(ad, bd);
-    auto Hba = RANSAC(m, inlier_thresh, iters, cutoff);
-    return draw_inliers(a, b, Hba, m, inlier_thresh);
-}
+// Spazio delle scale nel registro dei rilevatori ("scale-space")
+class ScaleSpaceDetector : public FeatureDetector {
+public:
+    explicit ScaleSpaceDetector(const DetectorParams& p) : p(p) {}
+    using FeatureDetector::detect;
+    vector<Descriptor> detect(const Image& im) const override {
+        return detect_scale_space_keypoints(im, p.sigma, p.thresh, p.window, p.nms, p.octaves, p.scales);
+    }
+private:
+    DetectorParams p;
+};
 
-// Crea un panorama usando i keypoint dello spazio delle scale
-Image panorama_image_scale(const Image& a, const Image& b, float sigma, float thresh, int window, int nms_window, float inlier_thresh, int iters, int cutoff, float acoeff, int num_octaves=4, int scales_per_octave=3) {
-    auto ad = detect_scale_space_keypoints(a, sigma, thresh, window, nms_window, num_octaves, scales_per_octave);
-    auto bd = detect_scale_space_keypoints(b, sigma, thresh, window, nms_window, num_octaves, scales_per_octave);
-    auto m = match_descriptors(ad, bd);
-    auto Hba = RANSAC(m, inlier_thresh, iters, cutoff);
-    return combine_images(a, b, Hba, acoeff);
-}
+static DetectorRegistration scale_space_registration("scale-space", [](const DetectorParams& p) {
+    return unique_ptr<FeatureDetector>(new ScaleSpaceDetector(p));
+});
@@ -1,88 +1,77 @@
 #include <vector>
 #include <algorithm>
 #include "image.h"
+#include "feature_cache.h"
+#include "cornerness.h"
+#include "feature_registry.h"
 
 // Rileva angoli usando Shi-Tomasi
-vector<Descriptor> shi_tomasi_detector(const Image& im, bool is_adaptive, float sigma, float thresh, 
-                                       int window, int nms_size) {
+static vector<Descriptor> detect_shi_tomasi_corners(const Image& im, bool is_adaptive, float sigma, float thresh, 
+                                                    int window, int nms_size, int budget, int selection, bool subpixel) {
     Image S = structure_matrix(im, sigma); // Matrice di struttura
-    Image R(S.w, S.h, 1);
-    float max_response = -INFINITY, mean_response = 0.0;
-    int valid_points = 0;
-    
-    // Calcola la risposta di Shi-Tomasi
-    for(int y = 0; y < S.h; y++) {
-        for(int x = 0; x < S.w; x++) {
-            float Ixx = S(x,y,0), Iyy = S(x,y,1), Ixy = S(x,y,2);
-            float term1 = (Ixx + Iyy) / 2.0f;
-            float term2 = sqrt(pow(Ixx - Iyy, 2) / 4.0f + pow(Ixy, 2));
-            R(x,y,0) = term1 - term2; // Minore tra gli autovalori
-        }
-    }
-    
-    // Trova massimo e media della matrice response
-    for(int y = 0; y < R.h; y++) {
-        for(int x = 0; x < R.w; x++) {
-            if(R(x,y,0) > 0) {
-                max_response = std::max(max_response, R(x,y,0));
-                mean_response += R(x,y,0);
-                valid_points++;
+    float final_thresh = thresh;
+
+    if (is_adaptive) {
+        // Massimo e media della risposta (il minore tra gli autovalori), riga per riga
+        // senza tenerla tutta: le righe sono ricalcolate dopo, nella soppressione
+        vector<float> row_max(S.h, -INFINITY);
+        vector<double> row_sum(S.h, 0.0);
+        vector<int> row_count(S.h, 0);
+        parallel_for_ranges(0, S.h, 32, [&](int y0, int y1) {
+            vector<float> r(S.w);
+            for (int y = y0; y < y1; y++) {
+                cornerness_row(S, y, ShiTomasiMeasure(), r.data());
+                for (float v : r) {
+                    if (v > 0) {
+                        row_max[y] = std::max(row_max[y], v);
+                        row_sum[y] += v;
+                        row_count[y]++;
+                    }
+                }
             }
+        });
+        float max_response = -INFINITY;
+        double mean_response = 0.0;
+        int valid_points = 0;
+        for (int y = 0; y < S.h; y++) {
+            max_response = std::max(max_response, row_max[y]);
+            mean_response += row_sum[y];
+            valid_points += row_count[y];
         }
+        mean_response /= valid_points;
+
+        // Soglia adattiva
+        final_thresh = thresh * (0.5f * max_response + 0.5f * (float)mean_response);
     }
-    mean_response /= valid_points;
-    
-    // Soglia adattiva
-    float final_thresh = is_adaptive ? thresh * (0.5f * max_response + 0.5f * mean_response) : thresh;
-    
-    Image Rnms = nms_image(R, nms_size); 
-    return detect_corners(im, Rnms, final_thresh, window);
-}
 
-// Disegna gli angoli trovati
-Image detect_and_draw_shi_tomasi(const Image& im, bool is_adaptive, float sigma, float thresh, 
-                                 int window, int nms_size) {
-    TIME(1);
-    vector<Descriptor> keypoints = shi_tomasi_detector(im, is_adaptive, sigma, thresh, window, nms_size);
-    printf("Numero di Descrittori: %zu\n", keypoints.size());
-    return mark_corners(im, keypoints);
+    // Soglia e soppressione dei non massimi mentre la risposta viene calcolata
+    vector<Corner> c = cornerness_candidates(S, ShiTomasiMeasure(), final_thresh, nms_size);
+    if (budget > 0) c = select_corners(c, budget, selection, im.w, im.h);
+    return describe_corners(im, c, window, subpixel);
 }
 
-// Trova e disegna match tra due immagini
-Image find_and_draw_shi_tomasi_matches(const Image& a, const Image& b, bool is_adaptive, float sigma, float thresh,
-                                       int window, int nms_size) {
-    TIME(1);
-    vector<Descriptor> ad = shi_tomasi_detector(a, is_adaptive, sigma, thresh, window, nms_size);
-    vector<Descriptor> bd = shi_tomasi_detector(b, is_adaptive, sigma, thresh, window, nms_size);
-    
-    vector<Match> m = match_descriptors(ad, bd);
-    printf("Numero di Match: %zu\n", m.size());
-    
-    Image A = mark_corners(a, ad);
-    Image B = mark_corners(b, bd);
-    return draw_matches(A, B, m, {});
+// Angoli di Shi-Tomasi, presi dalla cache delle feature se ci sono gia'
+vector<Descriptor> shi_tomasi_detector(const Image& im, bool is_adaptive, float sigma, float thresh, 
+                                       int window, int nms_size, int budget, int selection, bool subpixel) {
+    vector<double> params = {(double)is_adaptive, sigma, thresh, (double)window, (double)nms_size};
+    if (budget > 0 || subpixel) { params.push_back(budget); params.push_back(selection); }
+    if (subpixel) params.push_back(1);
+    return cached_features(im, "shi-tomasi", params,
+                           [&]() { return detect_shi_tomasi_corners(im, is_adaptive, sigma, thresh, window, nms_size, budget, selection, subpixel); });
 }
 
-// Disegna inliers usando RANSAC
-Image draw_shi_tomasi_inliers(const Image& a, const Image& b, bool is_adaptive, float sigma, float thresh,
-                              int window, int nms_size, float inlier_thresh, int iters, int cutoff) {
-    TIME(1);
-    vector<Descriptor> ad = shi_tomasi_detector(a, is_adaptive, sigma, thresh, window, nms_size);
-    vector<Descriptor> bd = shi_tomasi_detector(b, is_adaptive, sigma, thresh, window, nms_size);
-    
-    vector<Match> m = match_descriptors(ad, bd);
-    Matrix Hba = RANSAC(m, inlier_thresh, iters, cutoff);
-    return draw_inliers(a, b, Hba, m, inlier_thresh);
-}
+// Shi-Tomasi nel registro dei rilevatori ("shi-tomasi", method: soglia adattiva)
+class ShiTomasiDetector : public FeatureDetector {
+public:
+    explicit ShiTomasiDetector(const DetectorParams& p) : p(p) {}
+    using FeatureDetector::detect;
+    vector<Descriptor> detect(const Image& im) const override {
+        return shi_tomasi_detector(im, p.method != 0, p.sigma, p.thresh, p.window, p.nms, p.budget, p.selection, p.subpixel);
+    }
+private:
+    DetectorParams p;
+};
 
-// Crea un panorama unendo due immagini
-Image panorama_image_shi_tomasi(const Image& a, const Image& b, bool is_adaptive, float sigma, float thresh,
-                                int window, int nms_size, float inlier_thresh, int iters, int cutoff, float acoeff) {
-    TIME(1);
-    vector<Descriptor> ad = shi_tomasi_detector(a, is_adaptive, sigma, thresh, window, nms_size);
-    vector<Descriptor> bd = shi_tomasi_detector(b, is_adaptive, sigma, thresh, window, nms_size);
-    
-    vector<Match> m = match_descriptors(ad, bd);
-    Matrix Hba = RANSAC(m, inlier_thresh, iters, cutoff);
-    return combine_images(a, b, Hba, acoeff);
-}
\ No newline at end of file
+static DetectorRegistration shi_tomasi_registration("shi-tomasi", [](const DetectorParams& p) {
+    return unique_ptr<FeatureDetector>(new ShiTomasiDetector(p));
+});
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+// Thread-safe store of named, immutable results (images, features, homographies...).
+//
+// A result is published once it is complete, as a shared_ptr<const T>, with a
+// single atomic swap: readers get a reference-counted snapshot they can use for
+// as long as they want, without copying it, even if the name is published again
+// meanwhile. Access is by sharded locking, not wait-free: the keys are spread over
+// 16 independently locked shards, a shard is locked only to find or create the slot
+// of a key, and the swap itself is atomic_load/atomic_store of shared_ptr, which
+// libstdc++ guards with a short pooled lock. No lock is held while a result is
+// computed or used, so readers only ever wait for another lookup of the same shard.
+template<typename T>
+class ArtifactStore
+  {
+  public:
+
+  typedef shared_ptr<const T> Ptr;
+
+  // returns: the last value published as 'key', null if there is none.
+  // Locks the key's shard for the lookup.
+  Ptr get(const string& key) const
+    {
+    const Slot* s=find(key);
+    return s?atomic_load(&s->value):nullptr;
+    }
+
+  // Publishes 'value' as 'key', replacing the previous value.
+  void publish(const string& key, Ptr value)
+    {
+    atomic_store(&slot(key).value,move(value));
+    }
+
+  Ptr publish(const string& key, T value)
+    {
+    Ptr p=make_shared<const T>(move(value));
+    publish(key,p);
+    return p;
+    }
+
+  // returns: all the published values, sorted by key.
+  vector<pair<string,Ptr>> snapshot(void) const
+    {
+    vector<pair<string,Ptr>> r;
+    for(auto&e1:shards)
+      {
+      lock_guard<mutex> LG(e1.m);
+      for(auto&e2:e1.slots)
+        {
+        Ptr p=atomic_load(&e2.second->value);
+        if(p)r.emplace_back(e2.first,move(p));
+        }
+      }
+    sort(r.begin(),r.end(),[](const pair<string,Ptr>& a, const pair<string,Ptr>& b){ return a.first<b.first; });
+    return r;
+    }
+
+  private:
+
+  static const int SHARDS=16;
+
+  struct Slot
+    {
+    Ptr value;
+    };
+
+  struct Shard
+    {
+    mutable mutex m;
+    unordered_map<string,unique_ptr<Slot>> slots;  // slots never move nor die
+    };
+
+  Shard& shard(const string& key) const { return shards[hash<string>()(key)%SHARDS]; }
+
+  const Slot* find(const string& key) const
+    {
+    Shard& s=shard(key);
+    lock_guard<mutex> LG(s.m);
+    auto it=s.slots.find(key);
+    return it==s.slots.end()?nullptr:it->second.get();
+    }
+
+  Slot& slot(const string& key)
+    {
+    Shard& s=shard(key);
+    lock_guard<mutex> LG(s.m);
+    unique_ptr<Slot>& p=s.slots[key];
+    if(!p)p.reset(new Slot);
+    return *p;
+    }
+
+  mutable Shard shards[SHARDS];
+  };
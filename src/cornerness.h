@@ -0,0 +1,156 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#include <functional>
+#include <vector>
+
+#include "image.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Cornerness measures of a symmetric 2x2 matrix [a c; c b]: the structure matrix
+// (a=Ix^2, b=Iy^2, c=IxIy) or the Hessian (a=Ixx, b=Iyy, c=Ixy).
+// Every measure is a type, so cornerness_sweep is compiled once per measure with the
+// formula inlined in its loop; the method is chosen once per image, not per pixel.
+// With AVX2 a measure also works on 8 pixels at a time; the sweep then runs every pixel
+// through it (the end of a row padded), so a pixel's result does not depend on its column.
+
+// det/tr (Förstner). eps keeps flat areas finite.
+struct ForstnerMeasure
+  {
+  float eps;
+  explicit ForstnerMeasure(float eps=0.f) : eps(eps) {}
+  float operator()(float a, float b, float c) const { return (a*b-c*c)/(a+b+eps); }
+#ifdef __AVX2__
+  __m256 operator()(__m256 a, __m256 b, __m256 c) const
+    {
+    __m256 det=_mm256_sub_ps(_mm256_mul_ps(a,b),_mm256_mul_ps(c,c));
+    return _mm256_div_ps(det,_mm256_add_ps(_mm256_add_ps(a,b),_mm256_set1_ps(eps)));
+    }
+#endif
+  };
+
+// det-k*tr^2 (Harris).
+struct HarrisMeasure
+  {
+  float k;
+  explicit HarrisMeasure(float k=0.04f) : k(k) {}
+  float operator()(float a, float b, float c) const { float tr=a+b; return a*b-c*c-k*tr*tr; }
+#ifdef __AVX2__
+  __m256 operator()(__m256 a, __m256 b, __m256 c) const
+    {
+    __m256 tr=_mm256_add_ps(a,b);
+    __m256 det=_mm256_sub_ps(_mm256_mul_ps(a,b),_mm256_mul_ps(c,c));
+    return _mm256_sub_ps(det,_mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(k),tr),tr));
+    }
+#endif
+  };
+
+// Smallest eigenvalue (Shi-Tomasi), in the form that does not cancel: tr/2-sqrt((a-b)^2/4+c^2).
+struct ShiTomasiMeasure
+  {
+  float operator()(float a, float b, float c) const
+    {
+    float d=(a-b)*0.5f;
+    return (a+b)*0.5f-sqrtf(d*d+c*c);
+    }
+#ifdef __AVX2__
+  __m256 operator()(__m256 a, __m256 b, __m256 c) const
+    {
+    const __m256 half=_mm256_set1_ps(0.5f);
+    __m256 d=_mm256_mul_ps(_mm256_sub_ps(a,b),half);
+    __m256 r=_mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(d,d),_mm256_mul_ps(c,c)));
+    return _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(a,b),half),r);
+    }
+#endif
+  };
+
+// Average of Förstner and Harris.
+struct HybridMeasure
+  {
+  ForstnerMeasure f;
+  HarrisMeasure h;
+  HybridMeasure(float eps=1e-8f, float k=0.04f) : f(eps), h(k) {}
+  float operator()(float a, float b, float c) const { return 0.5f*(f(a,b,c)+h(a,b,c)); }
+#ifdef __AVX2__
+  __m256 operator()(__m256 a, __m256 b, __m256 c) const
+    {
+    return _mm256_mul_ps(_mm256_set1_ps(0.5f),_mm256_add_ps(f(a,b,c),h(a,b,c)));
+    }
+#endif
+  };
+
+// Determinant of the Hessian; w weights Ixy (0.9 balances SURF's box filters).
+struct HessianDetMeasure
+  {
+  float w;
+  explicit HessianDetMeasure(float w=1.f) : w(w) {}
+  float operator()(float a, float b, float c) const { return a*b-w*w*c*c; }
+#ifdef __AVX2__
+  __m256 operator()(__m256 a, __m256 b, __m256 c) const
+    {
+    __m256 ww=_mm256_set1_ps(w*w);
+    return _mm256_sub_ps(_mm256_mul_ps(a,b),_mm256_mul_ps(_mm256_mul_ps(ww,c),c));
+    }
+#endif
+  };
+
+// Writes the measure of row y of the 3 channel matrix image S to r.
+template<typename M>
+void cornerness_row(const Image& S, int y, M measure, float* r)
+  {
+  const float* a=S.RowPtr(y,0);
+  const float* b=S.RowPtr(y,1);
+  const float* c=S.RowPtr(y,2);
+  int x=0;
+#ifdef __AVX2__
+  for(;x+8<=S.w;x+=8)_mm256_storeu_ps(r+x,measure(_mm256_loadu_ps(a+x),_mm256_loadu_ps(b+x),_mm256_loadu_ps(c+x)));
+  if(x<S.w)
+    {
+    float pa[8]={0}, pb[8]={0}, pc[8]={0}, pr[8];
+    int n=S.w-x;
+    memcpy(pa,a+x,n*sizeof(float));
+    memcpy(pb,b+x,n*sizeof(float));
+    memcpy(pc,c+x,n*sizeof(float));
+    _mm256_storeu_ps(pr,measure(_mm256_loadu_ps(pa),_mm256_loadu_ps(pb),_mm256_loadu_ps(pc)));
+    memcpy(r+x,pr,n*sizeof(float));
+    }
+#else
+  for(;x<S.w;x++)r[x]=measure(a[x],b[x],c[x]);
+#endif
+  }
+
+// returns: measure of every pixel of the 3 channel matrix image S, rows in parallel.
+template<typename M>
+Image cornerness_sweep(const Image& S, M measure)
+  {
+  assert(S.c==3);
+  Image R(S.w,S.h,1);
+  parallel_for_ranges(0,S.h,32,[&](int y0, int y1)
+    {
+    for(int y=y0;y<y1;y++)cornerness_row(S,y,measure,R.RowPtr(y,0));
+    });
+  return R;
+  }
+
+// Threshold and non-maximum suppression of a response that is never stored whole:
+// response(y,r) writes row y to r, and the rows are decided as they stream through a
+// ring of the 2*nms+1 rows around them. returns: the pixels above thresh with no
+// pixel within nms larger, as corner_candidates(nms_image(R,nms),thresh) finds them,
+// in row order. Bands of rows run in parallel, each with its own ring.
+vector<Corner> stream_nms(int w, int h, int nms, float thresh, const function<void(int,float*)>& response);
+
+// returns: the corners of the measure of S, see stream_nms.
+template<typename M>
+vector<Corner> cornerness_candidates(const Image& S, M measure, float thresh, int nms)
+  {
+  assert(S.c==3);
+  return stream_nms(S.w,S.h,nms,thresh,[&](int y, float* r){ cornerness_row(S,y,measure,r); });
+  }
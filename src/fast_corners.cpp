@@ -0,0 +1,200 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <cassert>
+
+#include "image.h"
+#include "fast_corners.h"
+#include "feature_cache.h"
+#include "feature_registry.h"
+#include "cornerness.h"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Radius of the circle: pixels closer to the border are not tested.
+static const int FAST_BORDER=3;
+// The circle, clockwise from the top. Pixels 0, 4, 8 and 12 are the compass points.
+static const int CIRCLE[16][2]={{0,-3},{1,-3},{2,-2},{3,-1},{3,0},{3,1},{2,2},{1,3},
+                                {0,3},{-1,3},{-2,2},{-3,1},{-3,0},{-3,-1},{-2,-2},{-1,-3}};
+
+// returns: true if 'arc' contiguous pixels of the circle are all above hi or all below lo.
+static bool segment_test(const uint8_t* p, const int* off, int arc, int lo, int hi){
+  int bright=0, dark=0;
+  for(int k=0;k<16+arc-1;k++){
+    int v=p[off[k&15]];
+    bright=v>hi ? bright+1 : 0;
+    dark  =v<lo ? dark+1   : 0;
+    if(bright>=arc || dark>=arc)return true;
+  }
+  return false;
+}
+
+// returns: FAST score of the corner at p, in the units of the image.
+static float fast_score(const uint8_t* p, const int* off, int t){
+  int c=*p, sb=0, sd=0;
+  for(int k=0;k<16;k++){
+    int v=p[off[k]];
+    if(v>c+t)sb+=v-c-t;
+    else if(v<c-t)sd+=c-t-v;
+  }
+  return max(sb,sd)/255.f;
+}
+
+#ifdef __SSE2__
+static inline __m128i load_signed(const uint8_t* p, __m128i delta){
+  return _mm_xor_si128(_mm_loadu_si128((const __m128i*)p),delta);
+}
+#endif
+
+// Appends the corners of row y with x in [x0,x1) of the 8 bit image g (stride w).
+static void row_corners(const uint8_t* g, int w, int y, int x0, int x1, const int* off, int arc, int t, vector<Corner>& out){
+  const uint8_t* row=g+(size_t)y*w;
+  int x=x0;
+#ifdef __SSE2__
+  // bytes are compared signed, so they are moved to [-128,127] first
+  const __m128i delta=_mm_set1_epi8((char)0x80), vt=_mm_set1_epi8((char)t), vk=_mm_set1_epi8((char)(arc-1));
+  for(;x+16<=x1;x+=16){
+    const uint8_t* p=row+x;
+    __m128i v=_mm_loadu_si128((const __m128i*)p);
+    __m128i hi=_mm_xor_si128(_mm_adds_epu8(v,vt),delta);
+    __m128i lo=_mm_xor_si128(_mm_subs_epu8(v,vt),delta);
+
+    // an arc of 9 or more covers two neighbouring compass points
+    __m128i c[4];
+    for(int q1=0;q1<4;q1++)c[q1]=load_signed(p+off[4*q1],delta);
+    __m128i any=_mm_setzero_si128();
+    for(int q1=0;q1<4;q1++){
+      __m128i a=c[q1], b=c[(q1+1)&3];
+      any=_mm_or_si128(any,_mm_and_si128(_mm_cmpgt_epi8(a,hi),_mm_cmpgt_epi8(b,hi)));
+      any=_mm_or_si128(any,_mm_and_si128(_mm_cmpgt_epi8(lo,a),_mm_cmpgt_epi8(lo,b)));
+    }
+    if(!_mm_movemask_epi8(any))continue;
+
+    // lengths of the runs of bright and dark pixels around the circle, and their maximum
+    __m128i nb=_mm_setzero_si128(), nd=_mm_setzero_si128(), mb=nb, md=nb;
+    for(int k=0;k<16+arc-1;k++){
+      __m128i e=load_signed(p+off[k&15],delta);
+      __m128i b=_mm_cmpgt_epi8(e,hi), d=_mm_cmpgt_epi8(lo,e);
+      nb=_mm_and_si128(_mm_sub_epi8(nb,b),b);
+      nd=_mm_and_si128(_mm_sub_epi8(nd,d),d);
+      mb=_mm_max_epu8(mb,nb);
+      md=_mm_max_epu8(md,nd);
+    }
+    int bits=_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_max_epu8(mb,md),vk));
+    while(bits){
+      Corner f;
+      f.x=x+__builtin_ctz(bits);
+      f.y=y;
+      f.response=fast_score(row+f.x,off,t);
+      out.push_back(f);
+      bits&=bits-1;
+    }
+  }
+#endif
+  for(;x<x1;x++){
+    const uint8_t* p=row+x;
+    if(!segment_test(p,off,arc,*p-t,*p+t))continue;
+    Corner f;
+    f.x=x;
+    f.y=y;
+    f.response=fast_score(p,off,t);
+    out.push_back(f);
+  }
+}
+
+vector<Corner> fast_corners(const Image& im, float thresh, int arc){
+  assert(im.c==1);
+  assert(arc>=9 && arc<=16);
+  vector<Corner> r;
+  if(im.w<=2*FAST_BORDER || im.h<=2*FAST_BORDER)return r;
+
+  vector<uint8_t> g((size_t)im.w*im.h);
+  parallel_for_ranges(0,im.h,64,[&](int y0, int y1){
+    for(int i=y0*im.w;i<y1*im.w;i++)g[i]=(uint8_t)lroundf(min(max(im.data[i],0.f),1.f)*255);
+  });
+  int t=min(max((int)lroundf(thresh*255),1),255);
+  int off[16];
+  for(int k=0;k<16;k++)off[k]=CIRCLE[k][1]*im.w+CIRCLE[k][0];
+
+  int rows=im.h-2*FAST_BORDER;
+  vector<vector<Corner>> found(rows);
+  parallel_for_ranges(0,rows,16,[&](int lo, int hi){
+    for(int i=lo;i<hi;i++)row_corners(g.data(),im.w,i+FAST_BORDER,FAST_BORDER,im.w-FAST_BORDER,off,arc,t,found[i]);
+  });
+  for(auto&e1:found)r.insert(r.end(),e1.begin(),e1.end());
+  return r;
+}
+
+float harris_block_score(const Image& im, int x, int y){
+  assert(im.c==1);
+  float a=0, b=0, c=0;
+  for(int dy=-3;dy<=3;dy++)for(int dx=-3;dx<=3;dx++){
+    int px=x+dx, py=y+dy;
+    // sobel, as make_gx_filter and make_gy_filter
+    float gx=im.clamped_pixel(px+1,py-1)+2*im.clamped_pixel(px+1,py)+im.clamped_pixel(px+1,py+1)
+            -im.clamped_pixel(px-1,py-1)-2*im.clamped_pixel(px-1,py)-im.clamped_pixel(px-1,py+1);
+    float gy=im.clamped_pixel(px-1,py+1)+2*im.clamped_pixel(px,py+1)+im.clamped_pixel(px+1,py+1)
+            -im.clamped_pixel(px-1,py-1)-2*im.clamped_pixel(px,py-1)-im.clamped_pixel(px+1,py-1);
+    a+=gx*gx;
+    b+=gy*gy;
+    c+=gx*gy;
+  }
+  return HarrisMeasure()(a/49,b/49,c/49);
+}
+
+vector<Corner> nms_corners(const vector<Corner>& c, int w, int h, int nms){
+  // the responses as an image: the neighbours of a corner are looked up, not searched
+  Image s(w,h,1);
+  for(auto&e1:c)if(e1.response>0)s(e1.x,e1.y)=e1.response;
+
+  vector<char> keep(c.size(),0);
+  parallel_for(0,c.size(),[&](int i){
+    const Corner& f=c[i];
+    if(f.response<=0)return;
+    for(int y=max(f.y-nms,0);y<=min(f.y+nms,h-1);y++){
+      const float* row=s.RowPtr(y,0);
+      for(int x=max(f.x-nms,0);x<=min(f.x+nms,w-1);x++)if(row[x]>f.response)return;
+    }
+    keep[i]=1;
+  });
+  vector<Corner> r;
+  for(size_t q1=0;q1<c.size();q1++)if(keep[q1])r.push_back(c[q1]);
+  return r;
+}
+
+
+// FAST corners, described like the corners of detect_corners.
+// The features are taken from the feature cache when they are there.
+vector<Descriptor> fast_detector(const Image& im, float thresh, int arc, int window, int nms, bool harris_score, int budget, int selection){
+  vector<double> params={thresh, (double)arc, (double)window, (double)nms, (double)harris_score};
+  if(budget>0){ params.push_back(budget); params.push_back(selection); }
+  return cached_features(im, "fast", params, [&](){
+    Image gray = im.c==1 ? im : rgb_to_grayscale(im);
+    vector<Corner> c = fast_corners(gray, thresh, arc);
+    if(harris_score)parallel_for(0,c.size(),[&](int i){ c[i].response=harris_block_score(gray,c[i].x,c[i].y); });
+    c = nms_corners(c, gray.w, gray.h, nms);
+    if(budget>0)c = select_corners(c, budget, selection, gray.w, gray.h);
+    return describe_corners(im, c, window);
+  });
+}
+
+// FAST in the feature registry ("fast": arc is 9 or 12, method 1 scores with Harris).
+class FastDetector : public FeatureDetector {
+ public:
+  explicit FastDetector(const DetectorParams& p) : p(p) {}
+  using FeatureDetector::detect;
+  vector<Descriptor> detect(const Image& im) const override {
+    return fast_detector(im, p.thresh, p.arc, p.window, p.nms, p.method==1, p.budget, p.selection);
+  }
+ private:
+  DetectorParams p;
+};
+
+static DetectorRegistration fast_registration("fast", [](const DetectorParams& p){
+  return unique_ptr<FeatureDetector>(new FastDetector(p));
+});
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+#include "image.h"
+
+using namespace std;
+
+// FAST corners (Rosten and Drummond): pixel p is a corner if 'arc' contiguous pixels of
+// the 16 on the circle of radius 3 around it are all brighter than p+thresh or all darker
+// than p-thresh. im: grayscale in [0,1], compared at 8 bits. arc: 9 (FAST-9) or 12 (FAST-12).
+// The response is the FAST score: the larger of the sums by which the bright pixels exceed p+thresh
+// and the dark ones fall below p-thresh. No smoothing and no response image are needed;
+// with SSE2 the segment test runs on 16 pixels at a time, rows in parallel.
+vector<Corner> fast_corners(const Image& im, float thresh, int arc=9);
+
+// returns: Harris response of the gradients in the 7x7 block around (x,y) of im (grayscale).
+float harris_block_score(const Image& im, int x, int y);
+
+// returns: the corners with no other corner within nms pixels with a larger response, as
+// nms_image and detect_corners would keep them from an image of the responses. Corners
+// with response <= 0 are dropped. w, h: size of the image.
+vector<Corner> nms_corners(const vector<Corner>& c, int w, int h, int nms);
@@ -0,0 +1,107 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cassert>
+
+#include "image.h"
+#include "fast_hessian.h"
+#include "cornerness.h"
+
+using namespace std;
+
+// Filter sizes per octave.
+static const int FH_LAYERS=4;
+// Relative weight of Dxy, which balances the box approximation of the gaussian derivatives.
+static const float FH_DXY_WEIGHT=0.9f;
+
+IntegralImage::IntegralImage(const Image& im, int channel) : w(im.w), h(im.h), s((size_t)(im.w+1)*(im.h+1),0.) {
+  assert(channel>=0 && channel<im.c);
+  // rows: prefix sums
+  parallel_for_ranges(0,h,64,[&](int y0, int y1){
+    for(int y=y0;y<y1;y++){
+      const float* src=im.RowPtr(y,channel);
+      double* dst=s.data()+(size_t)(y+1)*(w+1);
+      double sum=0;
+      for(int x=0;x<w;x++)dst[x+1]=(sum+=src[x]);
+    }
+  });
+  // columns: running sums down the rows, in strips of columns
+  parallel_for_ranges(1,w+1,256,[&](int x0, int x1){
+    for(int y=1;y<h;y++){
+      const double* up=s.data()+(size_t)y*(w+1);
+      double* dst=s.data()+(size_t)(y+1)*(w+1);
+      for(int x=x0;x<x1;x++)dst[x]+=up[x];
+    }
+  });
+}
+
+// Size of filter i of octave o when the first filter is L0 (9, 15, 21... for L0=9).
+static int filter_size(int L0, int o, int i){
+  return L0+6*((1<<o)*(i+1)-1);
+}
+
+// returns: normalized determinant of the Hessian at (x,y) with filter size L.
+static float hessian_response(const IntegralImage& ii, int x, int y, int L){
+  int l=L/3, b=(L-1)/2;
+  double dxx=ii.box(x-b,y-l+1,x+b+1,y+l)-3*ii.box(x-l/2,y-l+1,x-l/2+l,y+l);
+  double dyy=ii.box(x-l+1,y-b,x+l,y+b+1)-3*ii.box(x-l+1,y-l/2,x+l,y-l/2+l);
+  double dxy=ii.box(x+1,y-l,x+l+1,y)+ii.box(x-l,y+1,x,y+l+1)
+            -ii.box(x-l,y-l,x,y)-ii.box(x+1,y+1,x+l+1,y+l+1);
+  double norm=1./((double)L*L);
+  return HessianDetMeasure(FH_DXY_WEIGHT)(dxx*norm,dyy*norm,dxy*norm);
+}
+
+vector<ScaleKeypoint> fast_hessian_extrema(const Image& im, float sigma, float thresh, int octaves){
+  assert(im.c==1);
+  IntegralImage ii(im);
+  // the 9x9 filter has sigma 1.2; sizes are 6k+3
+  int L0=max(9,6*(int)lround((9*sigma/1.2f-3)/6)+3);
+
+  vector<ScaleKeypoint> r;
+  for(int o=0;o<octaves;o++){
+    int step=1<<o;
+    int gw=im.w/step, gh=im.h/step;
+    // the largest filter of the octave must fit
+    int border=(filter_size(L0,o,FH_LAYERS-1)/2)/step+1;
+    if(gw<=2*border || gh<=2*border)break;
+
+    vector<Image> layer(FH_LAYERS);
+    for(auto&e1:layer)e1=Image(gw,gh,1);
+    parallel_for_ranges(0,FH_LAYERS*gh,16,[&](int lo, int hi){
+      for(int row=lo;row<hi;row++){
+        int i=row/gh, y=row%gh;
+        if(y<border || y>=gh-border)continue;
+        int L=filter_size(L0,o,i);
+        float* dst=layer[i].RowPtr(y,0);
+        for(int x=border;x<gw-border;x++)dst[x]=hessian_response(ii,x*step,y*step,L);
+      }
+    });
+
+    // maxima among the 26 neighbours, in the middle layers
+    vector<vector<ScaleKeypoint>> found(gh);
+    parallel_for(border+1,gh-border-1,[&](int y){
+      for(int i=1;i<FH_LAYERS-1;i++)for(int x=border+1;x<gw-border-1;x++){
+        float v=layer[i](x,y);
+        if(v<=thresh)continue;
+        bool max3=true;
+        for(int l=i-1;l<=i+1 && max3;l++)for(int dy=-1;dy<=1 && max3;dy++)for(int dx=-1;dx<=1;dx++){
+          if(l==i && !dx && !dy)continue;
+          if(layer[l](x+dx,y+dy)>=v){ max3=false; break; }
+        }
+        if(!max3)continue;
+        ScaleKeypoint k;
+        k.octave=o;
+        k.layer=i;
+        k.ox=x;
+        k.oy=y;
+        k.x=x*step;
+        k.y=y*step;
+        k.sigma=1.2f*filter_size(L0,o,i)/9;
+        k.response=v;
+        found[y].push_back(k);
+      }
+    });
+    for(auto&e1:found)r.insert(r.end(),e1.begin(),e1.end());
+  }
+  return r;
+}
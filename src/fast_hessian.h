@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "image.h"
+#include "scale_space.h"
+
+using namespace std;
+
+// Summed area table of a single channel image: the sum of any box costs 4 reads.
+// Sums are doubles so that large images keep the precision of their pixels.
+class IntegralImage
+  {
+  public:
+
+  explicit IntegralImage(const Image& im, int channel=0);
+
+  // returns: sum of the pixels in [x0,x1) x [y0,y1), the box clamped to the image.
+  double box(int x0, int y0, int x1, int y1) const
+    {
+    x0=min(max(x0,0),w); x1=min(max(x1,0),w);
+    y0=min(max(y0,0),h); y1=min(max(y1,0),h);
+    if(x1<=x0 || y1<=y0)return 0;
+    const double* r0=s.data()+(size_t)y0*(w+1);
+    const double* r1=s.data()+(size_t)y1*(w+1);
+    return r1[x1]-r1[x0]-r0[x1]+r0[x0];
+    }
+
+  int w=0, h=0;
+
+  private:
+
+  vector<double> s;  // (w+1) x (h+1), first row and column are 0
+  };
+
+// Fast-Hessian detector (Bay et al., SURF): the determinant of the Hessian is
+// approximated with box filters on an integral image, so a filter costs the same
+// at any size and the scales are filter sizes instead of blurred images.
+// Octave o holds 4 filter sizes sampled every 2^o pixels; the first filter has
+// blur sigma (at least 1.2, the 9x9 filter). Keypoints are the maxima of the
+// normalized response above thresh among their 26 neighbours in space and size.
+// im: grayscale. The ScaleKeypoint layer is the filter of the octave (1 or 2), the
+// response is the determinant; the layers of an octave are computed in parallel by rows.
+vector<ScaleKeypoint> fast_hessian_extrema(const Image& im, float sigma, float thresh, int octaves=4);
@@ -0,0 +1,229 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+#include <atomic>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "image.h"
+#include "feature_cache.h"
+#include "mapped_file.h"
+#include "matrix.h"
+
+using namespace std;
+
+static const char FEATURE_MAGIC[8]={'U','W','F','E','A','T','S',0};
+static const char MATCH_MAGIC[8]  ={'U','W','M','A','T','C','H',0};
+static const uint32_t VERSION=3;
+
+// Every entry: this header, then 'count' records whose layout depends on the kind of entry.
+// A feature record: x, y (double), scale, angle, then the 'dims' floats of the descriptor.
+struct CacheHeader
+  {
+  char magic[8];
+  uint32_t version;
+  uint32_t dims;      // features: length of the descriptors
+  uint64_t count;
+  uint64_t checksum;  // of what follows the header
+  };
+static_assert(sizeof(CacheHeader)==32, "the header must be 32 bytes");
+
+// Maps an entry and checks it. body, n: what follows the header.
+static bool read_entry(const string& path, const char* magic, MappedFile& f, CacheHeader& hd, const unsigned char*& body, size_t& n){
+  if(!f.open(path) || f.size<sizeof(CacheHeader))return false;
+  memcpy(&hd,f.data,sizeof(hd));
+  if(memcmp(hd.magic,magic,8) || hd.version!=VERSION)return false;
+  body=f.data+sizeof(hd);
+  n=f.size-sizeof(hd);
+  return hash_bytes(body,n)==hd.checksum;
+}
+
+// Writes an entry aside and renames it into place, which is atomic.
+static bool write_entry(const string& path, const char* magic, CacheHeader hd, const vector<unsigned char>& body){
+  memcpy(hd.magic,magic,8);
+  hd.version=VERSION;
+  hd.checksum=hash_bytes(body.data(),body.size());
+  static atomic<int> counter{0};
+  string tmp=path+".tmp."+to_string(getpid())+"."+to_string(counter++);
+  FILE* f=fopen(tmp.c_str(),"wb");
+  if(!f)return false;
+  fwrite(&hd,sizeof(hd),1,f);
+  if(body.size())fwrite(body.data(),1,body.size(),f);
+  bool ok=!ferror(f);
+  ok=!fclose(f) && ok;
+  if(ok)ok=!rename(tmp.c_str(),path.c_str());
+  if(!ok)remove(tmp.c_str());
+  return ok;
+}
+
+static string hex_key(const string& prefix, unsigned long long h){
+  char hex[17];
+  snprintf(hex,sizeof(hex),"%016llx",h);
+  return prefix+"-"+hex;
+}
+
+static string cache_dir_from_env(void){
+  const char* env=getenv("UWIMG_CACHE_DIR");
+  return string(env?env:"");
+}
+
+unsigned long long image_hash(const Image& im){
+  size_t plane=(size_t)im.w*im.h;
+  vector<unsigned long long> planes(im.c);
+  parallel_for(0,im.c,[&](int k){ planes[k]=hash_bytes(im.data+plane*k,plane*sizeof(float)); });
+  int sizes[3]={im.w,im.h,im.c};
+  unsigned long long h=hash_bytes(sizes,sizeof(sizes));
+  for(auto e1:planes)h=hash_bytes(&e1,sizeof(e1),h);
+  return h;
+}
+
+unsigned long long features_hash(const vector<Descriptor>& d){
+  unsigned long long h=hash_bytes(nullptr,0,d.size());
+  for(auto&e1:d){
+    double p[4]={e1.p.x,e1.p.y,e1.scale,e1.angle};
+    h=hash_bytes(p,sizeof(p),h);
+    h=hash_bytes(e1.data.data(),e1.data.size()*sizeof(float),h);
+  }
+  return h;
+}
+
+// Creates the directory and its parents.
+static void make_dirs(const string& dir){
+  for(size_t q1=1;q1<=dir.size();q1++)
+    if(q1==dir.size() || dir[q1]=='/')mkdir(dir.substr(0,q1).c_str(),0755);
+}
+
+FeatureCache::FeatureCache(const string& dir) : dir(dir) {
+  if(enabled())make_dirs(dir);
+}
+
+FeatureCache& FeatureCache::instance(void){
+  static FeatureCache cache(cache_dir_from_env());
+  return cache;
+}
+
+string FeatureCache::key(const Image& im, const string& detector, const vector<double>& params){
+  unsigned long long h=image_hash(im);
+  h=hash_bytes(detector.data(),detector.size(),h);
+  if(params.size())h=hash_bytes(params.data(),params.size()*sizeof(double),h);
+  return hex_key(detector,h);
+}
+
+bool FeatureCache::load(const string& key, vector<Descriptor>& d) const {
+  if(!enabled())return false;
+  MappedFile f;
+  CacheHeader hd;
+  const unsigned char* p;
+  size_t n;
+  if(!read_entry(path(key),FEATURE_MAGIC,f,hd,p,n))return false;
+  size_t record=2*sizeof(double)+(hd.dims+2)*sizeof(float);
+  if(hd.count>n/record || hd.count*record!=n)return false;
+
+  d.assign(hd.count,Descriptor());
+  for(auto&e1:d){
+    memcpy(&e1.p.x,p,sizeof(double));
+    memcpy(&e1.p.y,p+sizeof(double),sizeof(double));
+    memcpy(&e1.scale,p+2*sizeof(double),sizeof(float));
+    memcpy(&e1.angle,p+2*sizeof(double)+sizeof(float),sizeof(float));
+    e1.data.resize(hd.dims);
+    if(hd.dims)memcpy(e1.data.data(),p+2*sizeof(double)+2*sizeof(float),hd.dims*sizeof(float));
+    p+=record;
+  }
+  return true;
+}
+
+bool FeatureCache::store(const string& key, const vector<Descriptor>& d) const {
+  if(!enabled())return false;
+  CacheHeader hd;
+  memset(&hd,0,sizeof(hd));
+  hd.dims=d.empty()?0:d[0].data.size();
+  hd.count=d.size();
+  for(auto&e1:d)if(e1.data.size()!=hd.dims)return false;  // only uniform descriptors
+
+  size_t record=2*sizeof(double)+(hd.dims+2)*sizeof(float);
+  vector<unsigned char> body(record*d.size());
+  unsigned char* p=body.data();
+  for(auto&e1:d){
+    memcpy(p,&e1.p.x,sizeof(double));
+    memcpy(p+sizeof(double),&e1.p.y,sizeof(double));
+    memcpy(p+2*sizeof(double),&e1.scale,sizeof(float));
+    memcpy(p+2*sizeof(double)+sizeof(float),&e1.angle,sizeof(float));
+    if(hd.dims)memcpy(p+2*sizeof(double)+2*sizeof(float),e1.data.data(),hd.dims*sizeof(float));
+    p+=record;
+  }
+  return write_entry(path(key),FEATURE_MAGIC,hd,body);
+}
+
+
+// A match entry: the 9 coefficients of H, then per match the index of its two
+// features (int32) and their distance (float).
+MatchCache::MatchCache(const string& dir) : dir(dir) {
+  if(enabled())make_dirs(dir);
+}
+
+MatchCache& MatchCache::instance(void){
+  static MatchCache cache(cache_dir_from_env());
+  return cache;
+}
+
+string MatchCache::key(const vector<Descriptor>& a, const vector<Descriptor>& b, float inlier_thresh, int iters, int cutoff, unsigned seed){
+  unsigned long long features[2]={features_hash(a),features_hash(b)};
+  double params[4]={inlier_thresh,(double)iters,(double)cutoff,(double)seed};
+  return hex_key("match",hash_bytes(params,sizeof(params),hash_bytes(features,sizeof(features))));
+}
+
+bool MatchCache::load(const string& key, const vector<Descriptor>& a, const vector<Descriptor>& b, vector<Match>& m, Matrix& H) const {
+  if(!enabled())return false;
+  MappedFile f;
+  CacheHeader hd;
+  const unsigned char* p;
+  size_t n;
+  if(!read_entry(path(key),MATCH_MAGIC,f,hd,p,n))return false;
+  const size_t record=2*sizeof(int32_t)+sizeof(float);
+  if(n<9*sizeof(double) || hd.count>(n-9*sizeof(double))/record || 9*sizeof(double)+hd.count*record!=n)return false;
+
+  double h[9];
+  memcpy(h,p,sizeof(h));
+  p+=sizeof(h);
+  vector<Match> r(hd.count);
+  for(auto&e1:r){
+    int32_t ia, ib;
+    memcpy(&ia,p,4);
+    memcpy(&ib,p+4,4);
+    memcpy(&e1.distance,p+8,4);
+    if(ia<0 || ib<0 || ia>=(int)a.size() || ib>=(int)b.size())return false;
+    e1.a=&a[ia];
+    e1.b=&b[ib];
+    p+=record;
+  }
+  H=Matrix(3,3);
+  for(int q1=0;q1<9;q1++)H(q1/3,q1%3)=h[q1];
+  m=move(r);
+  return true;
+}
+
+bool MatchCache::store(const string& key, const vector<Descriptor>& a, const vector<Descriptor>& b, const vector<Match>& m, const Matrix& H) const {
+  if(!enabled())return false;
+  CacheHeader hd;
+  memset(&hd,0,sizeof(hd));
+  hd.count=m.size();
+  const size_t record=2*sizeof(int32_t)+sizeof(float);
+  vector<unsigned char> body(9*sizeof(double)+record*m.size());
+  unsigned char* p=body.data();
+  for(int q1=0;q1<9;q1++,p+=sizeof(double)){
+    double v=H(q1/3,q1%3);
+    memcpy(p,&v,sizeof(double));
+  }
+  for(auto&e1:m){
+    int32_t ia=e1.a-a.data(), ib=e1.b-b.data();
+    assert(ia>=0 && ia<(int)a.size() && ib>=0 && ib<(int)b.size());
+    memcpy(p,&ia,4);
+    memcpy(p+4,&ib,4);
+    memcpy(p+8,&e1.distance,4);
+    p+=record;
+  }
+  return write_entry(path(key),MATCH_MAGIC,hd,body);
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "matrix.h"
+
+using namespace std;
+
+// returns: hash of the sizes and pixels of im.
+unsigned long long image_hash(const Image& im);
+
+// returns: hash of the points, scales, angles and descriptors of d.
+unsigned long long features_hash(const vector<Descriptor>& d);
+
+// On-disk cache of detected features, shared by the runs and the processes using
+// the same directory. An entry is keyed by the hash of the image, the name of the
+// detector and its parameters, and holds the points and descriptors in a compact
+// binary file. Entries are read through a memory mapping and written to a temporary
+// file renamed into place: a reader sees a whole entry or none, even while another
+// process is writing the same one. Corrupted entries are recomputed.
+class FeatureCache
+  {
+  public:
+
+  // dir: where the entries are, created if missing. Empty: the cache is disabled.
+  explicit FeatureCache(const string& dir="");
+
+  // The cache of the process, in $UWIMG_CACHE_DIR (disabled if it is not set).
+  static FeatureCache& instance(void);
+
+  bool enabled(void) const { return !dir.empty(); }
+
+  // returns: the key of the features of im found by 'detector' with 'params'.
+  static string key(const Image& im, const string& detector, const vector<double>& params);
+
+  // returns: false if the entry is missing or corrupted.
+  bool load(const string& key, vector<Descriptor>& d) const;
+
+  // returns: false if the entry could not be written.
+  bool store(const string& key, const vector<Descriptor>& d) const;
+
+  // returns: the cached features, or the ones found by 'detect' (which are then stored).
+  template<typename F>
+  vector<Descriptor> get(const Image& im, const string& detector, const vector<double>& params, F detect) const
+    {
+    if(!enabled())return detect();
+    string k=key(im,detector,params);
+    vector<Descriptor> d;
+    if(load(k,d))return d;
+    d=detect();
+    store(k,d);
+    return d;
+    }
+
+  // returns: the file of an entry.
+  string path(const string& key) const { return dir+"/"+key+".feat"; }
+
+  private:
+
+  string dir;
+  };
+
+// Features of im, found by 'detect' or taken from the cache of the process.
+template<typename F>
+vector<Descriptor> cached_features(const Image& im, const string& detector, const vector<double>& params, F detect)
+  {
+  return FeatureCache::instance().get(im,detector,params,detect);
+  }
+
+// On-disk cache of pair registrations: the matches between two sets of features
+// (as indices into them) and the homography RANSAC found, keyed by the hashes of
+// the two sets and the RANSAC parameters. Same directory and same safety as FeatureCache.
+class MatchCache
+  {
+  public:
+
+  explicit MatchCache(const string& dir="");
+
+  // The cache of the process, in $UWIMG_CACHE_DIR (disabled if it is not set).
+  static MatchCache& instance(void);
+
+  bool enabled(void) const { return !dir.empty(); }
+
+  static string key(const vector<Descriptor>& a, const vector<Descriptor>& b, float inlier_thresh, int iters, int cutoff, unsigned seed=0);
+
+  // The matches point into a and b, which must be the features of the key.
+  // returns: false if the entry is missing or corrupted.
+  bool load(const string& key, const vector<Descriptor>& a, const vector<Descriptor>& b, vector<Match>& m, Matrix& H) const;
+
+  bool store(const string& key, const vector<Descriptor>& a, const vector<Descriptor>& b, const vector<Match>& m, const Matrix& H) const;
+
+  string path(const string& key) const { return dir+"/"+key+".match"; }
+
+  private:
+
+  string dir;
+  };
@@ -0,0 +1,160 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cassert>
+
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include "image.h"
+#include "feature_registry.h"
+
+using namespace std;
+
+vector<vector<Descriptor>> FeatureDetector::detect(const vector<const Image*>& ims) const {
+  vector<vector<Descriptor>> d(ims.size());
+  parallel_for(0,ims.size(),[&](int i){ d[i]=detect(*ims[i]); });
+  return d;
+}
+
+vector<Descriptor> DescriptorExtractor::describe(const Image& im, const vector<Descriptor>& k) const {
+  vector<Descriptor> d(k.size());
+  parallel_for(0,k.size(),[&](int i){ d[i]=describe(im,k[i]); });
+  return d;
+}
+
+// The registries are built on first use, so registrations from static objects of
+// any file of the library find them ready.
+template<typename F>
+struct Registry
+  {
+  mutex m;
+  map<string,F> factories;
+
+  void add(const string& name, F f)
+    {
+    lock_guard<mutex> lock(m);
+    factories[name]=f;
+    }
+
+  F find(const string& name, const char* what)
+    {
+    lock_guard<mutex> lock(m);
+    auto it=factories.find(name);
+    if(it==factories.end())throw invalid_argument(string("unknown ")+what+" '"+name+"'");
+    return it->second;
+    }
+
+  vector<string> names(void)
+    {
+    lock_guard<mutex> lock(m);
+    vector<string> r;
+    for(auto&e1:factories)r.push_back(e1.first);
+    return r;
+    }
+  };
+
+static Registry<DetectorFactory>& detectors(void){
+  static Registry<DetectorFactory> r;
+  return r;
+}
+
+static Registry<ExtractorFactory>& extractors(void){
+  static Registry<ExtractorFactory> r;
+  return r;
+}
+
+void register_detector (const string& name, DetectorFactory f){ detectors().add(name,f); }
+void register_extractor(const string& name, ExtractorFactory f){ extractors().add(name,f); }
+
+vector<string> detector_names(void){ return detectors().names(); }
+vector<string> extractor_names(void){ return extractors().names(); }
+
+// A detector whose keypoints are described by another extractor.
+class DescribedDetector : public FeatureDetector {
+ public:
+  DescribedDetector(unique_ptr<FeatureDetector> d, unique_ptr<DescriptorExtractor> e) : d(move(d)), e(move(e)) {}
+  using FeatureDetector::detect;
+  vector<Descriptor> detect(const Image& im) const override { return e->describe(im,d->detect(im)); }
+ private:
+  unique_ptr<FeatureDetector> d;
+  unique_ptr<DescriptorExtractor> e;
+};
+
+unique_ptr<FeatureDetector> make_detector(const string& name, const DetectorParams& p, const string& extractor){
+  unique_ptr<FeatureDetector> d=detectors().find(name,"detector")(p);
+  if(extractor.empty())return d;
+  return unique_ptr<FeatureDetector>(new DescribedDetector(move(d),make_extractor(extractor,p)));
+}
+
+unique_ptr<DescriptorExtractor> make_extractor(const string& name, const DetectorParams& p){
+  return extractors().find(name,"extractor")(p);
+}
+
+
+// The window x window patch around the keypoint, less its center (describe_index).
+class PatchExtractor : public DescriptorExtractor {
+ public:
+  explicit PatchExtractor(int window) : window(window) {}
+  using DescriptorExtractor::describe;
+  Descriptor describe(const Image& im, const Descriptor& k) const override {
+    Descriptor d=describe_index(im,lround(k.p.x),lround(k.p.y),window);
+    d.p=k.p;
+    d.scale=k.scale;
+    return d;
+  }
+ private:
+  int window;
+};
+
+static ExtractorRegistration patch_extractor("patch", [](const DetectorParams& p){
+  return unique_ptr<DescriptorExtractor>(new PatchExtractor(p.window));
+});
+
+
+vector<Descriptor> describe_features(const Image& im, const vector<Descriptor>& d, int window, const DescriptorExtractor* e){
+  PatchExtractor patch(window);
+  if(!e)e=&patch;
+  size_t side=2*(window/2)+1, n=side*side*im.c;
+  vector<Descriptor> r=d;
+  parallel_for(0,r.size(),[&](int i){
+    if(r[i].data.size()!=n)r[i]=e->describe(im,r[i]);
+  });
+  return r;
+}
+
+
+// Find and draw the features of an image.
+Image detect_and_draw_features(const Image& im, const FeatureDetector& d){
+  TIME(1);
+  vector<Descriptor> f=d.detect(im);
+  printf("Numero di Descrittori: %zu\n", f.size());
+  return mark_corners(im, f);
+}
+
+// Find and draw the matches between the features of two images.
+Image find_and_draw_feature_matches(const Image& a, const Image& b, const FeatureDetector& d){
+  TIME(1);
+  vector<vector<Descriptor>> f=d.detect({&a,&b});
+  vector<Match> m=match_descriptors(f[0], f[1]);
+  printf("Numero di Match: %zu\n", m.size());
+  return draw_matches(mark_corners(a, f[0]), mark_corners(b, f[1]), m, {});
+}
+
+// Draw the matches that are inliers of the homography RANSAC finds.
+Image draw_feature_inliers(const Image& a, const Image& b, const FeatureDetector& d, float inlier_thresh, int iters, int cutoff){
+  TIME(1);
+  vector<vector<Descriptor>> f=d.detect({&a,&b});
+  vector<Match> m;
+  Matrix Hba=estimate_homography(f[0], f[1], inlier_thresh, iters, cutoff, &m);
+  return draw_inliers(a, b, Hba, m, inlier_thresh);
+}
+
+// Create a panorama between two images with the features of d.
+Image panorama_image(const Image& a, const Image& b, const FeatureDetector& d, float inlier_thresh, int iters, int cutoff, float acoeff){
+  TIME(1);
+  vector<vector<Descriptor>> f=d.detect({&a,&b});
+  Matrix Hba=estimate_homography(f[0], f[1], inlier_thresh, iters, cutoff);
+  return combine_images(a, b, Hba, acoeff);
+}
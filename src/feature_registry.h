@@ -0,0 +1,119 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+using namespace std;
+
+// How a keypoint's orientation is found. ORIENT_CENTROID: direction of the intensity centroid
+// of the disc around it (as ORB). ORIENT_HISTOGRAM: peak of the histogram of its gradient
+// directions weighted by magnitude (as SIFT).
+enum OrientationMethod { ORIENT_CENTROID=0, ORIENT_HISTOGRAM=1 };
+
+// Parameters of a feature detector. Every detector reads the ones it uses:
+// sigma: blur of the structure matrix or of the first scale. thresh: response threshold.
+// window: side of the descriptor patch. nms: radius of the non-maximum suppression.
+// method: variant of the detector (the cornerness of "harris" and "fhh", adaptive threshold for "shi-tomasi",
+// Harris scores for "fast"). octaves, scales: size of the scale space of "scale-space".
+// arc: contiguous pixels of the segment test of "fast" (9 or 12).
+// budget, selection: if budget > 0 the corner detectors keep at most budget corners,
+// chosen by selection (a CornerSelection); the scale-space detectors keep them all.
+// subpixel: the corner detectors but "fast" move their points to the subpixel peak of the
+// response ("dog" always refines its keypoints).
+// orientation: how "oriented-patch" finds the orientation of a keypoint (an OrientationMethod).
+struct DetectorParams
+  {
+  float sigma=2.f;
+  float thresh=0.05f;
+  int window=7;
+  int nms=3;
+  int method=0;
+  int octaves=4;
+  int scales=3;
+  int arc=9;
+  int budget=0;
+  int selection=SELECT_ANMS;
+  bool subpixel=false;
+  int orientation=ORIENT_CENTROID;
+  };
+
+// Finds the features of an image: keypoints with their descriptors.
+class FeatureDetector
+  {
+  public:
+
+  virtual ~FeatureDetector() {}
+
+  // returns: the features of im.
+  virtual vector<Descriptor> detect(const Image& im) const = 0;
+
+  // returns: the features of every image. The images are detected in parallel, and the
+  // stages of every detector split their image across the same pool by rows.
+  // The images are taken by pointer, so they are not copied.
+  vector<vector<Descriptor>> detect(const vector<const Image*>& ims) const;
+  };
+
+// Describes given keypoints of an image.
+class DescriptorExtractor
+  {
+  public:
+
+  virtual ~DescriptorExtractor() {}
+
+  // returns: the descriptor of im at keypoint k (point and scale of k are kept).
+  virtual Descriptor describe(const Image& im, const Descriptor& k) const = 0;
+
+  // returns: the descriptors of all keypoints, in parallel.
+  vector<Descriptor> describe(const Image& im, const vector<Descriptor>& k) const;
+  };
+
+// returns: the features d of im with window x window patches: the ones described with another
+// window are described again, by e (the "patch" extractor if null). Features carried through
+// the merges of a panorama keep the patches of the detection that found them.
+vector<Descriptor> describe_features(const Image& im, const vector<Descriptor>& d, int window, const DescriptorExtractor* e=nullptr);
+
+// Registries of detectors and extractors by name. The detectors of the library register
+// themselves: "harris", "shi-tomasi", "fhh", "log", "dog", "scale-space", "fast"; extractors: "patch", "oriented-patch".
+typedef function<unique_ptr<FeatureDetector>(const DetectorParams&)> DetectorFactory;
+typedef function<unique_ptr<DescriptorExtractor>(const DetectorParams&)> ExtractorFactory;
+
+void register_detector (const string& name, DetectorFactory f);
+void register_extractor(const string& name, ExtractorFactory f);
+
+// A static DetectorRegistration registers a detector when the library is loaded.
+struct DetectorRegistration
+  {
+  DetectorRegistration(const string& name, DetectorFactory f) { register_detector(name,f); }
+  };
+
+struct ExtractorRegistration
+  {
+  ExtractorRegistration(const string& name, ExtractorFactory f) { register_extractor(name,f); }
+  };
+
+// returns: the detector called name. With an extractor, the keypoints of the detector
+// are described by it instead. Throws invalid_argument for unknown names.
+unique_ptr<FeatureDetector> make_detector(const string& name, const DetectorParams& p, const string& extractor="");
+unique_ptr<DescriptorExtractor> make_extractor(const string& name, const DetectorParams& p);
+
+vector<string> detector_names(void);
+vector<string> extractor_names(void);
+
+// The two-image pipeline of every detector: a and b are detected together.
+Image detect_and_draw_features(const Image& im, const FeatureDetector& d);
+Image find_and_draw_feature_matches(const Image& a, const Image& b, const FeatureDetector& d);
+Image draw_feature_inliers(const Image& a, const Image& b, const FeatureDetector& d, float inlier_thresh, int iters, int cutoff);
+Image panorama_image(const Image& a, const Image& b, const FeatureDetector& d, float inlier_thresh, int iters, int cutoff, float acoeff);
+
+// The detectors, also called directly (features taken from the feature cache when they are there).
+// budget, selection: see detect_corners. subpixel: see describe_corners.
+vector<Descriptor> shi_tomasi_detector(const Image& im, bool is_adaptive, float sigma, float thresh, int window, int nms_size, int budget=0, int selection=0, bool subpixel=false);
+vector<Descriptor> fhh_detector(const Image& im, int method, float sigma, float thresh, int window, int nms_window, int budget=0, int selection=0, bool subpixel=false);
+vector<Descriptor> log_keypoint_detector(const Image& im, float sigma, float thresh, int window, int nms_size, int budget=0, int selection=0, bool subpixel=false);
+vector<Descriptor> dog_detector(const Image& im, float sigma, float thresh, int window, int nms_window);
+vector<Descriptor> detect_scale_space_keypoints(const Image& im, float base_sigma, float thresh, int window, int nms, int num_octaves=4, int scales_per_octave=3);
+vector<Descriptor> fast_detector(const Image& im, float thresh, int arc, int window, int nms, bool harris_score, int budget=0, int selection=0);
@@ -0,0 +1,314 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+
+#include "image.h"
+#include "matrix.h"
+#include "tiled_image.h"
+
+using namespace std;
+
+// Conditioning transform: moves pixel coordinates to roughly [-1,1] so that
+// the 8 homography parameters have comparable magnitudes inside the solver.
+static Matrix conditioning(int w, int h){
+  double s=2.0/(w+h);
+  Matrix T=Matrix::identity(3,3);
+  T(0,0)=s; T(0,2)=-s*w/2.0;
+  T(1,1)=s; T(1,2)=-s*h/2.0;
+  return T;
+}
+
+static Matrix normalize_homography(const Matrix& H){
+  Matrix N=H;
+  double d=H(2,2);
+  for(auto&e1:N)e1/=d;
+  return N;
+}
+
+
+// returns: features of every image, detected once per image.
+vector<vector<Descriptor>> detect_all_features(const vector<Image>& ims, float sigma, int corner_method, float thresh, int window, int nms){
+  vector<vector<Descriptor>> d(ims.size());
+  parallel_for(0,ims.size(),[&](int i){ d[i]=harris_corner_detector(ims[i], sigma, thresh, window, nms, corner_method); });
+  return d;
+}
+
+
+// returns: the homography from image a to image b with its inliers (none if there are not enough matches).
+PairwiseRegistration register_pair(const vector<Descriptor>& da, const vector<Descriptor>& db, int a, int b, float inlier_thresh, int iters, int cutoff){
+  PairwiseRegistration r;
+  r.a=a;
+  r.b=b;
+  vector<Match> m;
+  Matrix Hba = estimate_homography(da, db, inlier_thresh, iters, cutoff, &m);
+  if(m.size()<4)return r;
+  r.Hba = Hba;
+  for(auto&e1:model_inliers(r.Hba, m, inlier_thresh))r.inliers.push_back({e1.a->p,e1.b->p});
+  return r;
+}
+
+// returns: accepted homographies between pairs of images, estimated in parallel.
+// Only pairs with |a-b|<=max_gap are tried (max_gap<=0: all the pairs).
+vector<PairwiseRegistration> pairwise_registrations(const vector<vector<Descriptor>>& d, float inlier_thresh, int iters, int cutoff, int min_inliers, int max_gap){
+  vector<pair<int,int>> todo;
+  for(int a=0;a<(int)d.size();a++)for(int b=a+1;b<(int)d.size();b++)
+    if(max_gap<=0 || b-a<=max_gap)todo.push_back({a,b});
+
+  vector<PairwiseRegistration> all(todo.size());
+  parallel_for(0,todo.size(),[&](int i){
+    int a=todo[i].first, b=todo[i].second;
+    all[i]=register_pair(d[a], d[b], a, b, inlier_thresh, iters, cutoff);
+  });
+
+  vector<PairwiseRegistration> accepted;
+  for(auto&e1:all)if((int)e1.inliers.size()>=min_inliers){
+    printf("Pair %d-%d: %zu inliers\n",e1.a,e1.b,e1.inliers.size());
+    accepted.push_back(move(e1));
+  }
+  return accepted;
+}
+
+
+// returns: for every image the homography mapping panorama coordinates into the image,
+// chained along the maximum spanning tree of the pair graph (weights: number of inliers).
+// Images not connected to the root get an empty Matrix.
+// int& root: set to the image used as panorama reference.
+vector<Matrix> spanning_tree_homographies(int n, const vector<PairwiseRegistration>& pairs, int& root){
+  vector<Matrix> Hr(n);
+  if(n==0)return Hr;
+
+  // The reference is the most connected image.
+  vector<double> weight(n,0);
+  for(auto&e1:pairs){ weight[e1.a]+=e1.inliers.size(); weight[e1.b]+=e1.inliers.size(); }
+  root=max_element(weight.begin(),weight.end())-weight.begin();
+
+  // Prim on the pair graph, always adding the strongest edge leaving the tree.
+  vector<bool> in_tree(n,false);
+  in_tree[root]=true;
+  Hr[root]=Matrix::identity_homography();
+  while(true){
+    const PairwiseRegistration* best=nullptr;
+    for(auto&e1:pairs)if(in_tree[e1.a]!=in_tree[e1.b])
+      if(!best || e1.inliers.size()>best->inliers.size())best=&e1;
+    if(!best)break;
+
+    if(in_tree[best->a]){
+      Hr[best->b]=normalize_homography(best->Hba*Hr[best->a]);
+      in_tree[best->b]=true;
+    } else {
+      Hr[best->a]=normalize_homography(best->Hba.inverse()*Hr[best->b]);
+      in_tree[best->a]=true;
+    }
+  }
+
+  for(int q1=0;q1<n;q1++)if(!in_tree[q1])printf("Image %d is not connected to the panorama\n",q1);
+  return Hr;
+}
+
+
+// Projection of a panorama point X through the 8 parameters g of a homography (g8=1),
+// together with the jacobians w.r.t. the parameters (2x8) and w.r.t. the point (2x2).
+static void project_jacobian(const double* g, const double* X, double* r, double* Jg, double* JX){
+  double u=g[0]*X[0]+g[1]*X[1]+g[2];
+  double v=g[3]*X[0]+g[4]*X[1]+g[5];
+  double w=g[6]*X[0]+g[7]*X[1]+1;
+  double iw=1/w;
+  r[0]=u*iw;
+  r[1]=v*iw;
+  if(!Jg)return;
+
+  double* Jx=Jg;
+  double* Jy=Jg+8;
+  Jx[0]=X[0]*iw; Jx[1]=X[1]*iw; Jx[2]=iw; Jx[3]=Jx[4]=Jx[5]=0; Jx[6]=-r[0]*X[0]*iw; Jx[7]=-r[0]*X[1]*iw;
+  Jy[0]=Jy[1]=Jy[2]=0; Jy[3]=X[0]*iw; Jy[4]=X[1]*iw; Jy[5]=iw; Jy[6]=-r[1]*X[0]*iw; Jy[7]=-r[1]*X[1]*iw;
+
+  JX[0]=(g[0]-r[0]*g[6])*iw; JX[1]=(g[1]-r[0]*g[7])*iw;
+  JX[2]=(g[3]-r[1]*g[6])*iw; JX[3]=(g[4]-r[1]*g[7])*iw;
+}
+
+// Refine all the homographies jointly with Levenberg-Marquardt.
+// Every pairwise inlier is a panorama point with two observations; the reprojection error
+// is measured in image pixels. The 2x2 point blocks are eliminated with the Schur complement
+// and the reduced 8m x 8m camera system is solved with the Matrix type.
+// vector<Matrix>& Hr: panorama->image homographies, refined in place (Hr[root] stays fixed).
+// int w, h: size of the input images (for conditioning).
+// returns: final RMS reprojection error in pixels.
+double bundle_adjust(vector<Matrix>& Hr, const vector<PairwiseRegistration>& pairs, int root, int w, int h, int iters){
+  int n=Hr.size();
+  Matrix T=conditioning(w,h);
+  Matrix Tinv=T.inverse();
+  double s=T(0,0);
+
+  // Parameter blocks for the free cameras.
+  vector<int> cam(n,-1);
+  int m=0;
+  for(int q1=0;q1<n;q1++)if(q1!=root && Hr[q1].rows)cam[q1]=m++;
+
+  vector<double> g(8*n,0);
+  for(int q1=0;q1<n;q1++)if(Hr[q1].rows){
+    Matrix Hn=normalize_homography(T*Hr[q1]*Tinv);
+    for(int q2=0;q2<8;q2++)g[8*q1+q2]=Hn.data[q2];
+  }
+
+  struct Observation { int c, k; double x[2]; };
+  vector<Observation> obs;
+  vector<double> X;
+  for(auto&e1:pairs)if(Hr[e1.a].rows && Hr[e1.b].rows){
+    Matrix Ia=normalize_homography(Hr[e1.a].inverse());
+    Matrix Ib=normalize_homography(Hr[e1.b].inverse());
+    for(auto&e2:e1.inliers){
+      Point pa=project_point(Ia,e2.first);
+      Point pb=project_point(Ib,e2.second);
+      int k=X.size()/2;
+      X.push_back(s*((pa.x+pb.x)/2-w/2.0));
+      X.push_back(s*((pa.y+pb.y)/2-h/2.0));
+      obs.push_back({e1.a,k,{s*(e2.first.x -w/2.0),s*(e2.first.y -h/2.0)}});
+      obs.push_back({e1.b,k,{s*(e2.second.x-w/2.0),s*(e2.second.y-h/2.0)}});
+    }
+  }
+  int np=X.size()/2;
+  if(m==0 || np==0)return 0;
+
+  auto cost=[&](const vector<double>& g, const vector<double>& X){
+    double c=0, r[2];
+    for(auto&o:obs){
+      project_jacobian(&g[8*o.c],&X[2*o.k],r,nullptr,nullptr);
+      c+=(r[0]-o.x[0])*(r[0]-o.x[0])+(r[1]-o.x[1])*(r[1]-o.x[1]);
+    }
+    return c;
+  };
+
+  double current=cost(g,X);
+  printf("Bundle adjustment: %d cameras, %d points, initial RMS %.3f px\n",m,np,sqrt(current/obs.size())/s);
+
+  double lambda=1e-3;
+  for(int it=0;it<iters;it++){
+    // Normal equations, block by block.
+    vector<double> U(64*m,0), ec(8*m,0);
+    vector<double> V(4*np,0), ep(2*np,0);
+    vector<double> W(16*obs.size(),0);
+    for(int q1=0;q1<(int)obs.size();q1++){
+      auto& o=obs[q1];
+      double r[2], Jg[16], JX[4];
+      project_jacobian(&g[8*o.c],&X[2*o.k],r,Jg,JX);
+      double e[2]={o.x[0]-r[0],o.x[1]-r[1]};
+
+      for(int a=0;a<2;a++)for(int b=0;b<2;b++)V[4*o.k+2*a+b]+=JX[a]*JX[b]+JX[2+a]*JX[2+b];
+      for(int a=0;a<2;a++)ep[2*o.k+a]+=JX[a]*e[0]+JX[2+a]*e[1];
+
+      int c=cam[o.c];
+      if(c<0)continue;
+      for(int a=0;a<8;a++)for(int b=0;b<8;b++)U[64*c+8*a+b]+=Jg[a]*Jg[b]+Jg[8+a]*Jg[8+b];
+      for(int a=0;a<8;a++)ec[8*c+a]+=Jg[a]*e[0]+Jg[8+a]*e[1];
+      for(int a=0;a<8;a++)for(int b=0;b<2;b++)W[16*q1+2*a+b]=Jg[a]*JX[b]+Jg[8+a]*JX[2+b];
+    }
+
+    // Damped point blocks, inverted.
+    vector<double> Vi(4*np);
+    for(int k=0;k<np;k++){
+      double a=V[4*k]*(1+lambda)+1e-12, b=V[4*k+1], c=V[4*k+2], d=V[4*k+3]*(1+lambda)+1e-12;
+      double det=a*d-b*c;
+      Vi[4*k]=d/det; Vi[4*k+1]=-b/det; Vi[4*k+2]=-c/det; Vi[4*k+3]=a/det;
+    }
+
+    // Reduced camera system S dc = rhs.
+    Matrix S(8*m,8*m), rhs(8*m);
+    for(int c=0;c<m;c++)for(int a=0;a<8;a++){
+      for(int b=0;b<8;b++)S(8*c+a,8*c+b)=U[64*c+8*a+b];
+      S(8*c+a,8*c+a)*=1+lambda;
+      rhs(8*c+a)=ec[8*c+a];
+    }
+    // Observations of the same point are adjacent in 'obs'.
+    for(int q1=0;q1<(int)obs.size();q1+=2){
+      int k=obs[q1].k;
+      const double* vi=&Vi[4*k];
+      double ve[2]={vi[0]*ep[2*k]+vi[1]*ep[2*k+1], vi[2]*ep[2*k]+vi[3]*ep[2*k+1]};
+      for(int i=q1;i<q1+2;i++){
+        int ci=cam[obs[i].c];
+        if(ci<0)continue;
+        const double* Wi=&W[16*i];
+        double WV[16];
+        for(int a=0;a<8;a++)for(int b=0;b<2;b++)WV[2*a+b]=Wi[2*a]*vi[b]+Wi[2*a+1]*vi[2+b];
+        for(int a=0;a<8;a++)rhs(8*ci+a)-=Wi[2*a]*ve[0]+Wi[2*a+1]*ve[1];
+        for(int j=q1;j<q1+2;j++){
+          int cj=cam[obs[j].c];
+          if(cj<0)continue;
+          const double* Wj=&W[16*j];
+          for(int a=0;a<8;a++)for(int b=0;b<8;b++)
+            S(8*ci+a,8*cj+b)-=WV[2*a]*Wj[2*b]+WV[2*a+1]*Wj[2*b+1];
+        }
+      }
+    }
+
+    Matrix dc=sle_solve(S,rhs);
+
+    // Back substitution for the points.
+    vector<double> g2=g, X2=X;
+    for(int q1=0;q1<n;q1++)if(cam[q1]>=0)for(int a=0;a<8;a++)g2[8*q1+a]+=dc(8*cam[q1]+a);
+    vector<double> t=ep;
+    for(int q1=0;q1<(int)obs.size();q1++){
+      int c=cam[obs[q1].c];
+      if(c<0)continue;
+      int k=obs[q1].k;
+      for(int a=0;a<8;a++)for(int b=0;b<2;b++)t[2*k+b]-=W[16*q1+2*a+b]*dc(8*c+a);
+    }
+    for(int k=0;k<np;k++){
+      X2[2*k  ]+=Vi[4*k  ]*t[2*k]+Vi[4*k+1]*t[2*k+1];
+      X2[2*k+1]+=Vi[4*k+2]*t[2*k]+Vi[4*k+3]*t[2*k+1];
+    }
+
+    double next=cost(g2,X2);
+    if(next<current){
+      bool converged=current-next<1e-9*current;
+      g.swap(g2);
+      X.swap(X2);
+      current=next;
+      lambda=max(lambda/10,1e-12);
+      if(converged)break;
+    } else lambda*=10;
+    if(lambda>1e8)break;
+  }
+
+  for(int q1=0;q1<n;q1++)if(cam[q1]>=0){
+    Matrix Hn(3,3);
+    for(int q2=0;q2<8;q2++)Hn.data[q2]=g[8*q1+q2];
+    Hn(2,2)=1;
+    Hr[q1]=normalize_homography(Tinv*Hn*T);
+  }
+
+  double rms=sqrt(current/obs.size())/s;
+  printf("Bundle adjustment: final RMS %.3f px\n",rms);
+  return rms;
+}
+
+
+// returns: all the images rendered in a single pass into one canvas, feather-blended.
+// vector<Matrix>& Hr: panorama->image homographies (empty Matrix: image skipped).
+// The canvas is blended tile by tile on disk (see TiledRenderer): only the
+// panorama, cropped to its pixels, is brought to memory.
+Image render_panorama(const vector<Image>& ims, const vector<Matrix>& Hr){
+  assert(ims.size()==Hr.size());
+  return render_panorama_tiled(ims, Hr).to_image();
+}
+
+
+// Create a panorama from many images with global registration:
+// features are detected once per image, all pairs are registered in parallel,
+// the homographies are chained along the maximum spanning tree, refined with bundle
+// adjustment and every image is rendered once into the final canvas.
+Image global_panorama_image(const vector<Image>& ims, float sigma, int corner_method, float thresh, int window, int nms,
+                            float inlier_thresh, int iters, int cutoff, int min_inliers, int max_gap, int ba_iters){
+  TIME(1);
+  if(ims.empty())return Image();
+
+  vector<vector<Descriptor>> d=detect_all_features(ims, sigma, corner_method, thresh, window, nms);
+  vector<PairwiseRegistration> pairs=pairwise_registrations(d, inlier_thresh, iters, cutoff, min_inliers, max_gap);
+
+  int root=0;
+  vector<Matrix> Hr=spanning_tree_homographies(ims.size(), pairs, root);
+  bundle_adjust(Hr, pairs, root, ims[root].w, ims[root].h, ba_iters);
+
+  return render_panorama(ims, Hr);
+}
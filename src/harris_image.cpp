@@ -4,7 +4,13 @@
 #include <cmath>
 #include <cassert>
 
+#include <algorithm>
+#include <numeric>
+
 #include "image.h"
+#include "feature_cache.h"
+#include "cornerness.h"
+#include "feature_registry.h"
 //#include "matrix.h"
 
 using namespace std;
@@ -102,17 +108,10 @@ Image structure_matrix(const Image& im2, float sigma){
 
 
 // returns: a response map of cornerness calculations.
+// method 0: det/tr, otherwise the smallest eigenvalue.
 Image cornerness_response(const Image& S, int method){
-  Image R(S.w, S.h);
-  for(int y=0; y<S.h; y++){
-    for(int x=0; x<S.w; x++){
-      float det=S(x,y,0)*S(x,y,1)-S(x,y,2)*S(x,y,2);
-      float tr=S(x,y,0)+S(x,y,1);
-      if(!method)R(x,y,0)=det/tr;
-      else R(x,y,0)=(tr-(sqrtf(powf(tr,2)-4*det)))/2;
-    }
-  }
-  return R;
+  if(!method)return cornerness_sweep(S,ForstnerMeasure());
+  return cornerness_sweep(S,ShiTomasiMeasure());
 }
 
 
@@ -134,25 +133,265 @@ Image nms_image(const Image& im, int w){
 }
 
 
-// returns: vector of descriptors of the corners in the image.
-vector<Descriptor> detect_corners(const Image& im, const Image& nms, float thresh, int window){
-  vector<Descriptor> d;
-  for(int y=0; y<im.h; y++){
-    for(int x=0; x<im.w; x++){
-      if(nms(x,y,0)>thresh)
-        d.push_back(describe_index(im,x,y,window));
+// Writes to out the maximum of r over [x-n,x+n] for every x of a row of w pixels,
+// in 3 passes whatever n is (van Herk/Gil-Werman): the row, padded, is cut in blocks
+// of 2n+1 and every window is a suffix of a block and a prefix of the next.
+// g, s: scratch of w+2n floats.
+static void row_max(const float* r, float* out, int w, int n, float* g, float* s){
+  int k=2*n+1, len=w+2*n;
+  auto p=[&](int i){ return i<n || i>=n+w ? -INFINITY : r[i-n]; };
+  for(int i=0;i<len;i++)g[i]=i%k ? max(g[i-1],p(i)) : p(i);
+  for(int i=len-1;i>=0;i--)s[i]=(i%k==k-1 || i==len-1) ? p(i) : max(s[i+1],p(i));
+  for(int x=0;x<w;x++)out[x]=max(s[x],g[x+k-1]);
+}
+
+// Subpixel peaks of n 3x3 neighbourhoods, p[i][j]: pixel i (row by row) of neighbourhood j.
+// The quadratic through the center, its gradient and its Hessian (central differences)
+// peaks at -H^-1 g; where H is not that of a maximum the offset is 0, and it is clamped
+// to half a pixel. With AVX2, 8 neighbourhoods at a time.
+static void quadratic_peaks(int n, const float* const p[9], float* ox, float* oy){
+  int j=0;
+#ifdef __AVX2__
+  const __m256 half=_mm256_set1_ps(0.5f), mhalf=_mm256_set1_ps(-0.5f), two=_mm256_set1_ps(2.f), quarter=_mm256_set1_ps(0.25f), zero=_mm256_setzero_ps();
+  for(;j+8<=n;j+=8){
+    __m256 v[9];
+    for(int q1=0;q1<9;q1++)v[q1]=_mm256_loadu_ps(p[q1]+j);
+    __m256 c2=_mm256_mul_ps(two,v[4]);
+    __m256 gx=_mm256_mul_ps(half,_mm256_sub_ps(v[5],v[3]));
+    __m256 gy=_mm256_mul_ps(half,_mm256_sub_ps(v[7],v[1]));
+    __m256 hxx=_mm256_sub_ps(_mm256_add_ps(v[5],v[3]),c2);
+    __m256 hyy=_mm256_sub_ps(_mm256_add_ps(v[7],v[1]),c2);
+    __m256 hxy=_mm256_mul_ps(quarter,_mm256_sub_ps(_mm256_add_ps(v[8],v[0]),_mm256_add_ps(v[6],v[2])));
+    __m256 det=_mm256_sub_ps(_mm256_mul_ps(hxx,hyy),_mm256_mul_ps(hxy,hxy));
+    __m256 ok=_mm256_and_ps(_mm256_cmp_ps(det,zero,_CMP_GT_OQ),_mm256_cmp_ps(hxx,zero,_CMP_LT_OQ));
+    __m256 dx=_mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(hxy,gy),_mm256_mul_ps(hyy,gx)),det);
+    __m256 dy=_mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(hxy,gx),_mm256_mul_ps(hxx,gy)),det);
+    dx=_mm256_and_ps(ok,_mm256_min_ps(_mm256_max_ps(dx,mhalf),half));
+    dy=_mm256_and_ps(ok,_mm256_min_ps(_mm256_max_ps(dy,mhalf),half));
+    _mm256_storeu_ps(ox+j,dx);
+    _mm256_storeu_ps(oy+j,dy);
+  }
+#endif
+  for(;j<n;j++){
+    float v[9];
+    for(int q1=0;q1<9;q1++)v[q1]=p[q1][j];
+    float gx=0.5f*(v[5]-v[3]), gy=0.5f*(v[7]-v[1]);
+    float hxx=v[5]+v[3]-2*v[4], hyy=v[7]+v[1]-2*v[4], hxy=0.25f*(v[8]+v[0]-v[6]-v[2]);
+    float det=hxx*hyy-hxy*hxy;
+    ox[j]=oy[j]=0;
+    if(!(det>0 && hxx<0))continue;
+    ox[j]=min(max((hxy*gy-hyy*gx)/det,-0.5f),0.5f);
+    oy[j]=min(max((hxy*gx-hxx*gy)/det,-0.5f),0.5f);
+  }
+}
+
+vector<Corner> stream_nms(int w, int h, int nms, float thresh, const function<void(int,float*)>& response){
+  // the ring keeps at least the rows next to the one decided, for the subpixel peaks
+  int keep=max(nms,1), k=2*keep+1;
+  vector<vector<Corner>> found(h);
+  parallel_for_ranges(0,h,max(64,2*k),[&](int y0, int y1){
+    // the responses and their maxima along the rows; row y is at y%k
+    vector<float> rows((size_t)k*w), hmax((size_t)k*w), g(w+2*nms), s(w+2*nms);
+    // the 3x3 neighbourhoods of the corners of the band, one array per pixel
+    vector<float> patch[9];
+    int next=max(y0-keep,0);
+    for(int y=y0;y<y1;y++){
+      for(;next<=min(y+keep,h-1);next++){
+        float* r=rows.data()+(size_t)(next%k)*w;
+        response(next,r);
+        row_max(r,hmax.data()+(size_t)(next%k)*w,w,nms,g.data(),s.data());
+      }
+      const float* r=rows.data()+(size_t)(y%k)*w;
+      const float* around[3]={rows.data()+(size_t)(max(y-1,0)%k)*w,r,rows.data()+(size_t)(min(y+1,h-1)%k)*w};
+      int top=max(y-nms,0), last=min(y+nms,h-1);
+      for(int x=0;x<w;x++){
+        float v=r[x];
+        if(!(v>thresh))continue;
+        bool peak=true;
+        for(int q1=top;q1<=last && peak;q1++)peak=hmax[(size_t)(q1%k)*w+x]<=v;
+        if(!peak)continue;
+        Corner c;
+        c.x=x;
+        c.y=y;
+        c.response=v;
+        found[y].push_back(c);
+        int xs[3]={max(x-1,0),x,min(x+1,w-1)};
+        for(int q1=0;q1<9;q1++)patch[q1].push_back(around[q1/3][xs[q1%3]]);
+      }
+    }
+
+    int n=patch[0].size();
+    vector<float> ox(n), oy(n);
+    const float* p[9];
+    for(int q1=0;q1<9;q1++)p[q1]=patch[q1].data();
+    quadratic_peaks(n,p,ox.data(),oy.data());
+    int j=0;
+    for(int y=y0;y<y1;y++)for(auto&e1:found[y]){ e1.ox=ox[j]; e1.oy=oy[j]; j++; }
+  });
+  vector<Corner> c;
+  for(auto&e1:found)c.insert(c.end(),e1.begin(),e1.end());
+  return c;
+}
+
+// returns: the pixels of nms above thresh, in row order.
+vector<Corner> corner_candidates(const Image& nms, float thresh){
+  vector<vector<Corner>> found(nms.h);
+  parallel_for_ranges(0,nms.h,32,[&](int y0, int y1){
+    for(int y=y0;y<y1;y++){
+      const float* row=nms.RowPtr(y,0);
+      for(int x=0;x<nms.w;x++)if(row[x]>thresh){
+        Corner c;
+        c.x=x;
+        c.y=y;
+        c.response=row[x];
+        found[y].push_back(c);
+      }
+    }
+  });
+  vector<Corner> c;
+  for(auto&e1:found)c.insert(c.end(),e1.begin(),e1.end());
+  return c;
+}
+
+// Stronger first; ties in row order, so that selections do not depend on the sort.
+static bool stronger(const Corner& a, const Corner& b){
+  if(a.response!=b.response)return a.response>b.response;
+  return a.y!=b.y ? a.y<b.y : a.x<b.x;
+}
+
+static bool row_order(const Corner& a, const Corner& b){
+  return a.y!=b.y ? a.y<b.y : a.x<b.x;
+}
+
+// returns: the k strongest corners, in row order. Partial sort: O(N log k).
+vector<Corner> strongest_corners(vector<Corner> c, int k){
+  if(k<0 || (int)c.size()<=k)return c;
+  partial_sort(c.begin(),c.begin()+k,c.end(),stronger);
+  c.resize(k);
+  sort(c.begin(),c.end(),row_order);
+  return c;
+}
+
+// returns: the k corners with the largest suppression radius, in row order (Brown et al.).
+// The radius of a corner is its distance to the closest corner stronger than it by the
+// factor 1/robust. Corners are visited strongest first, so the ones that can suppress a
+// corner are a prefix of the visit: they go into a grid of about k cells and the closest
+// is found by searching rings of cells outwards.
+vector<Corner> anms_corners(const vector<Corner>& c, int k, int w, int h, float robust){
+  if(k<0 || (int)c.size()<=k)return c;
+  int n=c.size();
+  vector<int> order(n);
+  iota(order.begin(),order.end(),0);
+  sort(order.begin(),order.end(),[&](int a, int b){ return stronger(c[a],c[b]); });
+
+  int cell=max(1,(int)sqrt((double)w*h/max(k,1)));
+  int gw=(w+cell-1)/cell, gh=(h+cell-1)/cell;
+  vector<vector<int>> grid(gw*gh);
+  vector<float> radius2(n,INFINITY);
+  int inserted=0;
+  for(int q1=0;q1<n;q1++){
+    const Corner& p=c[order[q1]];
+    while(inserted<q1 && robust*c[order[inserted]].response>p.response){
+      const Corner& s=c[order[inserted]];
+      grid[(s.y/cell)*gw+s.x/cell].push_back(order[inserted]);
+      inserted++;
+    }
+    if(!inserted)continue;
+    int cx=p.x/cell, cy=p.y/cell;
+    float best=INFINITY;
+    for(int r=0;r<max(gw,gh);r++){
+      // the cells of ring r are at least (r-1)*cell away
+      float near=(float)max(r-1,0)*cell;
+      if(near*near>=best)break;
+      for(int y=max(cy-r,0);y<=min(cy+r,gh-1);y++)for(int x=max(cx-r,0);x<=min(cx+r,gw-1);x++){
+        if(max(abs(x-cx),abs(y-cy))!=r)continue;
+        for(int e1:grid[y*gw+x]){
+          float dx=c[e1].x-p.x, dy=c[e1].y-p.y;
+          best=min(best,dx*dx+dy*dy);
+        }
+      }
     }
+    radius2[order[q1]]=best;
+  }
+
+  partial_sort(order.begin(),order.begin()+k,order.end(),[&](int a, int b){
+    if(radius2[a]!=radius2[b])return radius2[a]>radius2[b];
+    return stronger(c[a],c[b]);
+  });
+  vector<Corner> r;
+  for(int q1=0;q1<k;q1++)r.push_back(c[order[q1]]);
+  sort(r.begin(),r.end(),row_order);
+  return r;
+}
+
+// returns: k corners taken in turns from the cells of a grid of about k/4 cells: the
+// strongest of every cell, then the second strongest of every cell... in row order.
+vector<Corner> grid_corners(const vector<Corner>& c, int k, int w, int h){
+  if(k<0 || (int)c.size()<=k)return c;
+  int cells=max(1,k/4);
+  int cols=max(1,(int)lround(sqrt((double)cells*w/max(h,1))));
+  int rows=max(1,(cells+cols-1)/cols);
+
+  vector<vector<Corner>> bucket(cols*rows);
+  for(auto&e1:c)bucket[min(e1.y*rows/max(h,1),rows-1)*cols+min(e1.x*cols/max(w,1),cols-1)].push_back(e1);
+  // (turn, corner): only the first k of a cell can be taken
+  vector<pair<int,Corner>> turns;
+  for(auto&e1:bucket){
+    int n=min((int)e1.size(),k);
+    partial_sort(e1.begin(),e1.begin()+n,e1.end(),stronger);
+    for(int q1=0;q1<n;q1++)turns.push_back({q1,e1[q1]});
   }
+  partial_sort(turns.begin(),turns.begin()+k,turns.end(),[](const pair<int,Corner>& a, const pair<int,Corner>& b){
+    return a.first!=b.first ? a.first<b.first : stronger(a.second,b.second);
+  });
+  vector<Corner> r;
+  for(int q1=0;q1<k;q1++)r.push_back(turns[q1].second);
+  sort(r.begin(),r.end(),row_order);
+  return r;
+}
+
+vector<Corner> select_corners(const vector<Corner>& c, int k, int selection, int w, int h){
+  switch(selection){
+    case SELECT_ANMS: return anms_corners(c,k,w,h);
+    case SELECT_GRID: return grid_corners(c,k,w,h);
+    default:          return strongest_corners(c,k);
+  }
+}
+
+// returns: the descriptors of the corners of im, in parallel.
+// subpixel: the points are moved to the subpixel peaks (the patches stay on the pixels).
+vector<Descriptor> describe_corners(const Image& im, const vector<Corner>& c, int window, bool subpixel){
+  vector<Descriptor> d(c.size());
+  parallel_for(0,c.size(),[&](int i){
+    d[i]=describe_index(im,c[i].x,c[i].y,window);
+    if(subpixel)d[i].p=Point(c[i].x+c[i].ox,c[i].y+c[i].oy);
+  });
   return d;
 }
 
+// returns: vector of descriptors of the corners in the image.
+// budget > 0 keeps at most that many, chosen as 'selection' says (see CornerSelection).
+vector<Descriptor> detect_corners(const Image& im, const Image& nms, float thresh, int window, int budget, int selection){
+  vector<Corner> c=corner_candidates(nms,thresh);
+  if(budget>0)c=select_corners(c,budget,selection,im.w,im.h);
+  return describe_corners(im,c,window);
+}
+
 
 // Perform harris corner detection and extract features from the corners.
-vector<Descriptor> harris_corner_detector(const Image& im, float sigma, float thresh, int window, int nms, int corner_method){
-  Image S = structure_matrix(im, sigma);
-  Image R = cornerness_response(S,corner_method);
-  Image Rnms = nms_image(R, nms);
-  return detect_corners(im, Rnms, thresh, window);
+// The features are taken from the feature cache when they are there.
+vector<Descriptor> harris_corner_detector(const Image& im, float sigma, float thresh, int window, int nms, int corner_method, int budget, int selection, bool subpixel){
+  vector<double> params={sigma, thresh, (double)window, (double)nms, (double)corner_method};
+  if(budget>0 || subpixel){ params.push_back(budget); params.push_back(selection); }
+  if(subpixel)params.push_back(1);
+  return cached_features(im, "harris", params, [&](){
+    // the response is thresholded and suppressed as it is computed (stream_nms)
+    Image S = structure_matrix(im, sigma);
+    vector<Corner> c = corner_method ? cornerness_candidates(S, ShiTomasiMeasure(), thresh, nms)
+                                     : cornerness_candidates(S, ForstnerMeasure(), thresh, nms);
+    if(budget>0)c = select_corners(c, budget, selection, im.w, im.h);
+    return describe_corners(im, c, window, subpixel);
+  });
 }
 
 // Find and draw corners on an image.
@@ -160,3 +399,19 @@ Image detect_and_draw_corners(const Image& im, float sigma, float thresh, int wi
   vector<Descriptor> d = harris_corner_detector(im, sigma, thresh, window, nms, corner_method);
   return mark_corners(im, d);
 }
+
+// Harris corners in the feature registry ("harris", method is the corner_method).
+class HarrisDetector : public FeatureDetector {
+ public:
+  explicit HarrisDetector(const DetectorParams& p) : p(p) {}
+  using FeatureDetector::detect;
+  vector<Descriptor> detect(const Image& im) const override {
+    return harris_corner_detector(im, p.sigma, p.thresh, p.window, p.nms, p.method, p.budget, p.selection, p.subpixel);
+  }
+ private:
+  DetectorParams p;
+};
+
+static DetectorRegistration harris_registration("harris", [](const DetectorParams& p){
+  return unique_ptr<FeatureDetector>(new HarrisDetector(p));
+});
@@ -207,7 +207,7 @@ struct Image
   void load_binary(const string& filename);
   
   void load_image  (const string& filename);
-  void save_png    (const string& filename) const;
+  void save_png    (const string& filename, int level=6) const;
   void save_image  (const string& filename) const;
   
   };
@@ -226,16 +226,30 @@ struct Point
 
 // A descriptor for a point in an image.
 // point p: x,y coordinates of the image pixel.
+// float scale: blur of the scale space level the point was found at, in pixels of the image (0: not scale-invariant).
+// float angle: orientation of the keypoint in radians, set by the oriented extractors (0: not oriented).
 // vector<float> data: the descriptor for the pixel.
 struct Descriptor
   {
   Point p;
+  float scale=0;
+  float angle=0;
   vector<float> data;
   
   Descriptor(){}
   Descriptor(const Point& p) : p(p) {}
   };
 
+// A corner candidate of a detector.
+// int x, y: the pixel. float response: its cornerness (or score), larger is stronger.
+// float ox, oy: offset of the subpixel peak of the response from the pixel, within half a pixel.
+struct Corner
+  {
+  int x=0, y=0;
+  float response=0;
+  float ox=0, oy=0;
+  };
+
 // A match between two points in an Image.
 // const Descriptor* a, b: Pointers to the Descriptors in the corresponding images.
 // float distance: the distance between the descriptors for the points.
@@ -251,6 +265,29 @@ struct Match
   bool operator<(const Match& other) { return distance<other.distance; }
   };
 
+// An image of a hierarchical panorama, with the features of the original inputs it is made of.
+// Image im: the (partial) panorama.
+// vector<Descriptor> d: the features, with coordinates in im.
+// int window: side of the patches of the features (0: unknown).
+struct Mosaic
+  {
+  Image im;
+  vector<Descriptor> d;
+  int window=0;
+  };
+
+// A homography estimated between two images of a set.
+// int a, b: indices of the images.
+// Matrix Hba: homography mapping points of image a into image b.
+// vector<pair<Point,Point>> inliers: RANSAC inliers, point in a and point in b.
+struct PairwiseRegistration
+  {
+  int a=-1;
+  int b=-1;
+  Matrix Hba;
+  vector<pair<Point,Point>> inliers;
+  };
+
 
 
 
@@ -258,10 +295,21 @@ struct Match
 // Image I/O functions
 inline Image load_binary (const string& filename) { Image im; im.load_binary(filename); return im; }
 inline Image load_image  (const string& filename) { Image im; im.load_image(filename);  return im; }
-inline void  save_png    (const Image& im, const string& filename) { im.save_png   (filename); }
+inline void  save_png    (const Image& im, const string& filename, int level=6) { im.save_png(filename, level); }
 inline void  save_image  (const Image& im, const string& filename) { im.save_image (filename); }
 inline void  save_binary (const Image& im, const string& filename) { im.save_binary(filename); }
 
+// Loading throws runtime_error if a file cannot be decoded, try_load_image returns false instead.
+// channels > 0 forces the image to have that many channels.
+// scale > 1 reduces the image by that factor (1/2, 1/4, 1/8...) while decoding it, as box_downsample does.
+bool  try_load_image (const string& filename, Image& im, int channels=0, string* error=nullptr);
+Image load_image     (const string& filename, int scale);
+Image load_image_gray(const string& filename, int scale=1);
+vector<Image> load_images(const vector<string>& filenames, int channels=0, int scale=1);
+// returns: channels of the image load_image would decode from the file (alpha dropped),
+// read from the header only; 0 if the file cannot be read.
+int   image_channels (const string& filename);
+
 
 // Basic operations
 Image rgb_to_grayscale(const Image& im);
@@ -277,6 +325,7 @@ void clamp_image(Image& im);
 // Resizing
 Image nearest_resize (const Image& im, int w, int h);
 Image bilinear_resize(const Image& im, int w, int h);
+Image box_downsample (const Image& im, int scale);
 
 
 
@@ -313,11 +362,23 @@ Image operator+(const Image& a, const Image& b);
 Image structure_matrix(const Image& im, float sigma);
 Image cornerness_response(const Image& S, int method);
 Image nms_image(const Image& im, int w);
-vector<Descriptor> detect_corners(const Image& im, const Image& nms, float thresh, int window);
-vector<Descriptor> harris_corner_detector(const Image& im, float sigma, float thresh, int window, int nms, int corner_method);
+Descriptor describe_index(const Image& im, int x, int y, int w);
+vector<Descriptor> detect_corners(const Image& im, const Image& nms, float thresh, int window, int budget=0, int selection=0);
+vector<Descriptor> harris_corner_detector(const Image& im, float sigma, float thresh, int window, int nms, int corner_method, int budget=0, int selection=0, bool subpixel=false);
 Image detect_and_draw_corners(const Image& im, float sigma, float thresh, int window, int nms, int corner_method);
 Image mark_corners(const Image& im, const vector<Descriptor>& d);
 
+// Feature budget: how select_corners keeps 'budget' corners of many.
+// SELECT_STRONGEST: the strongest. SELECT_ANMS: adaptive non-maximal suppression, the ones
+// strongest over the largest radius. SELECT_GRID: the strongest of every cell of a grid.
+enum CornerSelection { SELECT_STRONGEST=0, SELECT_ANMS=1, SELECT_GRID=2 };
+vector<Corner> corner_candidates(const Image& nms, float thresh);
+vector<Corner> strongest_corners(vector<Corner> c, int k);
+vector<Corner> anms_corners(const vector<Corner>& c, int k, int w, int h, float robust=0.9f);
+vector<Corner> grid_corners(const vector<Corner>& c, int k, int w, int h);
+vector<Corner> select_corners(const vector<Corner>& c, int k, int selection, int w, int h);
+vector<Descriptor> describe_corners(const Image& im, const vector<Corner>& c, int window, bool subpixel=false);
+
 // Panorama
 Image both_images(const Image& a, const Image& b);
 Image draw_matches(const Image& a, const Image& b, const vector<Match>& matches, const vector<Match>&  inliers);
@@ -331,7 +392,25 @@ vector<Match> model_inliers(const Matrix& H, const vector<Match>& m, float thres
 void randomize_matches(vector<Match>& m);
 Matrix compute_homography_ba(const vector<Match>& matches);
 Matrix RANSAC(vector<Match> m, float thresh, int k, int cutoff);
+Matrix estimate_homography(const vector<Descriptor>& ad, const vector<Descriptor>& bd, float inlier_thresh, int iters, int cutoff, vector<Match>* matches=nullptr);
+Image trim_image(const Image& a);
+Image trim_image(const Image& a, int& ox, int& oy);
 Image combine_images(const Image& a, const Image& b, const Matrix& Hba, float acoeff);
+Image combine_images(const Image& a, const Image& b, const Matrix& Hba, float acoeff, int& ox, int& oy);
 Image panorama_image(const Image& a, const Image& b, float sigma, int corner_method, float thresh, int window, int nms, float inlier_thresh, int iters, int cutoff, float acoeff);
+Mosaic make_mosaic(const Image& im, float sigma, int corner_method, float thresh, int window, int nms);
+Mosaic panorama_mosaic(const Mosaic& a, const Mosaic& b, float inlier_thresh, int iters, int cutoff, float acoeff, int window=0);
+Mosaic merge_mosaics(const Mosaic& a, const Mosaic& b, const Matrix& Hba, float acoeff);
+Mosaic merge_mosaics(const Image& a, const vector<Descriptor>& ad, const Image& b, const vector<Descriptor>& bd, const Matrix& Hba, float acoeff);
 Image cylindrical_project(const Image& im, float f);
 Image spherical_project(const Image& im, float f);
+
+// Global registration
+vector<vector<Descriptor>> detect_all_features(const vector<Image>& ims, float sigma, int corner_method, float thresh, int window, int nms);
+PairwiseRegistration register_pair(const vector<Descriptor>& da, const vector<Descriptor>& db, int a, int b, float inlier_thresh, int iters, int cutoff);
+vector<PairwiseRegistration> pairwise_registrations(const vector<vector<Descriptor>>& d, float inlier_thresh, int iters, int cutoff, int min_inliers, int max_gap);
+vector<Matrix> spanning_tree_homographies(int n, const vector<PairwiseRegistration>& pairs, int& root);
+double bundle_adjust(vector<Matrix>& Hr, const vector<PairwiseRegistration>& pairs, int root, int w, int h, int iters);
+Image render_panorama(const vector<Image>& ims, const vector<Matrix>& Hr);
+Image global_panorama_image(const vector<Image>& ims, float sigma, int corner_method, float thresh, int window, int nms,
+                            float inlier_thresh, int iters, int cutoff, int min_inliers, int max_gap, int ba_iters);
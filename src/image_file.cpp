@@ -0,0 +1,378 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "image.h"
+#include "image_file.h"
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static const char MAGIC[8]={'U','W','I','M','G','B','I','N'};
+static const uint32_t VERSION=1;
+static const size_t BLOCK=1<<20;  // bytes of pixels per block (a multiple of every dtype size)
+static const size_t ALIGN=64;
+
+struct BinaryHeader
+  {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype;
+  int32_t w, h, c;
+  uint32_t compressed;
+  uint64_t data_offset;  // from the start of the file
+  uint64_t data_bytes;   // stored bytes of pixels (after compression)
+  uint64_t raw_bytes;    // bytes of pixels before compression
+  uint64_t checksum;
+  };
+static_assert(sizeof(BinaryHeader)==64, "the header must be 64 bytes");
+
+static size_t dtype_size(int dtype){ return dtype==BIN_F32?4:(dtype==BIN_F16?2:1); }
+
+static uint64_t checksum64(const unsigned char* p, size_t n){ return hash_bytes(p,n); }
+
+// The checksum of a file chains the checksums of its blocks.
+static uint64_t checksum_combine(uint64_t h, uint64_t block){
+  h=(h^block)*0xc4ceb9fe1a85ec53ull;
+  return h^(h>>31);
+}
+
+
+// Half floats, rounded to nearest even.
+static uint16_t float_to_half(float f){
+  uint32_t x;
+  memcpy(&x,&f,4);
+  uint32_t sign=(x>>16)&0x8000;
+  x&=0x7fffffff;
+  if(x>=0x7f800000)return sign|0x7c00|(x>0x7f800000?0x200:0);  // inf, nan
+  if(x>=0x477ff000)return sign|0x7c00;                          // too big: inf
+  if(x<0x38800000){                                             // subnormal
+    float v;
+    memcpy(&v,&x,4);
+    return sign|(uint16_t)nearbyintf(v*16777216.f);
+  }
+  x+=0xfff+((x>>13)&1);
+  return sign|((x-0x38000000)>>13);
+}
+
+static float half_to_float(uint16_t h){
+  uint32_t sign=(uint32_t)(h&0x8000)<<16;
+  uint32_t exp=(h>>10)&0x1f, mant=h&0x3ff;
+  if(exp==0){
+    float v=mant*(1.f/16777216.f);
+    return sign?-v:v;
+  }
+  uint32_t x=sign|(exp==31?0x7f800000|(mant<<13):((exp+112)<<23)|(mant<<13));
+  float f;
+  memcpy(&f,&x,4);
+  return f;
+}
+
+// Encodes n values of src as dtype into out.
+static void encode_values(const float* src, size_t n, int dtype, unsigned char* out){
+  size_t q1=0;
+  if(dtype==BIN_F32){ memcpy(out,src,n*4); return; }
+  if(dtype==BIN_F16){
+    uint16_t* o=(uint16_t*)out;
+#ifdef __F16C__
+    for(;q1+8<=n;q1+=8)_mm_storeu_si128((__m128i*)(o+q1),_mm256_cvtps_ph(_mm256_loadu_ps(src+q1),_MM_FROUND_TO_NEAREST_INT));
+#endif
+    for(;q1<n;q1++)o[q1]=float_to_half(src[q1]);
+    return;
+  }
+  for(;q1<n;q1++){
+    float v=src[q1];
+    v=v<0?0:(v>1?1:v);
+    out[q1]=(unsigned char)(255*v+0.5f);
+  }
+}
+
+static void decode_values(const unsigned char* in, size_t n, int dtype, float* dst){
+  size_t q1=0;
+  if(dtype==BIN_F32){ memcpy(dst,in,n*4); return; }
+  if(dtype==BIN_F16){
+    const uint16_t* i=(const uint16_t*)in;
+#ifdef __F16C__
+    for(;q1+8<=n;q1+=8)_mm256_storeu_ps(dst+q1,_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(i+q1))));
+#endif
+    for(;q1<n;q1++)dst[q1]=half_to_float(i[q1]);
+    return;
+  }
+  for(;q1<n;q1++)dst[q1]=in[q1]/255.f;
+}
+
+
+// LZ4 block format: sequences of literals followed by a match (offset < 64KB, length >= 4).
+// The last 5 bytes are always literals and no match starts in the last 12.
+static const int LZ_HASH_BITS=14;
+
+static uint32_t read32(const unsigned char* p){ uint32_t v; memcpy(&v,p,4); return v; }
+
+static void put_length(size_t len, vector<unsigned char>& out){
+  while(len>=255){ out.push_back(255); len-=255; }
+  out.push_back((unsigned char)len);
+}
+
+static void lz_sequence(const unsigned char* lit, size_t nlit, size_t offset, size_t mlen, vector<unsigned char>& out){
+  size_t ml=mlen?mlen-4:0;
+  out.push_back((unsigned char)((min<size_t>(nlit,15)<<4)|min<size_t>(ml,15)));
+  if(nlit>=15)put_length(nlit-15,out);
+  out.insert(out.end(),lit,lit+nlit);
+  if(!mlen)return;
+  out.push_back(offset&0xff);
+  out.push_back(offset>>8);
+  if(ml>=15)put_length(ml-15,out);
+}
+
+static void lz_compress(const unsigned char* src, size_t n, vector<unsigned char>& out){
+  vector<int> table(1<<LZ_HASH_BITS,-1);
+  size_t anchor=0;
+  if(n>=13){
+    size_t limit=n-12;
+    for(size_t i=0;i<limit;){
+      uint32_t seq=read32(src+i);
+      uint32_t hv=(seq*2654435761u)>>(32-LZ_HASH_BITS);
+      int cand=table[hv];
+      table[hv]=(int)i;
+      if(cand<0 || i-cand>65535 || read32(src+cand)!=seq){ i++; continue; }
+      size_t len=4;
+      while(i+len<n-5 && src[cand+len]==src[i+len])len++;
+      lz_sequence(src+anchor,i-anchor,i-cand,len,out);
+      i+=len;
+      anchor=i;
+    }
+  }
+  lz_sequence(src+anchor,n-anchor,0,0,out);
+}
+
+// returns: false if the block is corrupted.
+static bool lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t dn){
+  size_t i=0, o=0;
+  auto length=[&](size_t& len){
+    if(len<15)return true;
+    unsigned char b;
+    do{
+      if(i>=n)return false;
+      b=src[i++];
+      len+=b;
+    }while(b==255);
+    return true;
+  };
+  while(i<n){
+    unsigned char token=src[i++];
+    size_t nlit=token>>4;
+    if(!length(nlit) || nlit>n-i || nlit>dn-o)return false;
+    memcpy(dst+o,src+i,nlit);
+    i+=nlit; o+=nlit;
+    if(i==n)break;  // the last sequence has no match
+    if(i+2>n)return false;
+    size_t offset=src[i]|(src[i+1]<<8);
+    i+=2;
+    size_t mlen=token&15;
+    if(!length(mlen))return false;
+    mlen+=4;
+    if(!offset || offset>o || mlen>dn-o)return false;
+    for(size_t q1=0;q1<mlen;q1++,o++)dst[o]=dst[o-offset];  // may overlap
+  }
+  return o==dn;
+}
+
+
+// Where the blocks of a file are.
+struct BinaryLayout
+  {
+  BinaryHeader hd;
+  const uint64_t* table=nullptr;  // compressed files: block offsets, nblocks+1
+  const unsigned char* data=nullptr;
+  size_t nblocks=0;
+  bool legacy=false;
+
+  size_t raw_block(size_t b) const { return min(BLOCK,(size_t)hd.raw_bytes-b*BLOCK); }
+  const unsigned char* stored(size_t b, size_t& n) const
+    {
+    if(!hd.compressed){ n=raw_block(b); return data+b*BLOCK; }
+    n=table[b+1]-table[b];
+    return data+table[b];
+    }
+  };
+
+static bool fail(string* error, const string& filename, const string& why){
+  if(error)*error="Cannot load binary image \""+filename+"\": "+why;
+  return false;
+}
+
+static bool parse(const MappedFile& f, const string& filename, BinaryLayout& l, string* error){
+  BinaryHeader& hd=l.hd;
+  if(f.size>=sizeof(hd) && !memcmp(f.data,MAGIC,8)){
+    memcpy(&hd,f.data,sizeof(hd));
+    if(hd.version!=VERSION)return fail(error,filename,"unknown version "+to_string(hd.version));
+    if(hd.dtype>BIN_U8)return fail(error,filename,"unknown dtype "+to_string(hd.dtype));
+  } else {
+    // old files: w, h, c and the floats
+    int32_t s[3];
+    if(f.size<12)return fail(error,filename,"not a binary image");
+    memcpy(s,f.data,12);
+    if(s[0]<0 || s[1]<0 || s[2]<0 || 12+4*(uint64_t)s[0]*s[1]*s[2]!=f.size)return fail(error,filename,"not a binary image");
+    memset(&hd,0,sizeof(hd));
+    hd.w=s[0]; hd.h=s[1]; hd.c=s[2];
+    hd.dtype=BIN_F32;
+    hd.data_offset=12;
+    hd.data_bytes=hd.raw_bytes=f.size-12;
+    l.legacy=true;
+  }
+  if(hd.w<0 || hd.h<0 || hd.c<0 || (uint64_t)hd.w*hd.h*hd.c*dtype_size(hd.dtype)!=hd.raw_bytes)
+    return fail(error,filename,"inconsistent sizes");
+  if(hd.data_offset>f.size || hd.data_bytes>f.size-hd.data_offset)return fail(error,filename,"truncated file");
+  if(!hd.compressed && hd.data_bytes!=hd.raw_bytes)return fail(error,filename,"inconsistent sizes");
+
+  l.data=f.data+hd.data_offset;
+  l.nblocks=(hd.raw_bytes+BLOCK-1)/BLOCK;
+  if(hd.compressed){
+    if(sizeof(hd)+(l.nblocks+1)*8>hd.data_offset)return fail(error,filename,"truncated block table");
+    l.table=(const uint64_t*)(f.data+sizeof(hd));
+    for(size_t q1=0;q1<l.nblocks;q1++)
+      if(l.table[q1]>l.table[q1+1] || l.table[q1+1]>hd.data_bytes || l.table[q1+1]-l.table[q1]>l.raw_block(q1))
+        return fail(error,filename,"corrupted block table");
+  }
+  return true;
+}
+
+static bool verify(const BinaryLayout& l, const string& filename, string* error){
+  if(l.legacy)return true;
+  vector<uint64_t> sums(l.nblocks);
+  parallel_for(0,l.nblocks,[&](int b){
+    size_t n;
+    const unsigned char* p=l.stored(b,n);
+    sums[b]=checksum64(p,n);
+  });
+  uint64_t h=0;
+  for(auto e1:sums)h=checksum_combine(h,e1);
+  if(h!=l.hd.checksum)return fail(error,filename,"checksum mismatch");
+  return true;
+}
+
+static bool decode(const BinaryLayout& l, const string& filename, Image& im, string* error){
+  im=Image(l.hd.w,l.hd.h,l.hd.c);
+  size_t es=dtype_size(l.hd.dtype);
+  vector<char> ok(l.nblocks,1);
+  parallel_for(0,l.nblocks,[&](int b){
+    size_t n, raw=l.raw_block(b);
+    const unsigned char* p=l.stored(b,n);
+    vector<unsigned char> tmp;
+    if(n<raw){
+      tmp.resize(raw);
+      if(!lz_decompress(p,n,tmp.data(),raw)){ ok[b]=0; return; }
+      p=tmp.data();
+    }
+    decode_values(p,raw/es,l.hd.dtype,im.data+b*BLOCK/es);
+  });
+  for(auto e1:ok)if(!e1)return fail(error,filename,"corrupted block");
+  return true;
+}
+
+
+bool write_binary(const Image& im, const string& filename, int dtype, bool compress){
+  if(dtype<BIN_F32 || dtype>BIN_U8)throw invalid_argument("write_binary: unknown dtype");
+  BinaryHeader hd;
+  memset(&hd,0,sizeof(hd));
+  memcpy(hd.magic,MAGIC,8);
+  hd.version=VERSION;
+  hd.dtype=dtype;
+  hd.w=im.w; hd.h=im.h; hd.c=im.c;
+  hd.compressed=compress;
+  size_t es=dtype_size(dtype);
+  size_t count=(size_t)im.w*im.h*im.c;
+  hd.raw_bytes=count*es;
+  size_t nblocks=(hd.raw_bytes+BLOCK-1)/BLOCK;
+
+  // Floats are written as they are, other types are converted first.
+  const unsigned char* raw=(const unsigned char*)im.data;
+  vector<unsigned char> converted;
+  if(dtype!=BIN_F32){
+    converted.resize(hd.raw_bytes);
+    parallel_for(0,nblocks,[&](int b){
+      size_t n=min(BLOCK,(size_t)hd.raw_bytes-b*BLOCK)/es;
+      encode_values(im.data+b*BLOCK/es,n,dtype,converted.data()+b*BLOCK);
+    });
+    raw=converted.data();
+  }
+
+  vector<vector<unsigned char>> blocks(compress?nblocks:0);
+  vector<uint64_t> sums(nblocks);
+  parallel_for(0,nblocks,[&](int b){
+    size_t n=min(BLOCK,(size_t)hd.raw_bytes-b*BLOCK);
+    const unsigned char* p=raw+b*BLOCK;
+    if(compress){
+      lz_compress(p,n,blocks[b]);
+      if(blocks[b].size()>=n)blocks[b].assign(p,p+n);
+      sums[b]=checksum64(blocks[b].data(),blocks[b].size());
+    }
+    else sums[b]=checksum64(p,n);
+  });
+  for(auto e1:sums)hd.checksum=checksum_combine(hd.checksum,e1);
+
+  vector<uint64_t> table;
+  if(compress){
+    table.push_back(0);
+    for(auto&e1:blocks)table.push_back(table.back()+e1.size());
+  }
+  hd.data_bytes=compress?table.back():hd.raw_bytes;
+  size_t head=sizeof(hd)+table.size()*8;
+  hd.data_offset=(head+ALIGN-1)/ALIGN*ALIGN;
+
+  FILE* f=fopen(filename.c_str(),"wb");
+  if(!f)return false;
+  static const unsigned char zeros[ALIGN]={0};
+  fwrite(&hd,sizeof(hd),1,f);
+  if(table.size())fwrite(table.data(),8,table.size(),f);
+  fwrite(zeros,1,hd.data_offset-head,f);
+  if(compress)for(auto&e1:blocks)fwrite(e1.data(),1,e1.size(),f);
+  else if(hd.raw_bytes)fwrite(raw,1,hd.raw_bytes,f);
+  bool ok=!ferror(f);
+  ok=!fclose(f) && ok;
+  return ok;
+}
+
+bool read_binary(const string& filename, Image& im, string* error){
+  MappedFile f;
+  if(!f.open(filename))return fail(error,filename,"cannot open the file");
+  BinaryLayout l;
+  if(!parse(f,filename,l,error) || !verify(l,filename,error))return false;
+  Image r;
+  if(!decode(l,filename,r,error))return false;
+  im=move(r);
+  return true;
+}
+
+
+bool MappedImage::open(const string& filename, bool verify_checksum, string* error){
+  close();
+  if(!file.open(filename))return fail(error,filename,"cannot open the file");
+  BinaryLayout l;
+  if(!parse(file,filename,l,error) || (verify_checksum && !verify(l,filename,error))){ close(); return false; }
+  if(l.hd.dtype==BIN_F32 && !l.hd.compressed){
+    // The image borrows the mapping: close() takes the pointer back before the image frees it.
+    im.w=l.hd.w; im.h=l.hd.h; im.c=l.hd.c;
+    im.data=l.hd.raw_bytes?(float*)l.data:nullptr;
+    borrowed=true;
+    return true;
+  }
+  bool ok=decode(l,filename,im,error);
+  file.close();
+  if(!ok)close();
+  return ok;
+}
+
+void MappedImage::close(void){
+  if(borrowed){
+    im.data=nullptr;
+    im.w=im.h=im.c=0;
+    borrowed=false;
+  }
+  im=Image();
+  file.close();
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "image.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+// Binary image files.
+//
+// A 64 byte header (magic "UWIMGBIN", version, dtype, sizes, checksum) is followed by
+// the planar pixels, starting at an offset aligned to 64 bytes. The pixels are stored as
+// 32 bit floats, 16 bit floats or 8 bit values (0..255 for 0..1, lossy).
+// Compressed files cut the pixels in blocks of 1MB, compressed independently (LZ4
+// block format) and preceded by a table of their offsets; blocks that do not shrink
+// are stored as they are.
+// The checksum covers the stored pixel data, block by block.
+// Files written by the old save_binary (sizes and floats, no header) can still be read.
+
+enum { BIN_F32=0, BIN_F16=1, BIN_U8=2 };
+
+// returns: false if the file could not be written.
+bool write_binary(const Image& im, const string& filename, int dtype=BIN_F32, bool compress=false);
+
+// returns: false (and the reason in 'error') if the file cannot be read or is corrupted.
+bool read_binary(const string& filename, Image& im, string* error=nullptr);
+
+// A binary image file mapped in memory. Uncompressed float files are used in place,
+// without copies nor reads: their pages are loaded when the pixels are touched.
+// Other files are decoded from the mapping into memory.
+// The image is valid as long as the MappedImage is, and is read-only.
+class MappedImage
+  {
+  public:
+
+  MappedImage() = default;
+  MappedImage(const MappedImage&) = delete;
+  MappedImage& operator=(const MappedImage&) = delete;
+
+  ~MappedImage() { close(); }
+
+  // verify: check the checksum (reads the whole file).
+  // returns: false (and the reason in 'error') if the file cannot be read or is corrupted.
+  bool open(const string& filename, bool verify=false, string* error=nullptr);
+
+  void close(void);
+
+  const Image& image(void) const { return im; }
+
+  // returns: true if the pixels are the mapped file itself.
+  bool is_mapped(void) const { return borrowed; }
+
+  private:
+
+  MappedFile file;
+  Image im;
+  bool borrowed=false;  // im.data points into the mapping
+  };
@@ -0,0 +1,405 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include "image.h"
+#include "image_writer.h"
+#include "stb_image_write.h"
+
+using namespace std;
+
+static const unsigned short lengthc[] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258,259 };
+static const unsigned char  lengtheb[]= { 0,0,0,0,0,0,0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const unsigned short distc[]   = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,32769 };
+static const unsigned char  disteb[]  = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+static const int WINDOW=32768;
+static const int HASH_BITS=15;
+
+static const int STRIP_BYTES=1<<17;  // uncompressed bytes of a PNG strip
+static const size_t BAND_BYTES=1<<24;  // uncompressed bytes of the bands write_png feeds
+
+static unsigned int bitrev(unsigned int code, int bits){
+  unsigned int r=0;
+  while(bits--){ r=(r<<1)|(code&1); code>>=1; }
+  return r;
+}
+
+static unsigned int hash3(const unsigned char* p){
+  unsigned int v=(p[0]<<16)|(p[1]<<8)|p[2];
+  return (v*2654435761u)>>(32-HASH_BITS);
+}
+
+void DeflateStream::put_bits(unsigned int code, int bits, vector<unsigned char>& out){
+  bitbuf|=code<<bitcount;
+  bitcount+=bits;
+  while(bitcount>=8){
+    out.push_back(bitbuf&0xff);
+    bitbuf>>=8;
+    bitcount-=8;
+  }
+}
+
+// Huffman codes are packed starting from the most significant bit.
+void DeflateStream::put_huff(unsigned int code, int bits, vector<unsigned char>& out){
+  put_bits(bitrev(code,bits),bits,out);
+}
+
+void DeflateStream::put_literal(int v, vector<unsigned char>& out){
+  if(v<=143)     put_huff(0x30+v,8,out);
+  else if(v<=255)put_huff(0x190+v-144,9,out);
+  else if(v<=279)put_huff(v-256,7,out);
+  else           put_huff(0xc0+v-280,8,out);
+}
+
+void DeflateStream::put_match(int len, int dist, vector<unsigned char>& out){
+  int j=0;
+  while(len>lengthc[j+1]-1)j++;
+  put_literal(j+257,out);
+  if(lengtheb[j])put_bits(len-lengthc[j],lengtheb[j],out);
+  j=0;
+  while(dist>distc[j+1]-1)j++;
+  put_huff(j,5,out);
+  if(disteb[j])put_bits(dist-distc[j],disteb[j],out);
+}
+
+void DeflateStream::write(const unsigned char* data, size_t n, vector<unsigned char>& out){
+  if(!n)return;
+
+  if(level<=0){
+    // Stored blocks.
+    for(size_t q1=0;q1<n;q1+=65535){
+      unsigned int len=min<size_t>(65535,n-q1);
+      put_bits(0,3,out);
+      if(bitcount)put_bits(0,8-bitcount,out);
+      put_bits(len&0xffff,16,out);
+      put_bits(~len&0xffff,16,out);
+      out.insert(out.end(),data+q1,data+q1+len);
+    }
+    return;
+  }
+
+  if(!started){
+    put_bits(0,1,out);  // BFINAL = 0
+    put_bits(1,2,out);  // BTYPE = 1 -- fixed huffman
+    started=true;
+  }
+
+  // The dictionary is the tail of the previous data.
+  int hist=window.size();
+  window.insert(window.end(),data,data+n);
+  const unsigned char* buf=window.data();
+  int len=window.size();
+
+  int chain=1<<(min(level,9)+1);
+  vector<int> head(1<<HASH_BITS,-1);
+  vector<int> prev(len,-1);
+  auto insert=[&](int p){ if(p+3<=len){ unsigned int hv=hash3(buf+p); prev[p]=head[hv]; head[hv]=p; } };
+  for(int q1=0;q1<hist;q1++)insert(q1);
+
+  for(int i=hist;i<len;){
+    int best=0, bestd=0;
+    if(i+3<=len){
+      int limit=min(258,len-i);
+      int steps=0;
+      for(int cand=head[hash3(buf+i)];cand>=0 && i-cand<=WINDOW && steps<chain;cand=prev[cand],steps++){
+        if(buf[cand+best]!=buf[i+best])continue;
+        int l=0;
+        while(l<limit && buf[cand+l]==buf[i+l])l++;
+        if(l>best){ best=l; bestd=i-cand; if(l==limit)break; }
+      }
+    }
+    if(best>=3){
+      put_match(best,bestd,out);
+      for(int q1=0;q1<best;q1++)insert(i+q1);
+      i+=best;
+    } else {
+      put_literal(buf[i],out);
+      insert(i);
+      i++;
+    }
+  }
+
+  if(len>WINDOW)window.erase(window.begin(),window.end()-WINDOW);
+}
+
+void DeflateStream::flush(vector<unsigned char>& out){
+  if(started)put_literal(256,out);  // end of block
+  started=false;
+  put_bits(0,3,out);  // BFINAL = 0, BTYPE = 0 -- stored
+  if(bitcount)put_bits(0,8-bitcount,out);
+  put_bits(0x0000,16,out);
+  put_bits(0xffff,16,out);
+}
+
+void DeflateStream::set_dictionary(const unsigned char* data, size_t n){
+  size_t k=min<size_t>(n,WINDOW);
+  window.assign(data+n-k,data+n);
+}
+
+void DeflateStream::finish(vector<unsigned char>& out){
+  if(started)put_literal(256,out);  // end of block
+  put_bits(1,1,out);  // BFINAL = 1, an empty fixed huffman block
+  put_bits(1,2,out);
+  put_literal(256,out);
+  if(bitcount)put_bits(0,8-bitcount,out);
+  started=false;
+  window.clear();
+}
+
+
+static unsigned int crc32(unsigned int crc, const unsigned char* data, size_t n){
+  static unsigned int table[256];
+  static bool init=[](){
+    for(unsigned int q1=0;q1<256;q1++){
+      unsigned int c=q1;
+      for(int q2=0;q2<8;q2++)c=(c&1)?0xedb88320u^(c>>1):c>>1;
+      table[q1]=c;
+    }
+    return true;
+  }();
+  (void)init;
+  crc=~crc;
+  for(size_t q1=0;q1<n;q1++)crc=table[(crc^data[q1])&0xff]^(crc>>8);
+  return ~crc;
+}
+
+static const unsigned int ADLER_BASE=65521;
+
+static unsigned int adler32(unsigned int adler, const unsigned char* data, size_t n){
+  unsigned int a=adler&0xffff, b=adler>>16;
+  for(size_t q1=0;q1<n;){
+    size_t e=min(n,q1+5552);
+    for(;q1<e;q1++){ a+=data[q1]; b+=a; }
+    a%=ADLER_BASE; b%=ADLER_BASE;
+  }
+  return (b<<16)|a;
+}
+
+// returns: adler32 of the concatenation of two pieces, given the checksums
+// of each of them and the length of the second one (as zlib's adler32_combine).
+static unsigned int adler32_combine(unsigned int adler1, unsigned int adler2, size_t len2){
+  unsigned long long rem=len2%ADLER_BASE;
+  unsigned long long a1=adler1&0xffff, b1=adler1>>16;
+  unsigned long long a2=adler2&0xffff, b2=adler2>>16;
+  unsigned long long a=(a1+a2+ADLER_BASE-1)%ADLER_BASE;
+  unsigned long long b=(rem*a1%ADLER_BASE+b1+b2+ADLER_BASE-rem)%ADLER_BASE;
+  return (unsigned int)((b<<16)|a);
+}
+
+static void put_be32(unsigned char* p, unsigned int v){
+  p[0]=v>>24; p[1]=v>>16; p[2]=v>>8; p[3]=v;
+}
+
+void row_to_uint8(const Image& im, int y, unsigned char* out){
+  for(int k=0;k<im.c;k++){
+    const float* row=im.RowPtr(y,k);
+    for(int x=0;x<im.w;x++){
+      float v=row[x];
+      v=v<0?0:(v>1?1:v);
+      out[x*im.c+k]=(unsigned char)(255*v+0.5f);
+    }
+  }
+}
+
+static unsigned char paeth(int a, int b, int c){
+  int p=a+b-c, pa=abs(p-a), pb=abs(p-b), pc=abs(p-c);
+  if(pa<=pb && pa<=pc)return a;
+  if(pb<=pc)return b;
+  return c;
+}
+
+// Filters the n bytes of row 'cur' (above it: 'up'), with the filter that gives
+// the smallest sum of absolute differences. out: filter type and n filtered bytes.
+static void filter_row(const unsigned char* cur, const unsigned char* up, int n, int c, unsigned char* out, unsigned char* line){
+  long best_cost=-1;
+  for(int type=0;type<5;type++){
+    line[0]=type;
+    long cost=0;
+    for(int i=0;i<n;i++){
+      int a=i>=c?cur[i-c]:0, b=up[i], d=i>=c?up[i-c]:0;
+      int pred=0;
+      if(type==1)pred=a;
+      if(type==2)pred=b;
+      if(type==3)pred=(a+b)>>1;
+      if(type==4)pred=paeth(a,b,d);
+      unsigned char v=cur[i]-pred;
+      line[i+1]=v;
+      cost+=abs((signed char)v);
+    }
+    if(best_cost<0 || cost<best_cost){ best_cost=cost; memcpy(out,line,n+1); }
+  }
+}
+
+void PngWriter::write_chunk(const char* type, const unsigned char* data, size_t n){
+  unsigned char hdr[8];
+  put_be32(hdr,n);
+  memcpy(hdr+4,type,4);
+  unsigned int crc=crc32(0,hdr+4,4);
+  crc=crc32(crc,data,n);
+  unsigned char tail[4];
+  put_be32(tail,crc);
+  fwrite(hdr,1,8,f);
+  fwrite(data,1,n,f);
+  fwrite(tail,1,4,f);
+}
+
+void PngWriter::flush_idat(bool all){
+  if(idat.size()>=(1u<<16) || (all && idat.size())){
+    write_chunk("IDAT",idat.data(),idat.size());
+    idat.clear();
+  }
+}
+
+bool PngWriter::open(const string& filename, int w_, int h_, int c_, int level_){
+  static const unsigned char sig[8]={0x89,'P','N','G','\r','\n',0x1a,'\n'};
+  static const unsigned char ctype[5]={0,0,4,2,6};
+  assert(c_>=1 && c_<=4);
+
+  f=fopen(filename.c_str(),"wb");
+  if(!f)return false;
+  w=w_; h=h_; c=c_;
+  level=level_;
+  written=0;
+  adler=1;
+  prev.assign(w*c,0);
+  tail.clear();
+
+  fwrite(sig,1,8,f);
+  unsigned char ihdr[13];
+  put_be32(ihdr,w);
+  put_be32(ihdr+4,h);
+  ihdr[8]=8;          // bit depth
+  ihdr[9]=ctype[c];   // color type
+  ihdr[10]=ihdr[11]=ihdr[12]=0;
+  write_chunk("IHDR",ihdr,13);
+
+  idat.assign({0x78,0x5e});  // zlib header
+  return true;
+}
+
+void PngWriter::write_rows(const Image& im, int y0, int rows){
+  assert(f && im.w==w && im.c==c && y0>=0 && y0+rows<=im.h);
+  if(rows<=0)return;
+  int n=w*c;
+  size_t stride=n+1;
+  int strip=max(1,STRIP_BYTES/n);
+  int strips=(rows+strip-1)/strip;
+  filtered.resize(stride*rows);
+
+  // Every strip converts the row above it again, to filter its first row.
+  parallel_for(0,strips,[&](int s){
+    int a=s*strip, b=min(rows,a+strip);
+    vector<unsigned char> up(n), cur(n), line(stride);
+    if(a==0)up=prev;
+    else row_to_uint8(im,y0+a-1,up.data());
+    for(int y=a;y<b;y++){
+      row_to_uint8(im,y0+y,cur.data());
+      filter_row(cur.data(),up.data(),n,c,&filtered[stride*y],line.data());
+      swap(up,cur);
+    }
+  });
+  row_to_uint8(im,y0+rows-1,prev.data());
+
+  vector<vector<unsigned char>> out(strips);
+  vector<unsigned int> sums(strips);
+  parallel_for(0,strips,[&](int s){
+    size_t a=stride*s*strip, b=min(filtered.size(),a+stride*strip);
+    DeflateStream zs(level);
+    if(a)zs.set_dictionary(filtered.data(),a);
+    else zs.set_dictionary(tail.data(),tail.size());
+    zs.write(filtered.data()+a,b-a,out[s]);
+    zs.flush(out[s]);
+    sums[s]=adler32(1,filtered.data()+a,b-a);
+  });
+
+  for(int s=0;s<strips;s++){
+    size_t a=stride*s*strip, b=min(filtered.size(),a+stride*strip);
+    adler=adler32_combine(adler,sums[s],b-a);
+    idat.insert(idat.end(),out[s].begin(),out[s].end());
+    vector<unsigned char>().swap(out[s]);
+    flush_idat(false);
+  }
+
+  // the dictionary of the next strip
+  size_t k=min<size_t>(filtered.size(),WINDOW);
+  if(k<WINDOW)tail.insert(tail.end(),filtered.end()-k,filtered.end());
+  else tail.assign(filtered.end()-k,filtered.end());
+  if(tail.size()>WINDOW)tail.erase(tail.begin(),tail.end()-WINDOW);
+  written+=rows;
+}
+
+bool PngWriter::close(void){
+  if(!f)return false;
+  DeflateStream().finish(idat);
+  unsigned char sum[4];
+  put_be32(sum,adler);
+  idat.insert(idat.end(),sum,sum+4);
+  flush_idat(true);
+  write_chunk("IEND",nullptr,0);
+  bool ok=!ferror(f) && written==h;
+  ok=!fclose(f) && ok;
+  f=nullptr;
+  return ok;
+}
+
+
+bool write_png(const Image& im, const string& filename, int level){
+  PngWriter png;
+  if(!png.open(filename,im.w,im.h,im.c,level))return false;
+  int band=max<size_t>(1,BAND_BYTES/((size_t)im.w*im.c));
+  for(int y=0;y<im.h;y+=band)png.write_rows(im,y,min(band,im.h-y));
+  return png.close();
+}
+
+bool write_jpg(const Image& im, const string& filename, int quality){
+  vector<unsigned char> data((size_t)im.w*im.h*im.c);
+  parallel_for_ranges(0,im.h,64,[&](int y0, int y1){
+    for(int y=y0;y<y1;y++)row_to_uint8(im,y,&data[(size_t)y*im.w*im.c]);
+  });
+  return stbi_write_jpg(filename.c_str(),im.w,im.h,im.c,data.data(),quality);
+}
+
+
+AsyncImageWriter::AsyncImageWriter(size_t capacity) : q(capacity) {
+  th=thread([this](){
+    Job j;
+    while(q.pop(j)){
+      string file=j.name+(j.png?".png":".jpg");
+      bool ok=j.png?write_png(*j.im,file,j.level):write_jpg(*j.im,file);
+      if(!ok)fprintf(stderr, "Failed to write image %s\n", file.c_str());
+      j=Job();
+      lock_guard<mutex> LG(m);
+      if(!ok)failed=true;
+      pending--;
+      done.notify_all();
+    }
+  });
+}
+
+AsyncImageWriter::~AsyncImageWriter(){
+  q.close();
+  th.join();
+}
+
+void AsyncImageWriter::save(shared_ptr<const Image> im, const string& name, bool png, int level){
+    {
+    lock_guard<mutex> LG(m);
+    pending++;
+    }
+  Job j;
+  j.im=move(im);
+  j.name=name;
+  j.png=png;
+  j.level=level;
+  q.push(move(j));
+}
+
+bool AsyncImageWriter::wait(void){
+  unique_lock<mutex> LG(m);
+  done.wait(LG,[this](){ return pending==0; });
+  bool ok=!failed;
+  failed=false;
+  return ok;
+}
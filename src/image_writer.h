@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdio>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "image.h"
+#include "pipeline.h"
+
+using namespace std;
+
+// Deflate encoder (LZ77 + fixed Huffman codes) that compresses its input
+// piece by piece, keeping the last 32KB as dictionary for the next piece.
+class DeflateStream
+  {
+  public:
+
+  // level: 0 stores the data, 1..9 is the length of the searched hash chains.
+  explicit DeflateStream(int level=6) : level(level) {}
+
+  // Compresses n more bytes, appending the output to 'out'.
+  void write(const unsigned char* data, size_t n, vector<unsigned char>& out);
+
+  // Ends the current block and aligns the output to a byte with an empty stored
+  // block: the output of streams flushed like this can be concatenated.
+  void flush(vector<unsigned char>& out);
+
+  // Ends the stream.
+  void finish(vector<unsigned char>& out);
+
+  // Uses the last 32KB of 'data' as dictionary, as if they had just been compressed:
+  // a stream can start where another one, compressing the data before, ends.
+  void set_dictionary(const unsigned char* data, size_t n);
+
+  private:
+
+  void put_bits(unsigned int code, int bits, vector<unsigned char>& out);
+  void put_huff(unsigned int code, int bits, vector<unsigned char>& out);
+  void put_literal(int v, vector<unsigned char>& out);
+  void put_match(int len, int dist, vector<unsigned char>& out);
+
+  int level;
+  bool started=false;
+  unsigned int bitbuf=0;
+  int bitcount=0;
+  vector<unsigned char> window;
+  };
+
+// PNG encoder fed by bands of rows: memory use is bounded by the band size,
+// not by the size of the image.
+// A band is cut in strips that are converted, filtered and compressed in parallel
+// on the pool: every strip is an independent deflate stream, flushed to a byte
+// boundary, that has the data before it as dictionary (as pigz does).
+class PngWriter
+  {
+  public:
+
+  ~PngWriter() { if(f)fclose(f); }
+
+  // level: 0 stores the data, 1..9 compresses better and slower.
+  bool open(const string& filename, int w, int h, int c, int level=6);
+
+  // Appends 'rows' (planar float, w x n x c) to the image.
+  void write_rows(const Image& rows) { write_rows(rows,0,rows.h); }
+
+  // Appends rows [y0,y0+n) of im to the image.
+  void write_rows(const Image& im, int y0, int n);
+
+  bool close(void);
+
+  private:
+
+  void write_chunk(const char* type, const unsigned char* data, size_t n);
+  void flush_idat(bool all);
+
+  FILE* f=nullptr;
+  int w=0, h=0, c=0;
+  int level=6;
+  int written=0;
+  unsigned int adler=1;
+  vector<unsigned char> prev, filtered, tail, idat;
+  };
+
+// Saves the whole image as a PNG file, a band of rows at a time.
+// returns: false if the file could not be written.
+bool write_png(const Image& im, const string& filename, int level=6);
+
+// Saves the image as a JPEG file with stb (which needs all the 8 bit pixels at once).
+bool write_jpg(const Image& im, const string& filename, int quality=100);
+
+// Saves images on a thread of its own, so the threads producing them go on
+// computing while the images are encoded. The queue is bounded: save() waits
+// while it is full, so the images waiting to be written cannot pile up.
+class AsyncImageWriter
+  {
+  public:
+
+  explicit AsyncImageWriter(size_t capacity=8);
+
+  // Waits for the queued images.
+  ~AsyncImageWriter();
+
+  // Queues 'im' to be saved as 'name'.png (png) or 'name'.jpg. The image is shared, not copied.
+  void save(shared_ptr<const Image> im, const string& name, bool png=true, int level=6);
+
+  // Waits for all the queued images. returns: false if some of them could not be written.
+  bool wait(void);
+
+  private:
+
+  struct Job
+    {
+    shared_ptr<const Image> im;
+    string name;
+    bool png=true;
+    int level=6;
+    };
+
+  BoundedQueue<Job> q;
+  thread th;
+  mutex m;
+  condition_variable done;
+  int pending=0;
+  bool failed=false;
+  };
+
+// Converts one row of a planar float image into interleaved 8 bit pixels.
+void row_to_uint8(const Image& im, int y, unsigned char* out);
@@ -0,0 +1,56 @@
+#include <cstdlib>
+#include <cstdio>
+#include <stdexcept>
+
+#include "job_graph.h"
+
+using namespace std;
+
+bool JobGraph::add(const string& key, const vector<string>& deps, function<void()> f){
+  if(contains(key))return false;
+  Job* j=new Job;
+  j->deps=deps;
+  j->f=move(f);
+  jobs[key].reset(j);
+  return true;
+}
+
+void JobGraph::run(ThreadPool& pool){
+  for(auto&e1:jobs){
+    Job& j=*e1.second;
+    j.next.clear();
+    j.missing=j.deps.size();
+  }
+  for(auto&e1:jobs)for(auto&e2:e1.second->deps){
+    auto it=jobs.find(e2);
+    if(it==jobs.end())throw invalid_argument("JobGraph: "+e1.first+" depends on unknown job "+e2);
+    it->second->next.push_back(e1.second.get());
+  }
+
+  // Every job must be reachable from the ones without dependencies.
+  vector<Job*> ready;
+  for(auto&e1:jobs)if(!e1.second->missing)ready.push_back(e1.second.get());
+    {
+    map<Job*,int> missing;
+    for(auto&e1:jobs)missing[e1.second.get()]=e1.second->deps.size();
+    vector<Job*> todo=ready;
+    size_t reached=0;
+    while(!todo.empty()){
+      Job* j=todo.back();
+      todo.pop_back();
+      reached++;
+      for(Job* n:j->next)if(--missing[n]==0)todo.push_back(n);
+    }
+    if(reached!=jobs.size())throw invalid_argument("JobGraph: the dependencies have a cycle");
+    }
+
+  TaskGroup g(pool);
+  function<void(Job*)> start=[&](Job* j){
+    g.run([&,j](){
+      j->f();
+      for(Job* n:j->next)if(--n->missing==0)start(n);
+    });
+  };
+  for(Job* j:ready)start(j);
+  g.wait();
+}
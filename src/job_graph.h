@@ -0,0 +1,42 @@
+#pragma once
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "thread_pool.h"
+
+using namespace std;
+
+// A graph of jobs, identified by the key of what they compute.
+// A job runs on the pool as soon as all the jobs it depends on are done,
+// so independent branches never wait for each other.
+// Adding a key that is already in the graph keeps the first job: the same
+// result is never computed twice.
+class JobGraph
+  {
+  public:
+
+  // returns: false if 'key' was already in the graph.
+  bool add(const string& key, const vector<string>& deps, function<void()> f);
+
+  bool contains(const string& key) const { return jobs.count(key)!=0; }
+
+  // Runs all the jobs. Throws invalid_argument for unknown dependencies or cycles;
+  // if a job throws, the jobs depending on it are skipped and the exception is rethrown.
+  void run(ThreadPool& pool=ThreadPool::instance());
+
+  private:
+
+  struct Job
+    {
+    vector<string> deps;
+    function<void()> f;
+    vector<Job*> next;
+    atomic<int> missing{0};
+    };
+
+  map<string,unique_ptr<Job>> jobs;
+  };
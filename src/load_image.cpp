@@ -3,92 +3,267 @@
 #include <cstdlib>
 
 #include <string>
+#include <stdexcept>
 
 
 #include "image.h"
+#include "image_writer.h"
+#include "image_file.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-void save_image_stb(const Image& im, const string& name, int png)
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// PNG goes through the parallel strip encoder, JPEG through stb.
+void Image::save_png(const string& name, int level) const
   {
-  unsigned char *data = (unsigned char *)calloc(im.w*im.h*im.c, sizeof(char));
-  
-  for(int k = 0; k < im.c; ++k)for(int i = 0; i < im.w*im.h; ++i)
-    data[i*im.c+k] = (unsigned char) roundf((255*im.data[i + k*im.w*im.h]));
-  
-  string file=name + (png?".png":".jpg");
-  
-  int success = 0;
-  if(png)success = stbi_write_png(file.c_str(), im.w, im.h, im.c, data, im.w*im.c);
-  else   success = stbi_write_jpg(file.c_str(), im.w, im.h, im.c, data, 100);
-  
-  free(data);
-  
-  if(!success) fprintf(stderr, "Failed to write image %s\n", file.c_str());
+  string file = name + ".png";
+  if(!write_png(*this, file, level)) fprintf(stderr, "Failed to write image %s\n", file.c_str());
+  }
+
+void Image::save_image(const string& name) const
+  {
+  string file = name + ".jpg";
+  if(!write_jpg(*this, file)) fprintf(stderr, "Failed to write image %s\n", file.c_str());
+  }
+
+// Interleaved 8 bit rows to planar floats.
+// With AVX2, 16 pixels at a time: the c input registers are shuffled into one
+// register per channel, then widened to floats and divided by 255.
+#ifdef __AVX2__
+struct DeinterleaveMasks
+  {
+  __m128i m[4][4];  // [channel][input register]
+  DeinterleaveMasks(int c)
+    {
+    for(int k=0;k<c;k++)for(int r=0;r<c;r++)
+      {
+      alignas(16) unsigned char b[16];
+      for(int o=0;o<16;o++){ int src=c*o+k; b[o]=(src/16==r)?src%16:0x80; }
+      m[k][r]=_mm_load_si128((const __m128i*)b);
+      }
+    }
+  };
+
+static inline __m128i gather_channel(const __m128i* in, const DeinterleaveMasks& M, int c, int k)
+  {
+  __m128i v=_mm_shuffle_epi8(in[0],M.m[k][0]);
+  for(int r=1;r<c;r++)v=_mm_or_si128(v,_mm_shuffle_epi8(in[r],M.m[k][r]));
+  return v;
   }
 
-void Image::save_png(const string& name) const { save_image_stb(*this, name, 1); }
+static inline void widen(__m128i v, __m256 scale, __m256& lo, __m256& hi)
+  {
+  lo=_mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)),scale);
+  hi=_mm256_div_ps(_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v,8))),scale);
+  }
+#endif
+
+// 'planes' channels of an interleaved row with c channels (planes<=c).
+static void deinterleave_row(const unsigned char* src, int w, int c, float* const* out, int planes)
+  {
+  int i=0;
+#ifdef __AVX2__
+  static const DeinterleaveMasks M3(3), M4(4);
+  const DeinterleaveMasks* M=c==3?&M3:(c==4?&M4:nullptr);
+  const __m256 scale=_mm256_set1_ps(255.f);
+  if(c==1)for(;i+16<=w;i+=16)
+    {
+    __m256 lo,hi;
+    widen(_mm_loadu_si128((const __m128i*)(src+i)),scale,lo,hi);
+    _mm256_storeu_ps(out[0]+i,lo);
+    _mm256_storeu_ps(out[0]+i+8,hi);
+    }
+  if(M)for(;i+16<=w;i+=16)
+    {
+    __m128i in[4];
+    for(int r=0;r<c;r++)in[r]=_mm_loadu_si128((const __m128i*)(src+c*i+16*r));
+    for(int k=0;k<planes;k++)
+      {
+      __m256 lo,hi;
+      widen(gather_channel(in,*M,c,k),scale,lo,hi);
+      _mm256_storeu_ps(out[k]+i,lo);
+      _mm256_storeu_ps(out[k]+i+8,hi);
+      }
+    }
+#endif
+  for(;i<w;i++)for(int k=0;k<planes;k++)out[k][i]=src[c*i+k]/255.f;
+  }
 
-void Image::save_image(const string& name) const { save_image_stb(*this, name, 0); }
+// Luma of an interleaved row (same weights as rgb_to_grayscale).
+static void gray_row(const unsigned char* src, int w, int c, float* out)
+  {
+  if(c<3){ deinterleave_row(src,w,c,&out,1); return; }
+  int i=0;
+#if defined(__AVX2__) && defined(__FMA__)
+  static const DeinterleaveMasks M3(3), M4(4);
+  const DeinterleaveMasks& M=c==3?M3:M4;
+  const __m256 scale=_mm256_set1_ps(255.f);
+  const __m256 wr=_mm256_set1_ps(0.299f), wg=_mm256_set1_ps(0.587f), wb=_mm256_set1_ps(0.114f);
+  for(;i+16<=w;i+=16)
+    {
+    __m128i in[4];
+    for(int r=0;r<c;r++)in[r]=_mm_loadu_si128((const __m128i*)(src+c*i+16*r));
+    __m256 r0,r1,g0,g1,b0,b1;
+    widen(gather_channel(in,M,c,0),scale,r0,r1);
+    widen(gather_channel(in,M,c,1),scale,g0,g1);
+    widen(gather_channel(in,M,c,2),scale,b0,b1);
+    _mm256_storeu_ps(out+i  ,_mm256_fmadd_ps(wb,b0,_mm256_fmadd_ps(wg,g0,_mm256_mul_ps(wr,r0))));
+    _mm256_storeu_ps(out+i+8,_mm256_fmadd_ps(wb,b1,_mm256_fmadd_ps(wg,g1,_mm256_mul_ps(wr,r1))));
+    }
+#endif
+  for(;i<w;i++)
+    {
+    const unsigned char* p=src+c*i;
+    out[i]=0.299f*(p[0]/255.f)+0.587f*(p[1]/255.f)+0.114f*(p[2]/255.f);
+    }
+  }
+
+// Unpacks interleaved row j into planar float rows.
+static void unpack_row(const unsigned char* data, int w, int c, int j, bool gray, float* const* out, int planes)
+  {
+  const unsigned char* row = data + (size_t)c*w*j;
+  if(gray)gray_row(row, w, c, out[0]);
+  else deinterleave_row(row, w, c, out, planes);
+  }
 
 // 
 // Load an image using stb
 // channels = [0..4]
 // channels > 0 forces the image to have that many channels
+// gray: the image is converted to one luma channel while it is unpacked
+// scale: the image is reduced by this factor while it is unpacked, averaging scale x scale boxes
+// returns: false (and the reason in 'error') if the file cannot be decoded
 //
-Image load_image_stb(const string& filename, int channels)
+static bool load_image_stb(const string& filename, Image& im, int channels, bool gray, int scale, string* error)
   {
+  if (scale < 1) throw invalid_argument("load_image: the scale must be at least 1");
+  
   int w, h, c;
   unsigned char *data = stbi_load(filename.c_str(), &w, &h, &c, channels);
   if (!data)
     {
-    fprintf(stderr, "Cannot load image \"%s\"\nSTB Reason: %s\n", filename.c_str(), stbi_failure_reason());
-    exit(0);
+    if(error)*error = "Cannot load image \"" + filename + "\"\nSTB Reason: " + stbi_failure_reason();
+    return false;
     }
   
   if (channels) c = channels;
   
-  Image im(w, h, c);
+  //We don't like alpha channels, #YOLO
+  int planes = gray ? 1 : (c == 4 ? 3 : c);
   
-  for(int k = 0; k < c; ++k)
-    for(int j = 0; j < h; ++j)
-      for(int i = 0; i < w; ++i)
+  if (scale == 1)
+    {
+    im = Image(w, h, planes);
+    parallel_for_ranges(0, h, 64, [&](int y0, int y1)
+      {
+      for(int j = y0; j < y1; ++j)
         {
-        int dst_index = i + w*j + w*h*k;
-        int src_index = k + c*i + c*w*j;
-        im.data[dst_index] = (float)data[src_index]/255.f;
+        float* out[4];
+        for(int k = 0; k < planes; ++k)out[k] = im.RowPtr(j, k);
+        unpack_row(data, w, c, j, gray, out, planes);
         }
-  //We don't like alpha channels, #YOLO
-  if(im.c == 4) im.c = 3;
-  free(data);
+      });
+    }
+  else
+    {
+    // stb has no reduced decode: each box of rows is unpacked at full width, then averaged
+    int sw = max(1, w/scale), sh = max(1, h/scale);
+    im = Image(sw, sh, planes);
+    parallel_for_ranges(0, sh, 16, [&](int y0, int y1)
+      {
+      vector<float> rows((size_t)w*planes);
+      vector<float> sum((size_t)w*planes);
+      float* out[4];
+      for(int k = 0; k < planes; ++k)out[k] = rows.data() + (size_t)w*k;
+      for(int j = y0; j < y1; ++j)
+        {
+        fill(sum.begin(), sum.end(), 0.f);
+        int n = 0;
+        for(int q2 = j*scale; q2 < min(h, (j+1)*scale); q2++, n++)
+          {
+          unpack_row(data, w, c, q2, gray, out, planes);
+          for(size_t q1 = 0; q1 < sum.size(); q1++)sum[q1] += rows[q1];
+          }
+        for(int k = 0; k < planes; ++k)
+          {
+          float* dst = im.RowPtr(j, k);
+          const float* src = sum.data() + (size_t)w*k;
+          for(int i = 0; i < sw; ++i)
+            {
+            float v = 0;
+            int m = 0;
+            for(int q1 = i*scale; q1 < min(w, (i+1)*scale); q1++, m++)v += src[q1];
+            dst[i] = v/(n*m);
+            }
+          }
+        }
+      });
+    }
+  
+  stbi_image_free(data);
+  return true;
+  }
+
+bool try_load_image(const string& filename, Image& im, int channels, string* error)
+  {
+  return load_image_stb(filename, im, channels, false, 1, error);
+  }
+
+void Image::load_image(const string& filename)
+  {
+  string error;
+  if(!load_image_stb(filename, *this, 0, false, 1, &error))throw runtime_error(error);
+  }
+
+Image load_image(const string& filename, int scale)
+  {
+  Image im;
+  string error;
+  if(!load_image_stb(filename, im, 0, false, scale, &error))throw runtime_error(error);
   return im;
   }
 
-void Image::load_image(const string& filename) { *this=load_image_stb(filename,0); }
+Image load_image_gray(const string& filename, int scale)
+  {
+  Image im;
+  string error;
+  if(!load_image_stb(filename, im, 0, true, scale, &error))throw runtime_error(error);
+  return im;
+  }
+
+int image_channels(const string& filename)
+  {
+  int w, h, c;
+  if(!stbi_info(filename.c_str(), &w, &h, &c))return 0;
+  return c == 4 ? 3 : c;
+  }
+
+// Files are decoded concurrently on the pool, each one unpacked by rows in parallel.
+vector<Image> load_images(const vector<string>& filenames, int channels, int scale)
+  {
+  vector<Image> ims(filenames.size());
+  vector<string> errors(filenames.size());
+  parallel_for(0, filenames.size(), [&](int i){ load_image_stb(filenames[i], ims[i], channels, false, scale, &errors[i]); });
+  for(auto&e1:errors)if(!e1.empty())throw runtime_error(e1);
+  return ims;
+  }
 
 
+// See image_file.h for the format.
 void Image::save_binary(const string& filename) const
   {
-  FILE*fn=fopen(filename.c_str(),"wb");
-  fwrite(&w,sizeof(w),1,fn);
-  fwrite(&h,sizeof(h),1,fn);
-  fwrite(&c,sizeof(c),1,fn);
-  fwrite(data,sizeof(float),size(),fn);
-  fclose(fn);
+  if(!write_binary(*this, filename)) fprintf(stderr, "Failed to write image %s\n", filename.c_str());
   }
 
+// The pixels are decoded from the mapped file straight into the image.
 void Image::load_binary(const string& filename)
   {
-  int w,h,c;
-  FILE*fn=fopen(filename.c_str(),"rb");
-  fread(&w,sizeof(w),1,fn);
-  fread(&h,sizeof(h),1,fn);
-  fread(&c,sizeof(c),1,fn);
-  Image im(w,h,c);
-  fread(im.data,sizeof(float),im.size(),fn);
-  fclose(fn);
-  *this=im;
+  string error;
+  if(!read_binary(filename, *this, &error))throw runtime_error(error);
   }
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+// A file mapped in memory. Used as out-of-core storage: pages of a shared
+// file mapping can be written back and dropped by the kernel at any time,
+// so the resident memory stays bounded whatever the size of the file.
+struct MappedFile
+  {
+  unsigned char* data=nullptr;
+  size_t size=0;
+  int fd=-1;
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  MappedFile(MappedFile&& from) { *this=move(from); }
+  MappedFile& operator=(MappedFile&& from)
+    {
+    if(this==&from)return *this;
+    close();
+    data=from.data; size=from.size; fd=from.fd;
+    from.data=nullptr; from.size=0; from.fd=-1;
+    return *this;
+    }
+
+  ~MappedFile() { close(); }
+
+  // Anonymous scratch space of 'bytes' bytes, backed by an unlinked file in $TMPDIR.
+  bool create_scratch(size_t bytes)
+    {
+    const char* dir=getenv("TMPDIR");
+    string name=string(dir?dir:"/tmp")+"/uwimg-XXXXXX";
+    int f=mkstemp(&name[0]);
+    if(f<0)return false;
+    unlink(name.c_str());
+    return attach(f,bytes,true);
+    }
+
+  // A new file of 'bytes' bytes, mapped read/write.
+  bool create(const string& filename, size_t bytes)
+    {
+    int f=::open(filename.c_str(),O_RDWR|O_CREAT|O_TRUNC,0644);
+    if(f<0)return false;
+    return attach(f,bytes,true);
+    }
+
+  // An existing file, mapped read-only (private: writes to 'data' are not allowed).
+  bool open(const string& filename)
+    {
+    int f=::open(filename.c_str(),O_RDONLY);
+    if(f<0)return false;
+    struct stat st;
+    if(fstat(f,&st)){::close(f);return false;}
+    return attach(f,st.st_size,false);
+    }
+
+  // Lets the kernel drop the pages of [offset,offset+bytes) from the resident set.
+  void release(size_t offset, size_t bytes)
+    {
+    size_t page=sysconf(_SC_PAGESIZE);
+    size_t b=(offset+page-1)/page*page;
+    size_t e=min(size,offset+bytes)/page*page;
+    if(e>b)madvise(data+b,e-b,MADV_DONTNEED);
+    }
+
+  void close(void)
+    {
+    if(data)munmap(data,size);
+    if(fd>=0)::close(fd);
+    data=nullptr; size=0; fd=-1;
+    }
+
+  private:
+
+  bool attach(int f, size_t bytes, bool writable)
+    {
+    close();
+    if(writable && ftruncate(f,bytes)){::close(f);return false;}
+    void* p=bytes?mmap(nullptr,bytes,writable?PROT_READ|PROT_WRITE:PROT_READ,MAP_SHARED,f,0):nullptr;
+    if(p==MAP_FAILED){::close(f);return false;}
+    data=(unsigned char*)p; size=bytes; fd=f;
+    return true;
+    }
+  };
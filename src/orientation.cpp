@@ -0,0 +1,129 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cassert>
+
+#include <algorithm>
+
+#include "image.h"
+#include "feature_registry.h"
+#include "orientation.h"
+
+using namespace std;
+
+// Bins of the histogram of gradient directions (11.25 degrees each). The diagonals and the
+// axes fall in the middle of a bin, so the gradients of 8 bit images are never on the fence.
+static const int HIST_BINS=32;
+
+// returns: bin of the angle a (radians) among n bins of the circle, bin 0 centered on 0.
+static int angle_bin(float a, int n){
+  int b=(int)lroundf(a*n/(2*(float)M_PI));
+  return (b%n+n)%n;
+}
+
+OrientedPatchExtractor::OrientedPatchExtractor(int window, int method, int radius, int bins)
+  : window(window), method(method), radius(radius>0 ? radius : max(window,10)), bins(bins) {
+  assert(bins>0);
+  reach=this->radius+1;  // the histogram takes the gradient of the disc's rim
+  taps.resize(bins);
+  for(int q=0;q<bins;q++){
+    double t=2*M_PI*q/bins, c=cos(t), s=sin(t);
+    for(int dx=-window/2;dx<=window/2;dx++)for(int dy=-window/2;dy<=window/2;dy++){
+      double fx=c*dx-s*dy, fy=s*dx+c*dy;
+      // the right angles land on pixels exactly
+      if(fabs(fx-lround(fx))<1e-9)fx=lround(fx);
+      if(fabs(fy-lround(fy))<1e-9)fy=lround(fy);
+      Tap p;
+      p.dx=(int)floor(fx);
+      p.dy=(int)floor(fy);
+      float ax=(float)(fx-p.dx), ay=(float)(fy-p.dy);
+      p.w00=(1-ax)*(1-ay);
+      p.w10=ax*(1-ay);
+      p.w01=(1-ax)*ay;
+      p.w11=ax*ay;
+      taps[q].push_back(p);
+      reach=max(reach,max(max(abs(p.dx),abs(p.dx+1)),max(abs(p.dy),abs(p.dy+1))));
+    }
+  }
+  float sigma=this->radius*0.5f;
+  for(int dy=-this->radius;dy<=this->radius;dy++)for(int dx=-this->radius;dx<=this->radius;dx++)
+    if(dx*dx+dy*dy<=this->radius*this->radius)disc.push_back({dx,dy,expf(-(dx*dx+dy*dy)/(2*sigma*sigma))});
+}
+
+// Inside the image the neighbourhood is the image itself; near the border its clamped
+// pixels are copied to buf, so the sampling is the same everywhere.
+OrientedPatchExtractor::Neighbourhood OrientedPatchExtractor::neighbourhood(const Image& im, int x, int y, vector<float>& buf) const {
+  if(x>=reach && y>=reach && x+reach<im.w && y+reach<im.h)return {im.RowPtr(y,0)+x, im.w, im.w*im.h, im.c};
+  int s=2*reach+1;
+  buf.resize((size_t)s*s*im.c);
+  for(int c=0;c<im.c;c++)for(int dy=-reach;dy<=reach;dy++)for(int dx=-reach;dx<=reach;dx++)
+    buf[((size_t)c*s+dy+reach)*s+dx+reach]=im.clamped_pixel(x+dx,y+dy,c);
+  return {buf.data()+reach*s+reach, s, s*s, im.c};
+}
+
+// The channels are summed: the orientation is the same for every channel.
+float OrientedPatchExtractor::orientation(const Neighbourhood& n) const {
+  if(method==ORIENT_CENTROID){
+    float m10=0, m01=0;
+    for(auto&e1:disc){
+      const float* q=n.p+e1.dy*n.stride+e1.dx;
+      float v=0;
+      for(int c=0;c<n.c;c++)v+=q[c*n.plane];
+      m10+=e1.dx*v;
+      m01+=e1.dy*v;
+    }
+    return m10==0 && m01==0 ? 0.f : atan2f(m01,m10);
+  }
+
+  float h[HIST_BINS]={0}, t[HIST_BINS];
+  for(auto&e1:disc){
+    const float* q=n.p+e1.dy*n.stride+e1.dx;
+    float gx=0, gy=0;
+    for(int c=0;c<n.c;c++){
+      const float* r=q+c*n.plane;
+      gx+=r[1]-r[-1];
+      gy+=r[n.stride]-r[-n.stride];
+    }
+    float m=sqrtf(gx*gx+gy*gy);
+    if(m>0)h[angle_bin(atan2f(gy,gx),HIST_BINS)]+=e1.weight*m;
+  }
+  // smoothed twice with [1 2 1]/4, around the circle
+  for(int q1=0;q1<2;q1++){
+    for(int k=0;k<HIST_BINS;k++)t[k]=0.25f*(h[(k+HIST_BINS-1)%HIST_BINS]+2*h[k]+h[(k+1)%HIST_BINS]);
+    copy(t,t+HIST_BINS,h);
+  }
+  int k=max_element(h,h+HIST_BINS)-h;
+  if(h[k]<=0)return 0.f;
+  // the peak between the bins, from the parabola through the largest and its neighbours
+  float l=h[(k+HIST_BINS-1)%HIST_BINS], r=h[(k+1)%HIST_BINS], den=l-2*h[k]+r;
+  float a=(k+(den<0 ? 0.5f*(l-r)/den : 0.f))*2*(float)M_PI/HIST_BINS;
+  return a>(float)M_PI ? a-2*(float)M_PI : a;
+}
+
+float OrientedPatchExtractor::orientation(const Image& im, int x, int y) const {
+  vector<float> buf;
+  return orientation(neighbourhood(im,x,y,buf));
+}
+
+Descriptor OrientedPatchExtractor::describe(const Image& im, const Descriptor& k) const {
+  vector<float> buf;
+  Neighbourhood n=neighbourhood(im,lround(k.p.x),lround(k.p.y),buf);
+  Descriptor d(k.p);
+  d.scale=k.scale;
+  d.angle=orientation(n);
+  const vector<Tap>& tp=taps[angle_bin(d.angle,bins)];
+  d.data.reserve(tp.size()*im.c);
+  for(int c=0;c<im.c;c++){
+    const float* p=n.p+c*n.plane;
+    float cval=*p;
+    for(auto&e1:tp){
+      const float* q=p+e1.dy*n.stride+e1.dx;
+      d.data.push_back(e1.w00*q[0]+e1.w10*q[1]+e1.w01*q[n.stride]+e1.w11*q[n.stride+1]-cval);
+    }
+  }
+  return d;
+}
+
+static ExtractorRegistration oriented_patch_extractor("oriented-patch", [](const DetectorParams& p){
+  return unique_ptr<DescriptorExtractor>(new OrientedPatchExtractor(p.window,p.orientation));
+});
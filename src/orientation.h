@@ -0,0 +1,59 @@
+#pragma once
+
+#include <vector>
+
+#include "image.h"
+#include "feature_registry.h"
+
+using namespace std;
+
+// The window x window patch of describe_index, sampled in the frame of the keypoint's
+// orientation: a point keeps its descriptor when the camera rolls. The orientation is found
+// in the disc of the given radius (0: the window, at least 10) and quantized to 'bins' angles.
+// The bilinear offsets and weights of the rotated patch are tabled once per angle, so
+// every keypoint costs the same whatever its angle. At angle 0 the patch is describe_index's.
+class OrientedPatchExtractor : public DescriptorExtractor
+  {
+  public:
+
+  explicit OrientedPatchExtractor(int window, int method=ORIENT_CENTROID, int radius=0, int bins=32);
+
+  using DescriptorExtractor::describe;
+
+  // returns: the rotated patch of im at k, with its angle.
+  Descriptor describe(const Image& im, const Descriptor& k) const override;
+
+  // returns: orientation of the keypoint at pixel (x,y) of im, in radians from the x axis
+  // towards the y axis, in [-pi,pi].
+  float orientation(const Image& im, int x, int y) const;
+
+  private:
+
+  // A sample of the patch: between pixels (dx,dy) and (dx+1,dy+1) of the keypoint.
+  struct Tap
+    {
+    int dx, dy;
+    float w00, w10, w01, w11;
+    };
+
+  // A pixel of the orientation disc and its weight.
+  struct DiscPixel
+    {
+    int dx, dy;
+    float weight;
+    };
+
+  // The pixels within reach of a keypoint: p points at the keypoint in channel 0.
+  struct Neighbourhood
+    {
+    const float* p;
+    int stride, plane, c;
+    };
+
+  Neighbourhood neighbourhood(const Image& im, int x, int y, vector<float>& buf) const;
+  float orientation(const Neighbourhood& n) const;
+
+  int window, method, radius, bins, reach;
+  vector<vector<Tap>> taps;  // the patch, per angle
+  vector<DiscPixel> disc;
+  };
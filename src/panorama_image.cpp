@@ -6,9 +6,13 @@
 
 #include "image.h"
 #include "matrix.h"
+#include "remap.h"
+#include "tiled_image.h"
+#include "feature_cache.h"
+#include "feature_registry.h"
 
+#include <map>
 #include <set>
-#include <thread>
 
 using namespace std;
 
@@ -261,12 +265,38 @@ Matrix RANSAC(vector<Match> m, float thresh, int k, int cutoff){
 }
 
 
-Image trim_image(const Image& a)
+// returns: homography mapping a to b, from match_descriptors and RANSAC, or from
+// the match cache of the process when the same features were registered before.
+// vector<Match>* matches: if not null, set to the matches (pointing into ad and bd).
+Matrix estimate_homography(const vector<Descriptor>& ad, const vector<Descriptor>& bd, float inlier_thresh, int iters, int cutoff, vector<Match>* matches){
+  MatchCache& cache = MatchCache::instance();
+  string key;
+  vector<Match> m;
+  Matrix Hba;
+  if(cache.enabled()){
+    // RANSAC draws from rand(), which has no seed to put in the key
+    key = MatchCache::key(ad, bd, inlier_thresh, iters, cutoff);
+    if(cache.load(key, ad, bd, m, Hba)){
+      if(matches)*matches = move(m);
+      return Hba;
+    }
+  }
+  m = match_descriptors(ad, bd);
+  Hba = RANSAC(m, inlier_thresh, iters, cutoff);
+  if(cache.enabled())cache.store(key, ad, bd, m, Hba);
+  if(matches)*matches = move(m);
+  return Hba;
+}
+
+// returns: the bounding box of the non-empty pixels of a.
+// int& ox, oy: set to the position of the box in a.
+Image trim_image(const Image& a, int& ox, int& oy)
   {
   int minx=a.w-1;
   int maxx=0;
   int miny=a.h-1;
   int maxy=0;
+  ox=oy=0;
   
   for(int q3=0;q3<a.c;q3++)for(int q2=0;q2<a.h;q2++)for(int q1=0;q1<a.w;q1++)if(a(q1,q2,q3))
     {
@@ -283,69 +313,30 @@ Image trim_image(const Image& a)
   for(int q3=0;q3<a.c;q3++)for(int q2=miny;q2<=maxy;q2++)for(int q1=minx;q1<=maxx;q1++)
     b(q1-minx,q2-miny,q3)=a(q1,q2,q3);
   
+  ox=minx;
+  oy=miny;
   return b;
   }
 
+Image trim_image(const Image& a)
+  {
+  int ox, oy;
+  return trim_image(a, ox, oy);
+  }
+
+
+// returns: combined image stitched together.
+// int& ox, oy: set to the position of the result in the coordinates of image a.
+// The canvas is warped tile by tile on disk (see combine_images_tiled): only the
+// result, cropped to its pixels, is brought to memory.
+Image combine_images(const Image& a, const Image& b, const Matrix& Hba, float ablendcoeff, int& ox, int& oy){
+  return combine_images_tiled(a, b, Hba, ablendcoeff, ox, oy).to_image();
+}
 
 // returns: combined image stitched together.
 Image combine_images(const Image& a, const Image& b, const Matrix& Hba, float ablendcoeff){
-  Matrix Hinv=Hba.inverse();
-  
-  // Project the corners of image b into image a coordinates.
-  Point c1 = project_point(Hinv, Point(0,0));
-  Point c2 = project_point(Hinv, Point(b.w-1, 0));
-  Point c3 = project_point(Hinv, Point(0, b.h-1));
-  Point c4 = project_point(Hinv, Point(b.w-1, b.h-1));
-  
-  // Find top left and bottom right corners of image b warped into image a.
-  Point topleft, botright;
-  botright.x = max(c1.x, max(c2.x, max(c3.x, c4.x)));
-  botright.y = max(c1.y, max(c2.y, max(c3.y, c4.y)));
-  topleft.x = min(c1.x, min(c2.x, min(c3.x, c4.x)));
-  topleft.y = min(c1.y, min(c2.y, min(c3.y, c4.y)));
-  
-  // Find how big our new image should be and the offsets from image a.
-  int dx = min(0, (int)topleft.x);
-  int dy = min(0, (int)topleft.y);
-  int w = max(a.w, (int)botright.x) - dx;
-  int h = max(a.h, (int)botright.y) - dy;
-    
-  // Can disable this if you are making very big panoramas.
-  // Usually this means there was an error in calculating H.
-  if(w > 15000 || h > 4000)
-    {
-    printf("Can't make such big panorama :/ (%d %d)\n",w,h);
-    return Image(100,100,1);
-    }
-  
-  Image c(w, h, a.c);
-  
-  // Paste image a into the new image offset by dx and dy.
-  for(int k = 0; k < a.c; ++k)
-    for(int j = 0; j < a.h; ++j)
-      for(int i = 0; i < a.w; ++i){
-        c(i - dx, j - dy, k) = a(i, j, k);
-      }
-  for (int j = 0; j < h; ++j)
-      for (int i = 0; i < w; ++i){
-          if (!c.is_nonempty_patch(i, j)) {
-
-              Point projected = project_point(Hba, Point(i + dx, j + dy));
-              if (projected.x >= 0 && projected.y >= 0 && projected.x < b.w && projected.y < b.h) {
-                  for (int k = 0; k < b.c; k++) {
-                      float prev = c(i, j, k);
-                      float pixel = b.pixel_bilinear(projected.x, projected.y, k);
-
-                      if (prev > 0) {
-                          c(i, j, k) = ablendcoeff * c(i, j, k) + (1 - ablendcoeff) * pixel;
-                      }
-                      else c(i, j, k) = pixel;
-                  }
-
-              }
-          }
-      }
-  return trim_image(c);
+  int ox, oy;
+  return combine_images(a, b, Hba, ablendcoeff, ox, oy);
 }
 
 // Create a panoramam between two images.
@@ -355,71 +346,86 @@ Image panorama_image(const Image& a, const Image& b, float sigma, int corner_met
   vector<Descriptor> bd;
   
   // doing it multithreading...
-  thread tha([&](){ad = harris_corner_detector(a, sigma, thresh, window, nms, corner_method);});
-  thread thb([&](){bd = harris_corner_detector(b, sigma, thresh, window, nms, corner_method);});
-  tha.join();
-  thb.join();
-  
-  // Find matches
-  vector<Match> m = match_descriptors(ad, bd);
+  TaskGroup g;
+  g.run([&](){ad = harris_corner_detector(a, sigma, thresh, window, nms, corner_method);});
+  bd = harris_corner_detector(b, sigma, thresh, window, nms, corner_method);
+  g.wait();
   
-  // Run RANSAC to find the homography
-  Matrix Hba = RANSAC(m, inlier_thresh, iters, cutoff);
+  // Find matches and run RANSAC to find the homography (or take them from the cache)
+  Matrix Hba = estimate_homography(ad, bd, inlier_thresh, iters, cutoff);
   
   // Stitch the images together with the homography
   return combine_images(a, b, Hba, acoeff);
 }
 
+// returns: an input of a hierarchical panorama, with its features.
+Mosaic make_mosaic(const Image& im, float sigma, int corner_method, float thresh, int window, int nms){
+  Mosaic m;
+  m.im=im;
+  m.d=harris_corner_detector(im, sigma, thresh, window, nms, corner_method);
+  m.window=window;
+  return m;
+}
+
+// returns: a and b stitched together, carrying the features of both into the result.
+// Features are matched from the cache and never detected again on the mosaics:
+// the ones of a are translated, the ones of b are projected with the inverse homography
+// and kept only where a does not cover the result (a is pasted on top, as in combine_images).
+// Features found with another window are described again with window (0: the larger of
+// the windows of a and b) on their mosaic, and carried with those patches.
+Mosaic panorama_mosaic(const Mosaic& a, const Mosaic& b, float inlier_thresh, int iters, int cutoff, float acoeff, int window){
+  if(window<=0)window = max(a.window, b.window);
+  if(window<=0 || (a.window==window && b.window==window)){
+    Matrix Hba = RANSAC(match_descriptors(a.d, b.d), inlier_thresh, iters, cutoff);
+    return merge_mosaics(a, b, Hba, acoeff);
+  }
+  vector<Descriptor> ad = describe_features(a.im, a.d, window);
+  vector<Descriptor> bd = describe_features(b.im, b.d, window);
+  Matrix Hba = RANSAC(match_descriptors(ad, bd), inlier_thresh, iters, cutoff);
+  Mosaic r = merge_mosaics(a.im, ad, b.im, bd, Hba, acoeff);
+  r.window = window;
+  return r;
+}
+
+// returns: a and b stitched together with a known homography, carrying the features of both.
+Mosaic merge_mosaics(const Mosaic& a, const Mosaic& b, const Matrix& Hba, float acoeff){
+  Mosaic r = merge_mosaics(a.im, a.d, b.im, b.d, Hba, acoeff);
+  r.window = a.window==b.window ? a.window : 0;
+  return r;
+}
+
+// Same, with images and features coming from different places.
+Mosaic merge_mosaics(const Image& a, const vector<Descriptor>& ad, const Image& b, const vector<Descriptor>& bd, const Matrix& Hba, float acoeff){
+  Mosaic r;
+  int ox, oy;
+  r.im = combine_images(a, b, Hba, acoeff, ox, oy);
+  if(r.im.c!=a.c)return r;
+  
+  r.d.reserve(ad.size()+bd.size());
+  for(auto&e1:ad){
+    r.d.push_back(e1);
+    r.d.back().p=Point(e1.p.x-ox, e1.p.y-oy);
+  }
+  
+  Matrix Hinv=Hba.inverse();
+  for(auto&e1:bd){
+    Point p=project_point(Hinv, e1.p);
+    int x=lround(p.x), y=lround(p.y);
+    if(x>=0 && y>=0 && x<a.w && y<a.h && !a.is_empty(x,y))continue;
+    p=Point(p.x-ox, p.y-oy);
+    if(!r.im.contains(p.x,p.y))continue;
+    r.d.push_back(e1);
+    r.d.back().p=p;
+  }
+  return r;
+}
+
 // returns: image projected onto cylinder, then flattened.
 Image cylindrical_project(const Image& im, float f){
-    Image c(im.w, im.h, im.c);
-    int xc = im.w / 2;
-    int yc = im.h / 2;
-
-    for (int j = 0; j < im.h; j++) {
-        for (int i = 0; i < im.w; i++) {
-            float theta = (i - xc) / f;
-            float h = (j - yc) / f;
-            float X = sin(theta);
-            float Y = h;
-            float Z = cos(theta);
-            float new_x = ((f * X) / Z) + xc;
-            float new_y = ((f * Y) / Z) + yc;
-            int a = (int)new_x;
-            int b = (int)new_y;
-            if (a >= 0 && a < im.w && b >= 0 && b < im.h)
-                for (int k = 0; k < im.c; k++) {
-                    c(i, j, k) = im(a, b, k);
-                }
-
-        }
-    }
-    return c;
+  return remap_image(im, *projection_map(im.w, im.h, f, PROJ_CYLINDRICAL));
 }
 
-// returns: image projected onto cylinder, then flattened.
+// returns: image projected onto sphere, then flattened.
 Image spherical_project(const Image& im, float f){
-  double hfov=atan(im.w/(2*f));
-  double vfov=atan(im.h/(2*f));
-  Image c(im.w, im.h, im.c);
-  int xc = im.w / 2;
-  int yc = im.h / 2;
-  for (int j = 0; j < im.h; j++) {
-      for (int i = 0; i < im.w; i++) {
-          float theta = (i - xc) / f;
-          float h = (j - yc) / f;
-          float X = sin(theta) * cos(h);
-          float Y = sin(h);
-          float Z = cos(theta) * cos(h);
-          float new_x = f * (X / Z) + xc;
-          float new_y = f * (Y / Z) + yc;
-          int a = (int)new_x;
-          int b = (int)new_y;
-          if (a >= 0 && a < im.w && b >= 0 && b < im.h)
-              for (int k = 0; k < im.c; k++) {
-                  c(i, j, k) = im(a, b, k);
-              }
-      }
-  }
-  return c;
+  return remap_image(im, *projection_map(im.w, im.h, f, PROJ_SPHERICAL));
 }
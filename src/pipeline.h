@@ -0,0 +1,217 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Bounded multi-producer multi-consumer queue (D. Vyukov's array queue):
+// every cell carries a sequence number telling whether it is ready to be
+// written or read, so push and pop are a CAS on a position and no lock is taken.
+// The blocking push/pop back off while the queue is full/empty.
+//
+// close(): no more items will be pushed, pop drains the queue and then fails.
+// cancel(): the consumer is gone, push and pop fail right away.
+template<typename T>
+class BoundedQueue
+  {
+  public:
+
+  // capacity: rounded up to a power of 2.
+  explicit BoundedQueue(size_t capacity)
+    {
+    size_t n=2;
+    while(n<capacity)n*=2;
+    mask=n-1;
+    cells.reset(new Cell[n]);
+    for(size_t q1=0;q1<n;q1++)cells[q1].seq.store(q1,memory_order_relaxed);
+    }
+
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  // returns: false if the queue is full ('v' is left alone).
+  bool try_push(T& v)
+    {
+    size_t pos=tail.load(memory_order_relaxed);
+    while(true)
+      {
+      Cell& c=cells[pos&mask];
+      size_t seq=c.seq.load(memory_order_acquire);
+      intptr_t diff=(intptr_t)seq-(intptr_t)pos;
+      if(diff==0)
+        {
+        if(tail.compare_exchange_weak(pos,pos+1,memory_order_relaxed))
+          {
+          c.data=move(v);
+          c.seq.store(pos+1,memory_order_release);
+          return true;
+          }
+        }
+      else if(diff<0)return false;
+      else pos=tail.load(memory_order_relaxed);
+      }
+    }
+
+  // returns: false if the queue is empty.
+  bool try_pop(T& v)
+    {
+    size_t pos=head.load(memory_order_relaxed);
+    while(true)
+      {
+      Cell& c=cells[pos&mask];
+      size_t seq=c.seq.load(memory_order_acquire);
+      intptr_t diff=(intptr_t)seq-(intptr_t)(pos+1);
+      if(diff==0)
+        {
+        if(head.compare_exchange_weak(pos,pos+1,memory_order_relaxed))
+          {
+          v=move(c.data);
+          c.data=T();
+          c.seq.store(pos+mask+1,memory_order_release);
+          return true;
+          }
+        }
+      else if(diff<0)return false;
+      else pos=head.load(memory_order_relaxed);
+      }
+    }
+
+  // Waits while the queue is full. returns: false if the queue was cancelled or closed.
+  bool push(T v)
+    {
+    for(int spin=0;!cancelled && !closed;spin++)
+      {
+      if(try_push(v))return true;
+      backoff(spin);
+      }
+    return false;
+    }
+
+  // Waits while the queue is empty. returns: false if it was cancelled, or closed and drained.
+  bool pop(T& v)
+    {
+    for(int spin=0;!cancelled;spin++)
+      {
+      if(try_pop(v))return true;
+      if(closed)return try_pop(v);
+      backoff(spin);
+      }
+    return false;
+    }
+
+  void close(void) { closed=true; }
+  void cancel(void) { cancelled=true; }
+  bool is_cancelled(void) const { return cancelled; }
+
+  private:
+
+  static void backoff(int spin)
+    {
+    if(spin<64)this_thread::yield();
+    else this_thread::sleep_for(chrono::microseconds(200));
+    }
+
+  struct Cell
+    {
+    atomic<size_t> seq;
+    T data;
+    };
+
+  unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(64) atomic<size_t> tail{0};
+  alignas(64) atomic<size_t> head{0};
+  atomic<bool> closed{false};
+  atomic<bool> cancelled{false};
+  };
+
+
+// Streaming pipeline: stages connected by bounded queues, all running at the same time.
+// A stage is a few threads pulling items from its input queue and pushing results
+// to its output queue; when all its threads are done the output is closed, so the
+// next stage drains it and stops. A full queue stops the stage before it, so the
+// number of items alive is bounded by the queue sizes, not by the input.
+// If a stage throws, its queues are cancelled, the whole pipeline stops, and join() rethrows.
+// Stage threads mostly wait on queues, so they are not pool tasks: the heavy work
+// inside a stage can still use the pool. Every stage thread is an OS thread on top of
+// the pool's, so size the stages to share the pool's worker count, not one each.
+class Pipeline
+  {
+  public:
+
+  ~Pipeline() { try { join(); } catch(...) {} }
+
+  // Runs 'f(item, out)' for every item of 'in' on 'threads' threads; f pushes any number of results to 'out'.
+  template<typename In, typename Out, typename F>
+  void stage(int threads, BoundedQueue<In>& in, BoundedQueue<Out>& out, F f)
+    {
+    auto running=make_shared<atomic<int>>(threads);
+    for(int q1=0;q1<threads;q1++)th.emplace_back([this,&in,&out,f,running]()
+      {
+      try
+        {
+        In item;
+        while(!out.is_cancelled() && in.pop(item))f(move(item),out);
+        if(out.is_cancelled())in.cancel();
+        }
+      catch(...)
+        {
+        fail(current_exception());
+        in.cancel();
+        out.cancel();
+        }
+      if(--*running==0)out.close();
+      });
+    }
+
+  // Runs 'f(item)' for every item of 'in' on 'threads' threads.
+  template<typename In, typename F>
+  void sink(int threads, BoundedQueue<In>& in, F f)
+    {
+    for(int q1=0;q1<threads;q1++)th.emplace_back([this,&in,f]()
+      {
+      try
+        {
+        In item;
+        while(in.pop(item))f(move(item));
+        }
+      catch(...)
+        {
+        fail(current_exception());
+        in.cancel();
+        }
+      });
+    }
+
+  // Waits for all the stages.
+  void join(void)
+    {
+    for(auto&e1:th)e1.join();
+    th.clear();
+    if(error)
+      {
+      exception_ptr e=error;
+      error=nullptr;
+      rethrow_exception(e);
+      }
+    }
+
+  private:
+
+  void fail(exception_ptr e)
+    {
+    lock_guard<mutex> LG(m);
+    if(!error)error=e;
+    }
+
+  vector<thread> th;
+  mutex m;
+  exception_ptr error;
+  };
@@ -0,0 +1,135 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+
+#include "image.h"
+#include "remap.h"
+
+#include <list>
+#include <tuple>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// Fills the map in parallel: 'source(x,y)' is the input point sampled by output pixel (x,y).
+template<typename F>
+static void build_map(RemapMap& m, F source){
+  parallel_for_ranges(0,m.h,16,[&](int y0, int y1){
+    for(int y=y0;y<y1;y++)for(int x=0;x<m.w;x++){
+      Point p=source(x,y);
+      m.set(x,y,p.x,p.y);
+    }
+  });
+}
+
+Point Projection::forward(const Point& p, int w, int h) const {
+  if(method==PROJ_IDENTITY)return p;
+  int xc = w / 2;
+  int yc = h / 2;
+  double theta = atan((p.x - xc) / f);
+  if(method==PROJ_CYLINDRICAL)return Point(f * theta + xc, (p.y - yc) * cos(theta) + yc);
+  double phi = atan((p.y - yc) * cos(theta) / f);
+  return Point(f * theta + xc, f * phi + yc);
+}
+
+Point Projection::inverse(const Point& p, int w, int h) const {
+  if(method==PROJ_IDENTITY)return p;
+  int xc = w / 2;
+  int yc = h / 2;
+  double theta = (p.x - xc) / f;
+  if(method==PROJ_CYLINDRICAL)return Point(f * tan(theta) + xc, (p.y - yc) / cos(theta) + yc);
+  double phi = (p.y - yc) / f;
+  return Point(f * tan(theta) + xc, f * tan(phi) / cos(theta) + yc);
+}
+
+void project_features(vector<Descriptor>& d, const Projection& proj, int w, int h){
+  for(auto&e1:d)e1.p=proj.forward(e1.p,w,h);
+}
+
+// How many projection maps projection_map keeps, most recently used first.
+static const int MAP_CACHE_SIZE=4;
+
+shared_ptr<const RemapMap> projection_map(int w, int h, float f, int method){
+  assert(method==PROJ_CYLINDRICAL || method==PROJ_SPHERICAL);
+  static list<pair<tuple<int,int,float,int>,shared_ptr<const RemapMap>>> cache;
+  static mutex m;
+  auto key=make_tuple(w,h,f,method);
+    {
+    lock_guard<mutex> LG(m);
+    for(auto it=cache.begin();it!=cache.end();it++)if(it->first==key){
+      cache.splice(cache.begin(),cache,it);
+      return cache.front().second;
+    }
+    }
+
+  auto map=make_shared<RemapMap>(w,h,w,h);
+  Projection proj(method,f);
+  build_map(*map,[&](int i, int j){ return proj.inverse(Point(i,j),w,h); });
+
+  lock_guard<mutex> LG(m);
+  cache.emplace_front(key,map);
+  if((int)cache.size()>MAP_CACHE_SIZE)cache.pop_back();
+  return map;
+}
+
+RemapMap undistortion_map(int w, int h, float f, float k1, float k2){
+  RemapMap map(w,h,w,h);
+  float xc = w / 2.f;
+  float yc = h / 2.f;
+  build_map(map,[&](int i, int j){
+    float x = (i - xc) / f;
+    float y = (j - yc) / f;
+    float r2 = x*x + y*y;
+    float d = 1 + k1*r2 + k2*r2*r2;
+    return Point(x * d * f + xc, y * d * f + yc);
+  });
+  return map;
+}
+
+// One row of one channel.
+static void remap_row(const float* src, int sw, const RemapMap& m, int y, float* out){
+  const int* idx=&m.idx[y*m.w];
+  const float* fx=&m.fx[y*m.w];
+  const float* fy=&m.fy[y*m.w];
+  int x=0;
+#if defined(__AVX2__) && defined(__FMA__)
+  const __m256i minus1=_mm256_set1_epi32(-1);
+  for(;x+8<=m.w;x+=8){
+    __m256i id=_mm256_loadu_si256((const __m256i*)(idx+x));
+    __m256i valid=_mm256_cmpgt_epi32(id,minus1);
+    id=_mm256_and_si256(id,valid);
+    __m256 v00=_mm256_i32gather_ps(src     ,id,4);
+    __m256 v01=_mm256_i32gather_ps(src+1   ,id,4);
+    __m256 v10=_mm256_i32gather_ps(src+sw  ,id,4);
+    __m256 v11=_mm256_i32gather_ps(src+sw+1,id,4);
+    __m256 wx=_mm256_loadu_ps(fx+x);
+    __m256 wy=_mm256_loadu_ps(fy+x);
+    __m256 top=_mm256_fmadd_ps(wx,_mm256_sub_ps(v01,v00),v00);
+    __m256 bot=_mm256_fmadd_ps(wx,_mm256_sub_ps(v11,v10),v10);
+    __m256 r=_mm256_fmadd_ps(wy,_mm256_sub_ps(bot,top),top);
+    _mm256_storeu_ps(out+x,_mm256_and_ps(r,_mm256_castsi256_ps(valid)));
+  }
+#endif
+  for(;x<m.w;x++){
+    int i=idx[x];
+    if(i<0){ out[x]=0; continue; }
+    const float* s=src+i;
+    float top=s[0]+fx[x]*(s[1]-s[0]);
+    float bot=s[sw]+fx[x]*(s[sw+1]-s[sw]);
+    out[x]=top+fy[x]*(bot-top);
+  }
+}
+
+Image remap_image(const Image& im, const RemapMap& m){
+  assert(im.w==m.src_w && im.h==m.src_h && im.w>=2 && im.h>=2);
+  Image r(m.w, m.h, im.c);
+  parallel_for_ranges(0,m.h,16,[&](int y0, int y1){
+    for(int y=y0;y<y1;y++)for(int k=0;k<im.c;k++)remap_row(im.data+k*im.w*im.h, im.w, m, y, r.RowPtr(y,k));
+  });
+  return r;
+}
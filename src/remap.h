@@ -0,0 +1,66 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "image.h"
+
+using namespace std;
+
+// A precomputed warp. Output pixel i samples the input bilinearly between
+// input pixels idx[i], idx[i]+1, idx[i]+src_w and idx[i]+src_w+1 with
+// weights fx[i], fy[i]. idx[i]<0 marks an output pixel outside the input.
+struct RemapMap
+  {
+  int w=0, h=0;          // output size
+  int src_w=0, src_h=0;  // input size
+  vector<int> idx;
+  vector<float> fx, fy;
+
+  RemapMap() = default;
+  RemapMap(int w, int h, int src_w, int src_h) : w(w), h(h), src_w(src_w), src_h(src_h), idx(w*h,-1), fx(w*h,0.f), fy(w*h,0.f) {}
+
+  // Sets output pixel (x,y) to sample the input at (sx,sy).
+  void set(int x, int y, float sx, float sy)
+    {
+    int i=y*w+x;
+    if(!(sx>=0 && sy>=0 && sx<=src_w-1 && sy<=src_h-1)){ idx[i]=-1; return; }
+    int x0=min((int)sx,src_w-2);
+    int y0=min((int)sy,src_h-2);
+    idx[i]=y0*src_w+x0;
+    fx[i]=sx-x0;
+    fy[i]=sy-y0;
+    }
+  };
+
+// Projection methods, as in make-panorama.
+enum { PROJ_IDENTITY=0, PROJ_CYLINDRICAL=1, PROJ_SPHERICAL=2 };
+
+// Closed-form cylindrical/spherical mapping of a w x h image with focal f:
+// points can be moved between the image and its projection without resampling.
+struct Projection
+  {
+  int method=PROJ_IDENTITY;
+  float f=1;
+
+  Projection() = default;
+  Projection(int method, float f) : method(method), f(f) {}
+
+  // returns: point of the projected image where p of the original image lands.
+  Point forward(const Point& p, int w, int h) const;
+  // returns: point of the original image seen at p of the projected image.
+  Point inverse(const Point& p, int w, int h) const;
+  };
+
+// Moves the features detected on a w x h image to its projection.
+void project_features(vector<Descriptor>& d, const Projection& proj, int w, int h);
+
+// returns: the map of a projection (cylindrical or spherical) of a w x h image with focal f.
+// The last few maps used are kept, so a dataset of images of one size builds its map once.
+shared_ptr<const RemapMap> projection_map(int w, int h, float f, int method);
+
+// returns: map removing the radial distortion (k1, k2) of a w x h image with focal f.
+RemapMap undistortion_map(int w, int h, float f, float k1, float k2);
+
+// returns: im warped through the map (bilinear sampling, 0 outside the input).
+Image remap_image(const Image& im, const RemapMap& m);
@@ -22,7 +22,7 @@ float Image::pixel_bilinear(float x, float y, int c) const {
     // use the member function pixel(a,b,c)
     float x1, x2, y1, y2;
     x1 = floor(x); y1 = floor(y);
-    x2 = ceil(x); y2 = ceil(y);
+    x2 = x1 + 1; y2 = y1 + 1;
     float v11, v12, v21, v22;
     v11 = clamped_pixel(x1,y1,c);
     v12 = clamped_pixel(x1,y2,c);
@@ -75,3 +75,27 @@ Image bilinear_resize(const Image &im, int w, int h) {
 }
 
 
+// return new Image of size (im.w/scale, im.h/scale, im.c), every pixel the mean of a scale x scale box.
+// Pixel i of the result is centered on pixel scale*i+(scale-1)/2 of im.
+Image box_downsample(const Image &im, int scale) {
+    if (scale < 1) throw invalid_argument("box_downsample: the scale must be at least 1");
+    if (scale == 1) return im;
+    
+    Image ret(max(1, im.w/scale), max(1, im.h/scale), im.c);
+    
+    parallel_for(0, ret.h*ret.c, [&](int row) {
+        int j = row % ret.h, k = row / ret.h;
+        float* dst = ret.RowPtr(j, k);
+        int y1 = min(im.h, (j+1)*scale);
+        for (int i = 0; i < ret.w; ++i) {
+            int x1 = min(im.w, (i+1)*scale);
+            float sum = 0;
+            for (int y = j*scale; y < y1; ++y) {
+                const float* src = im.RowPtr(y, k);
+                for (int x = i*scale; x < x1; ++x) sum += src[x];
+            }
+            dst[i] = sum / ((y1-j*scale)*(x1-i*scale));
+        }
+    });
+    return ret;
+}
@@ -0,0 +1,281 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cassert>
+#include <cstring>
+
+#include <list>
+#include <mutex>
+
+#include "image.h"
+#include "scale_space.h"
+#include "feature_cache.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// How many scale spaces ScaleSpace::get keeps.
+static const int CACHE_SIZE=4;
+// Smallest side of the last octave when the number of octaves is automatic.
+static const int MIN_OCTAVE_SIZE=16;
+
+// returns: the normalized gaussian kernel of smooth_image (ceil(6*sigma) taps, odd).
+static vector<float> gaussian_kernel(float sigma){
+  int w=ceil(sigma*6);
+  if(!(w%2))w++;
+  vector<float> k(w);
+  float sum=0;
+  for(int q1=0;q1<w;q1++){
+    float d=q1-w/2;
+    k[q1]=expf(-d*d/(2*sigma*sigma));
+    sum+=k[q1];
+  }
+  for(auto&e1:k)e1/=sum;
+  return k;
+}
+
+Image gaussian_blur(const Image& im, float sigma){
+  if(sigma<=0)return im;
+  vector<float> k=gaussian_kernel(sigma);
+  int n=k.size(), r=n/2;
+  Image t(im.w,im.h,im.c), out(im.w,im.h,im.c);
+
+  parallel_for_ranges(0,im.h*im.c,16,[&](int lo, int hi){
+    vector<float> pad(im.w+2*r);
+    for(int row=lo;row<hi;row++){
+      const float* src=im.RowPtr(row%im.h,row/im.h);
+      float* dst=t.RowPtr(row%im.h,row/im.h);
+      for(int x=0;x<im.w+2*r;x++)pad[x]=src[min(max(x-r,0),im.w-1)];
+      for(int q1=0;q1<n;q1++){
+        const float* p=pad.data()+q1;
+        float kq=k[q1];
+        for(int x=0;x<im.w;x++)dst[x]+=kq*p[x];
+      }
+    }
+  });
+
+  parallel_for_ranges(0,im.h*im.c,16,[&](int lo, int hi){
+    for(int row=lo;row<hi;row++){
+      int y=row%im.h, ch=row/im.h;
+      float* dst=out.RowPtr(y,ch);
+      for(int q1=0;q1<n;q1++){
+        const float* src=t.RowPtr(min(max(y+q1-r,0),im.h-1),ch);
+        float kq=k[q1];
+        for(int x=0;x<im.w;x++)dst[x]+=kq*src[x];
+      }
+    }
+  });
+  return out;
+}
+
+// returns: every other pixel of im.
+static Image decimate(const Image& im){
+  Image r(max(1,im.w/2),max(1,im.h/2),im.c);
+  parallel_for(0,r.h*r.c,[&](int row){
+    const float* src=im.RowPtr(2*(row%r.h),row/r.h);
+    float* dst=r.RowPtr(row%r.h,row/r.h);
+    for(int x=0;x<r.w;x++)dst[x]=src[2*x];
+  });
+  return r;
+}
+
+// returns: the number of octaves built for a w x h image when 'octaves' are asked.
+static int octave_count(int w, int h, int octaves){
+  int n=1;
+  while(n!=octaves && (min(w,h)>>n)>=MIN_OCTAVE_SIZE)n++;
+  return n;
+}
+
+ScaleSpace::ScaleSpace(const Image& im, float sigma, int scales, int octaves, float input_sigma)
+  : sigma_(sigma), input_sigma(input_sigma), scales_(scales) {
+  if(sigma<=0 || scales<1)throw invalid_argument("ScaleSpace: sigma must be positive and scales at least 1");
+  int n=octave_count(im.w,im.h,octaves);
+  levels_.resize(n);
+  dogs_.resize(n);
+
+  for(int o=0;o<n;o++){
+    vector<Image>& L=levels_[o];
+    L.resize(levels());
+    if(o==0)L[0]=gaussian_blur(im,sqrtf(max(0.f,sigma*sigma-input_sigma*input_sigma)));
+    else L[0]=decimate(levels_[o-1][scales]);
+    for(int s=1;s<levels();s++){
+      float s0=level_sigma(s-1), s1=level_sigma(s);
+      L[s]=gaussian_blur(L[s-1],sqrtf(s1*s1-s0*s0));
+    }
+    dogs_[o].resize(levels()-1);
+  }
+
+  int layers=levels()-1;
+  parallel_for(0,n*layers,[&](int i){
+    int o=i/layers, s=i%layers;
+    dogs_[o][s]=levels_[o][s+1]-levels_[o][s];
+  });
+}
+
+shared_ptr<const ScaleSpace> ScaleSpace::get(const Image& im, float sigma, int scales, int octaves, float input_sigma){
+  static list<pair<unsigned long long,shared_ptr<const ScaleSpace>>> cache;
+  static mutex m;
+  unsigned long long h=image_hash(im);
+  int n=octave_count(im.w,im.h,octaves);
+    {
+    lock_guard<mutex> LG(m);
+    for(auto it=cache.begin();it!=cache.end();it++){
+      const ScaleSpace& ss=*it->second;
+      if(it->first!=h || ss.sigma_!=sigma || ss.scales_!=scales || ss.input_sigma!=input_sigma || ss.octaves()<n)continue;
+      cache.splice(cache.begin(),cache,it);
+      return cache.front().second;
+    }
+    }
+
+  auto ss=make_shared<const ScaleSpace>(im,sigma,scales,octaves,input_sigma);
+  lock_guard<mutex> LG(m);
+  cache.emplace_front(h,ss);
+  if((int)cache.size()>CACHE_SIZE)cache.pop_back();
+  return ss;
+}
+
+// Pixels of the border of an octave without keypoints.
+static const int DOG_BORDER=5;
+// Steps of the quadratic refinement before a point that keeps moving is dropped.
+static const int REFINE_STEPS=5;
+
+// Appends to 'out' the x in [x0,x1) where row y of layer 1 of 'D' is a 3x3x3 extremum
+// stronger than pre. D: three consecutive layers; needs 1<=x0 and x1<=w-1.
+static void row_extrema(const Image* D[3], int y, int x0, int x1, float pre, vector<int>& out){
+  const float* r[3][3];
+  for(int l=0;l<3;l++)for(int dy=0;dy<3;dy++)r[l][dy]=D[l]->RowPtr(y+dy-1,0);
+  const float* c=r[1][1];
+  int x=x0;
+#ifdef __AVX2__
+  const __m256 vpre=_mm256_set1_ps(pre), vnpre=_mm256_set1_ps(-pre);
+  for(;x+8<=x1;x+=8){
+    __m256 v=_mm256_loadu_ps(c+x);
+    int strong=_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(v,vpre,_CMP_GT_OQ),_mm256_cmp_ps(v,vnpre,_CMP_LT_OQ)));
+    if(!strong)continue;
+    __m256 mx=_mm256_set1_ps(-INFINITY), mn=_mm256_set1_ps(INFINITY);
+    for(int l=0;l<3;l++)for(int dy=0;dy<3;dy++)for(int dx=-1;dx<=1;dx++){
+      if(l==1 && dy==1 && dx==0)continue;
+      __m256 n=_mm256_loadu_ps(r[l][dy]+x+dx);
+      mx=_mm256_max_ps(mx,n);
+      mn=_mm256_min_ps(mn,n);
+    }
+    int bits=strong&_mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(v,mx,_CMP_GT_OQ),_mm256_cmp_ps(v,mn,_CMP_LT_OQ)));
+    while(bits){
+      out.push_back(x+__builtin_ctz(bits));
+      bits&=bits-1;
+    }
+  }
+#endif
+  for(;x<x1;x++){
+    float v=c[x];
+    if(!(v>pre || v<-pre))continue;
+    float mx=-INFINITY, mn=INFINITY;
+    for(int l=0;l<3;l++)for(int dy=0;dy<3;dy++)for(int dx=-1;dx<=1;dx++){
+      if(l==1 && dy==1 && dx==0)continue;
+      mx=max(mx,r[l][dy][x+dx]);
+      mn=min(mn,r[l][dy][x+dx]);
+    }
+    if(v>mx || v<mn)out.push_back(x);
+  }
+}
+
+// Fits a quadratic to the DoG around (x,y) of layer s of octave o and moves there,
+// one pixel or layer at a time. returns: false if the point leaves the octave,
+// does not converge, is too weak or lies on an edge.
+static bool refine_extremum(const ScaleSpace& ss, int o, int s, int x, int y, float thresh, float edge_ratio, ScaleKeypoint& k){
+  int layers=ss.levels()-1;
+  double off[3], g[3], v=0;
+  for(int step=0;;step++){
+    if(step==REFINE_STEPS)return false;
+    const Image& D0=ss.dog(o,s-1);
+    const Image& D1=ss.dog(o,s);
+    const Image& D2=ss.dog(o,s+1);
+    v=D1(x,y);
+    g[0]=(D1(x+1,y)-D1(x-1,y))/2.;
+    g[1]=(D1(x,y+1)-D1(x,y-1))/2.;
+    g[2]=(D2(x,y)-D0(x,y))/2.;
+    double dxx=D1(x+1,y)+D1(x-1,y)-2*v;
+    double dyy=D1(x,y+1)+D1(x,y-1)-2*v;
+    double dss=D2(x,y)+D0(x,y)-2*v;
+    double dxy=(D1(x+1,y+1)-D1(x-1,y+1)-D1(x+1,y-1)+D1(x-1,y-1))/4.;
+    double dxs=(D2(x+1,y)-D2(x-1,y)-D0(x+1,y)+D0(x-1,y))/4.;
+    double dys=(D2(x,y+1)-D2(x,y-1)-D0(x,y+1)+D0(x,y-1))/4.;
+
+    // off = -H^-1 g (Cramer)
+    double H[3][3]={{dxx,dxy,dxs},{dxy,dyy,dys},{dxs,dys,dss}};
+    double det=H[0][0]*(H[1][1]*H[2][2]-H[1][2]*H[2][1])
+              -H[0][1]*(H[1][0]*H[2][2]-H[1][2]*H[2][0])
+              +H[0][2]*(H[1][0]*H[2][1]-H[1][1]*H[2][0]);
+    if(fabs(det)<1e-12)return false;
+    for(int q1=0;q1<3;q1++){
+      double M[3][3];
+      memcpy(M,H,sizeof(M));
+      for(int q2=0;q2<3;q2++)M[q2][q1]=-g[q2];
+      off[q1]=(M[0][0]*(M[1][1]*M[2][2]-M[1][2]*M[2][1])
+              -M[0][1]*(M[1][0]*M[2][2]-M[1][2]*M[2][0])
+              +M[0][2]*(M[1][0]*M[2][1]-M[1][1]*M[2][0]))/det;
+    }
+
+    if(fabs(off[0])<0.5 && fabs(off[1])<0.5 && fabs(off[2])<0.5){
+      // edges: large curvature across, small along
+      double tr=dxx+dyy, det2=dxx*dyy-dxy*dxy;
+      if(det2<=0 || tr*tr*edge_ratio>=(edge_ratio+1)*(edge_ratio+1)*det2)return false;
+      break;
+    }
+    x+=lround(off[0]);
+    y+=lround(off[1]);
+    s+=lround(off[2]);
+    const Image& D=ss.dog(o,0);
+    if(s<1 || s>layers-2 || x<DOG_BORDER || y<DOG_BORDER || x>=D.w-DOG_BORDER || y>=D.h-DOG_BORDER)return false;
+  }
+
+  float k1=powf(2.f,1.f/ss.scales())-1;
+  k.response=(v+0.5*(g[0]*off[0]+g[1]*off[1]+g[2]*off[2]))/k1;
+  if(fabsf(k.response)<=thresh)return false;
+  k.octave=o;
+  k.layer=s;
+  k.ox=x+off[0];
+  k.oy=y+off[1];
+  k.x=k.ox*(1<<o);
+  k.y=k.oy*(1<<o);
+  k.sigma=ss.sigma(o,0)*powf(2.f,(s+off[2])/ss.scales());
+  return true;
+}
+
+vector<ScaleKeypoint> dog_extrema(const ScaleSpace& ss, float thresh, float edge_ratio){
+  int S=ss.scales();
+  // raw DoG values below this cannot reach thresh after the refinement
+  float pre=0.5f*thresh*(powf(2.f,1.f/S)-1);
+
+  // one task per band of rows of a layer, the results are put back in order
+  const int BAND=32;
+  struct Task { int o, s, y0, y1; };
+  vector<Task> tasks;
+  for(int o=0;o<ss.octaves();o++){
+    const Image& D=ss.dog(o,0);
+    for(int s=1;s<=S;s++)for(int y=DOG_BORDER;y<D.h-DOG_BORDER;y+=BAND)
+      tasks.push_back({o,s,y,min(y+BAND,D.h-DOG_BORDER)});
+  }
+
+  vector<vector<ScaleKeypoint>> found(tasks.size());
+  parallel_for(0,tasks.size(),[&](int i){
+    const Task& t=tasks[i];
+    const Image* D[3]={&ss.dog(t.o,t.s-1),&ss.dog(t.o,t.s),&ss.dog(t.o,t.s+1)};
+    vector<int> xs;
+    for(int y=t.y0;y<t.y1;y++){
+      xs.clear();
+      row_extrema(D,y,DOG_BORDER,D[1]->w-DOG_BORDER,pre,xs);
+      for(int x:xs){
+        ScaleKeypoint k;
+        if(refine_extremum(ss,t.o,t.s,x,y,thresh,edge_ratio,k))found[i].push_back(k);
+      }
+    }
+  });
+
+  vector<ScaleKeypoint> r;
+  for(auto&e1:found)r.insert(r.end(),e1.begin(),e1.end());
+  return r;
+}
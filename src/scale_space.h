@@ -0,0 +1,73 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "image.h"
+
+using namespace std;
+
+// returns: im blurred by sigma with clamped borders, as smooth_image does, separably and
+// rows in parallel; the blur of the levels of ScaleSpace.
+Image gaussian_blur(const Image& im, float sigma);
+
+// Gaussian scale space (pyramid) of an image.
+//
+// Octave o is the image reduced by 2^o. Every octave has scales+3 levels: level s is
+// blurred by sigma*2^(s/scales) in the pixels of its octave, so level 'scales' is
+// twice as blurred as level 0 and, decimated, is level 0 of the next octave.
+// A level is made from the previous one by blurring it with the difference of the
+// two sigmas only, so the kernels stay small. The DoG layers are the differences of
+// consecutive levels: dog(o,s)=level(o,s+1)-level(o,s), scales+2 per octave.
+// The channels of the image are kept: detectors working on intensity pass a grayscale image.
+class ScaleSpace
+  {
+  public:
+
+  // sigma: blur of level 0. scales: intervals per octave (levels are scales+3).
+  // octaves: 0 is as many as fit (the smallest octave is at least 16 pixels wide).
+  // input_sigma: blur the image already has (0.5 for camera images is usual).
+  ScaleSpace(const Image& im, float sigma, int scales, int octaves=0, float input_sigma=0.f);
+
+  // The scale space of im, shared with the other detectors asking for it.
+  // The last few built are kept; a kept one with more octaves is reused.
+  static shared_ptr<const ScaleSpace> get(const Image& im, float sigma, int scales, int octaves=0, float input_sigma=0.f);
+
+  int octaves(void) const { return (int)levels_.size(); }
+  int scales (void) const { return scales_; }
+  int levels (void) const { return scales_+3; }
+
+  const Image& level(int o, int s) const { return levels_[o][s]; }
+  const Image& dog  (int o, int s) const { return dogs_[o][s]; }
+
+  // returns: blur of level s in the pixels of its octave.
+  float level_sigma(int s) const { return sigma_*powf(2.f,(float)s/scales_); }
+  // returns: blur of level (o,s) in the pixels of the image.
+  float sigma(int o, int s) const { return level_sigma(s)*(1<<o); }
+
+  private:
+
+  float sigma_;
+  float input_sigma;
+  int scales_;
+  vector<vector<Image>> levels_;
+  vector<vector<Image>> dogs_;
+  };
+
+// An extremum of the DoG layers of a scale space, refined to subpixel and subscale position.
+// x, y, sigma: position and blur in the pixels of the image.
+// octave, layer: where it was found; ox, oy: position in the pixels of that octave.
+// response: interpolated DoG value, divided by k-1 so that it does not depend on the scales per octave.
+struct ScaleKeypoint
+  {
+  float x=0, y=0, sigma=0;
+  int octave=0, layer=0;
+  float ox=0, oy=0;
+  float response=0;
+  };
+
+// Scale-invariant keypoints (Lowe's SIFT detector): the points larger or smaller than
+// their 26 neighbours in space and scale, refined by fitting a quadratic to the DoG.
+// Refined points with |response| <= thresh, or on edges (ratio of the principal
+// curvatures above edge_ratio), are dropped. Octaves and layers are searched in parallel.
+vector<ScaleKeypoint> dog_extrema(const ScaleSpace& ss, float thresh, float edge_ratio=10.f);
@@ -2,7 +2,7 @@
 #include "../utils.h"
 #include "../matrix.h"
 #include <string>
-#include "../DOG.cpp"
+#include "../feature_registry.h"
 
 using namespace std;
 
@@ -30,19 +30,26 @@ int main() {
     int cutoff = 150;
     float acoeff = 0.5;
 
-    Image dog_points_A = detect_and_draw_dog(a, sigma, thresh, window, nms);
+    DetectorParams p;
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.window = window;
+    p.nms = nms;
+    auto detector = make_detector("dog", p);
+
+    Image dog_points_A = detect_and_draw_features(a, *detector);
     save_image(dog_points_A, "output/dog_keypoints_A");
 
-    Image dog_points_B = detect_and_draw_dog(b, sigma, thresh, window, nms);
+    Image dog_points_B = detect_and_draw_features(b, *detector);
     save_image(dog_points_B, "output/dog_keypoints_B");
 
-    Image dog_matches = find_and_draw_dog_matches(a, b, sigma, thresh, window, nms);
+    Image dog_matches = find_and_draw_feature_matches(a, b, *detector);
     save_image(dog_matches, "output/dog_matches");
 
-    Image dog_inliers = draw_dog_inliers(a, b, sigma, thresh, window, nms, inlier_thresh, iters, cutoff);
+    Image dog_inliers = draw_feature_inliers(a, b, *detector, inlier_thresh, iters, cutoff);
     save_image(dog_inliers, "output/dog_inliers");
 
-    Image dog_panorama = panorama_image_dog(a, b, sigma, thresh, window, nms, inlier_thresh, iters, cutoff, acoeff);
+    Image dog_panorama = panorama_image(a, b, *detector, inlier_thresh, iters, cutoff, acoeff);
     save_image(dog_panorama, "output/dog_panorama");
 
     return 0;
@@ -2,12 +2,12 @@
 #include "../utils.h"
 #include "../matrix.h"
 #include <string>
-#include "../FHH.cpp"
+#include "../feature_registry.h"
 
 using namespace std;
 
 //TESTIAMO IL RILEVATORE: sigma=1.5, window=10, nms=10
-//columbia 01 23 45 67 89 || METODO 0: thresh=3   || METODO 123: thresh=0.2
+//columbia 01 23 45 67 89 || METODO 0: thresh=0.001 || METODO 123: thresh=0.2
 //rainier  01 23 45       ||                      ||
 //field    32 45 67       ||                      ||                    
 //helens   10 23 45       ||                      ||                    
@@ -31,19 +31,27 @@ int main() {
     int cutoff = 150;
     float acoeff = 0.5;
 
-    Image fh_points_A = detect_and_draw_fhh(a, method, sigma, thresh, window, nms);
+    DetectorParams p;
+    p.method = method;
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.window = window;
+    p.nms = nms;
+    auto detector = make_detector("fhh", p);
+
+    Image fh_points_A = detect_and_draw_features(a, *detector);
     save_image(fh_points_A, "output/fhh_keypoints_A");
 
-    Image fh_points_B = detect_and_draw_fhh(b, method, sigma, thresh, window, nms);
+    Image fh_points_B = detect_and_draw_features(b, *detector);
     save_image(fh_points_B, "output/fhh_keypoints_B");
 
-    Image fh_matches = find_and_draw_fhh_matches(a, b, method, sigma, thresh, window, nms);
+    Image fh_matches = find_and_draw_feature_matches(a, b, *detector);
     save_image(fh_matches, "output/fhh_matches");
 
-    Image fh_inliers = draw_fhh_inliers(a, b, method, sigma, thresh, window, nms, inlier_thresh, iters, cutoff);
+    Image fh_inliers = draw_feature_inliers(a, b, *detector, inlier_thresh, iters, cutoff);
     save_image(fh_inliers, "output/fhh_inliers");
 
-    Image fh_panorama = panorama_image_fhh(a, b, method, sigma, thresh, window, nms, inlier_thresh, iters, cutoff, acoeff);
+    Image fh_panorama = panorama_image(a, b, *detector, inlier_thresh, iters, cutoff, acoeff);
     save_image(fh_panorama, "output/fhh_panorama");
 
     return 0;
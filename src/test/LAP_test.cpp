@@ -3,7 +3,7 @@
 #include "../matrix.h"
 
 #include <string>
-#include "../LAP.cpp"
+#include "../feature_registry.h"
 
 using namespace std;
 
@@ -31,19 +31,26 @@ int main() {
     int cutoff = 150;
     float acoeff = 0.5;
 
-    Image log_points_A = detect_and_draw_log_keypoints(a, sigma, thresh, window, nms);
+    DetectorParams p;
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.window = window;
+    p.nms = nms;
+    auto detector = make_detector("log", p);
+
+    Image log_points_A = detect_and_draw_features(a, *detector);
     save_image(log_points_A, "output/log_keypoints_A");
 
-    Image log_points_B = detect_and_draw_log_keypoints(b, sigma, thresh, window, nms);
+    Image log_points_B = detect_and_draw_features(b, *detector);
     save_image(log_points_B, "output/log_keypoints_B");
 
-    Image log_matches = find_and_draw_log_matches(a, b, sigma, thresh, window, nms);
+    Image log_matches = find_and_draw_feature_matches(a, b, *detector);
     save_image(log_matches, "output/log_matches");
 
-    Image log_inliers = draw_log_inliers(a, b, sigma, thresh, window, nms, inlier_thresh, iters, cutoff);
+    Image log_inliers = draw_feature_inliers(a, b, *detector, inlier_thresh, iters, cutoff);
     save_image(log_inliers, "output/log_inliers");
 
-    Image log_panorama = panorama_image_log(a, b, sigma, thresh, window, nms, inlier_thresh, iters, cutoff, acoeff);
+    Image log_panorama = panorama_image(a, b, *detector, inlier_thresh, iters, cutoff, acoeff);
     save_image(log_panorama, "output/log_panorama");
 
     return 0;
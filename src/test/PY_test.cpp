@@ -2,7 +2,7 @@
 #include "../utils.h"
 #include "../matrix.h"
 #include <string>
-#include "../PY.cpp"
+#include "../feature_registry.h"
 
 using namespace std;
 
@@ -33,19 +33,28 @@ int main() {
     int cutoff = 150;
     float acoeff = 0.5;
 
-    Image scale_points_A = detect_and_draw_scale_space_keypoints(a, sigma, thresh, window, nms, num_octaves, scales_per_octave);
+    DetectorParams p;
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.window = window;
+    p.nms = nms;
+    p.octaves = num_octaves;
+    p.scales = scales_per_octave;
+    auto detector = make_detector("scale-space", p);
+
+    Image scale_points_A = detect_and_draw_features(a, *detector);
     save_image(scale_points_A, "output/scale_keypoints_A");
 
-    Image scale_points_B = detect_and_draw_scale_space_keypoints(b, sigma, thresh, window, nms, num_octaves, scales_per_octave);
+    Image scale_points_B = detect_and_draw_features(b, *detector);
     save_image(scale_points_B, "output/scale_keypoints_B");
 
-    Image scale_matches = find_and_draw_scale_matches(a, b, sigma, thresh, window, nms, num_octaves, scales_per_octave);
+    Image scale_matches = find_and_draw_feature_matches(a, b, *detector);
     save_image(scale_matches, "output/scale_matches");
 
-    Image scale_inliers = draw_scale_inliers(a, b, sigma, thresh, window, nms, inlier_thresh, iters, cutoff, num_octaves, scales_per_octave);
+    Image scale_inliers = draw_feature_inliers(a, b, *detector, inlier_thresh, iters, cutoff);
     save_image(scale_inliers, "output/scale_inliers");
 
-    Image scale_panorama = panorama_image_scale(a, b, sigma, thresh, window, nms, inlier_thresh, iters, cutoff, acoeff, num_octaves, scales_per_octave);
+    Image scale_panorama = panorama_image(a, b, *detector, inlier_thresh, iters, cutoff, acoeff);
     save_image(scale_panorama, "output/scale_panorama");
 
     return 0;
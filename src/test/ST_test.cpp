@@ -2,7 +2,7 @@
 #include "../utils.h"
 #include "../matrix.h"
 #include <string>
-#include "../ST.cpp"
+#include "../feature_registry.h"
 
 using namespace std;
 
@@ -32,19 +32,27 @@ int main() {
     int cutoff = 150;
     float acoeff = 0.5;
 
-    Image shi_tomasi_points_A = detect_and_draw_shi_tomasi(a, is_adaptive, sigma, thresh, window, nms_size);
+    DetectorParams p;
+    p.method = is_adaptive;
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.window = window;
+    p.nms = nms_size;
+    auto detector = make_detector("shi-tomasi", p);
+
+    Image shi_tomasi_points_A = detect_and_draw_features(a, *detector);
     save_image(shi_tomasi_points_A, "output/shi_tomasi_keypoints_A");
 
-    Image shi_tomasi_points_B = detect_and_draw_shi_tomasi(b, is_adaptive, sigma, thresh, window, nms_size);
+    Image shi_tomasi_points_B = detect_and_draw_features(b, *detector);
     save_image(shi_tomasi_points_B, "output/shi_tomasi_keypoints_B");
 
-    Image shi_tomasi_matches = find_and_draw_shi_tomasi_matches(a, b, is_adaptive, sigma, thresh, window, nms_size);
+    Image shi_tomasi_matches = find_and_draw_feature_matches(a, b, *detector);
     save_image(shi_tomasi_matches, "output/shi_tomasi_matches");
 
-    Image shi_tomasi_inliers = draw_shi_tomasi_inliers(a, b, is_adaptive, sigma, thresh, window, nms_size, inlier_thresh, iters, cutoff);
+    Image shi_tomasi_inliers = draw_feature_inliers(a, b, *detector, inlier_thresh, iters, cutoff);
     save_image(shi_tomasi_inliers, "output/shi_tomasi_inliers");
 
-    Image shi_tomasi_panorama = panorama_image_shi_tomasi(a, b, is_adaptive, sigma, thresh, window, nms_size, inlier_thresh, iters, cutoff, acoeff);
+    Image shi_tomasi_panorama = panorama_image(a, b, *detector, inlier_thresh, iters, cutoff, acoeff);
     save_image(shi_tomasi_panorama, "output/shi_tomasi_panorama");
 
     return 0;
@@ -1,63 +1,154 @@
 #include "../image.h"
 #include "../utils.h"
 #include "../matrix.h"
+#include "../tiled_image.h"
+#include "../image_writer.h"
+#include "../job_graph.h"
+#include "../artifact_store.h"
+#include "../pipeline.h"
+#include "../feature_registry.h"
 
 #include <string>
-#include <thread>
-#include <map>
-#include <mutex>
 
 using namespace std;
 
+// Images, features and homographies of a dataset, published by name once they are done
+// and shared between the jobs without copies: inputs are detected once, merged results
+// carry the features of their inputs along.
 struct image_map
   {
-  map<string,Image> im;
-  mutex m;
+  ArtifactStore<Image> im;
+  ArtifactStore<vector<Descriptor>> d;
+  ArtifactStore<Matrix> H;  // homography between the two halves of a merged image
   string outdir,indir;
-  Image& operator[](const string& a){lock_guard<mutex> LG(m); return im[a];}
+  AsyncImageWriter writer;  // merged images are saved in the background as soon as they are done
   };
 
-void save_images(const image_map& im,const string& out)
+// Corners kept per image, $UWIMG_FEATURE_BUDGET (0 or unset: every corner above the
+// threshold). With a budget the corners are spread by adaptive non-maximal suppression,
+// so matching and RANSAC cost about the same for every dataset and threshold.
+int feature_budget(void)
   {
-  TIME(1);
-  vector < thread > th;
-  for(auto&e1:im.im)//if(e1.first.find("-")!=string::npos)
-  th.emplace_back([&]()
-    {
-    save_png(e1.second,out+e1.first);
-    printf("%s saved!\n",(out+e1.first).c_str());
-    });
-  for(auto&e1:th)e1.join();
+  const char* env=getenv("UWIMG_FEATURE_BUDGET");
+  return env ? max(0,atoi(env)) : 0;
+  }
+
+// The extractor of the corners: "oriented-patch" if $UWIMG_ORIENTATION is "centroid" or
+// "histogram", so handheld sets that roll between shots still match; null (axis-aligned
+// patches) if unset.
+unique_ptr<DescriptorExtractor> feature_extractor(int window)
+  {
+  const char* env=getenv("UWIMG_ORIENTATION");
+  if(!env || !*env)return nullptr;
+  DetectorParams p;
+  p.window=window;
+  p.orientation=string(env)=="histogram" ? ORIENT_HISTOGRAM : ORIENT_CENTROID;
+  return make_extractor("oriented-patch",p);
   }
 
-// PROJ_METHOD:    0 - Identity,    1 - cylindrical,    2 - spherical
-void load_images(image_map& im, const string& indir, const string& outdir, int numpics, int PROJ_METHOD=0, double FOCAL_LEN=1000)
+// Corners described by the extractor of feature_extractor.
+vector<Descriptor> orient_features(const Image& im, const vector<Descriptor>& d, int window)
+  {
+  unique_ptr<DescriptorExtractor> e=feature_extractor(window);
+  return e ? e->describe(im,d) : d;
+  }
+
+// Saves the images not saved yet (the merged ones are saved by their render job)
+// and waits for all of them to be written.
+void save_images(image_map& im,const string& out)
   {
   TIME(1);
-  im.indir=indir;
-  im.outdir=outdir;
-  vector < unique_ptr<thread> > th; 
-  for(int q1=0;q1<numpics;q1++)th.emplace_back(new thread([&,q1]()
+  for(auto&e1:im.im.snapshot())if(!im.H.get(e1.first))
     {
-    string file=indir+to_string(q1)+".jpg";
-    Image in=load_image(file);
-    if(PROJ_METHOD==0)im[to_string(q1)]=in;
-    if(PROJ_METHOD==1)im[to_string(q1)]=cylindrical_project(in,FOCAL_LEN);
-    if(PROJ_METHOD==2)im[to_string(q1)]=spherical_project(in,FOCAL_LEN);
-    printf("%s loaded into im[\"%s\"]\n",file.c_str(),to_string(q1).c_str());
-    }));
-  for(auto&e1:th)e1->join();th.clear();
+    im.writer.save(e1.second,out+e1.first);
+    printf("%s queued\n",(out+e1.first).c_str());
+    }
+  im.writer.wait();
   }
 
-void create_panorama(image_map& im, const string& out, const string& aname, const string& bname,
+// The panorama tree of a dataset as a graph of jobs: load:N, project:N, detect:N for the
+// inputs, match:OUT (matching and RANSAC) and render:OUT for the merged images.
+// Every step starts as soon as its inputs exist, and a step declared twice runs once.
+struct panorama_jobs
+  {
+  image_map im;
+  JobGraph g;
+  int numpics;
+  
+  // PROJ_METHOD:    0 - Identity,    1 - cylindrical,    2 - spherical
+  panorama_jobs(const string& indir, const string& outdir, int numpics, int PROJ_METHOD=0, double FOCAL_LEN=1000) : numpics(numpics)
+    {
+    im.indir=indir;
+    im.outdir=outdir;
+    for(int q1=0;q1<numpics;q1++)
+      {
+      string name=to_string(q1);
+      g.add("load:"+name,{},[this,name]()
+        {
+        string file=im.indir+name+".jpg";
+        im.im.publish(name,load_image(file));
+        printf("%s loaded into im[\"%s\"]\n",file.c_str(),name.c_str());
+        });
+      if(PROJ_METHOD==1)g.add("project:"+name,{"load:"+name},[this,name,FOCAL_LEN](){ im.im.publish(name,cylindrical_project(*im.im.get(name),FOCAL_LEN)); });
+      if(PROJ_METHOD==2)g.add("project:"+name,{"load:"+name},[this,name,FOCAL_LEN](){ im.im.publish(name,spherical_project(*im.im.get(name),FOCAL_LEN)); });
+      }
+    }
+  
+  bool is_input(const string& name) const
+    {
+    for(int q1=0;q1<numpics;q1++)if(name==to_string(q1))return true;
+    return false;
+    }
+  
+  // returns: the job after which the image has its features.
+  // Inputs are detected with the parameters of the first merge that uses them; a merge
+  // with another window describes the features again (see create_panorama).
+  string features(const string& name, float sigma, int corner_method, float thresh, int window, int nms)
+    {
+    if(!is_input(name))return "render:"+name;
+    string pixels=g.contains("project:"+name)?"project:"+name:"load:"+name;
+    g.add("detect:"+name,{pixels},[=]()
+      {
+      const Image& pic=*im.im.get(name);
+      im.d.publish(name,orient_features(pic,harris_corner_detector(pic,sigma,thresh,window,nms,corner_method,feature_budget(),SELECT_ANMS),window));
+      });
+    return "detect:"+name;
+    }
+  
+  void run(void)
+    {
+    TIME(1);
+    g.run();
+    save_images(im,im.outdir);
+    }
+  };
+
+void create_panorama(panorama_jobs& jobs, const string& out, const string& aname, const string& bname,
                      float sigma, int corner_method, float thresh, int window, int nms, float inlier_thresh, int iters, int cutoff, float acoeff)
   {
-  printf("Combining %s and %s into %s...\n",aname.c_str(),bname.c_str(),out.c_str());
-  assert(im[aname].size()!=0 && "Image A invalid\n");
-  assert(im[bname].size()!=0 && "Image B invalid\n");
-  im[out]=panorama_image(im[aname],im[bname],sigma,corner_method,thresh,window,nms,inlier_thresh,iters,cutoff,acoeff);
-  save_png(im[out],im.outdir+out);
-  printf("%s finished computing\n",out.c_str());
+  string fa=jobs.features(aname,sigma,corner_method,thresh,window,nms);
+  string fb=jobs.features(bname,sigma,corner_method,thresh,window,nms);
+  image_map& im=jobs.im;
+  
+  jobs.g.add("match:"+out,{fa,fb},[=,&im]()
+    {
+    printf("Combining %s and %s into %s...\n",aname.c_str(),bname.c_str(),out.c_str());
+    assert(im.im.get(aname) && "Image A invalid\n");
+    assert(im.im.get(bname) && "Image B invalid\n");
+    // the features carried from earlier merges may have the patches of another window
+    unique_ptr<DescriptorExtractor> e=feature_extractor(window);
+    vector<Descriptor> ad=describe_features(*im.im.get(aname),*im.d.get(aname),window,e.get());
+    vector<Descriptor> bd=describe_features(*im.im.get(bname),*im.d.get(bname),window,e.get());
+    im.H.publish(out,estimate_homography(ad,bd,inlier_thresh,iters,cutoff));
+    });
+  
+  jobs.g.add("render:"+out,{"match:"+out},[=,&im]()
+    {
+    Mosaic r=merge_mosaics(*im.im.get(aname),*im.d.get(aname),*im.im.get(bname),*im.d.get(bname),*im.H.get(out),acoeff);
+    printf("%s finished computing (%zu features carried)\n",out.c_str(),r.d.size());
+    im.writer.save(im.im.publish(out,move(r.im)),im.outdir+out);
+    im.d.publish(out,move(r.d));
+    });
   }
 
 // HW5 5
@@ -66,29 +157,24 @@ void do_columbia_peak(void)
   string indir="pano/columbia/";
   string outdir="output/columbia/";
   
-  image_map im;
-  load_images(im,indir,outdir,11,2,1310);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
+  panorama_jobs im(indir,outdir,11,2,1310);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
-  vector < thread > th; 
-  
-  th.push_back(thread([&](){create_panorama(im,"0-1","0","1" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"2-3","2","3" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"4-5","4","5" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"6-7","6","7" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"8-9","8","9" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"0-1","0","1" ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"2-3","2","3" ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"4-5","4","5" ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"6-7","6","7" ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"8-9","8","9" ,2,0,0.05,7,7,5,50000,100,0.5);
   
   
-  th.push_back(thread([&](){create_panorama(im,"8--10",  "8-9",  "10"  ,2,0,0.15,11,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"0--3" ,  "0-1",  "2-3" ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"4--7" ,  "4-5",  "6-7" ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"8--10",  "8-9",  "10"  ,2,0,0.15,11,7,5,50000,100,0.5);
+  create_panorama(im,"0--3" ,  "0-1",  "2-3" ,2,0,0.04,11,7,5,50000,100,0.5);
+  create_panorama(im,"4--7" ,  "4-5",  "6-7" ,2,0,0.04,11,7,5,50000,100,0.5);
   
   
   create_panorama(im,"4--10" , "4--7",  "8--10" ,2,0,0.04,10,7,5,50000,100,0.5);
   create_panorama(im,"all"   , "0--3",  "4--10" ,2,0,0.04,10,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -99,8 +185,7 @@ void do_rainier(void)
   string indir="pano/rainier/";
   string outdir="output/rainier/";
   
-  image_map im;
-  load_images(im,indir,outdir,6,0,710);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
+  panorama_jobs im(indir,outdir,6,0,710);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
   create_panorama(im,"0-1","0","1" ,2,0,0.05,7,7,5,50000,100,0.5);
   create_panorama(im,"2-3","2","3" ,2,0,0.05,7,7,5,50000,100,0.5);
@@ -109,7 +194,7 @@ void do_rainier(void)
   create_panorama(im,"0--3","0-1","2-3"  ,2,0,0.05,7,7,5,50000,100,0.5);
   create_panorama(im,"all" ,"0--3","4-5" ,2,0,0.05,7,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -120,24 +205,18 @@ void do_field(void)
   string indir="pano/field/";
   string outdir="output/field/";
   
-  image_map im;
-  load_images(im,indir,outdir,8,1,1200);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
-  
-  vector < thread > th; 
+  panorama_jobs im(indir,outdir,8,1,1200);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
+  create_panorama(im,"2-3","2","3" ,3,0,0.05,11,7,5,50000,100,0);
+  create_panorama(im,"4-5","4","5" ,3,0,0.05,11,7,5,50000,100,1);
+  create_panorama(im,"6-7","6","7" ,3,0,0.05,11,7,5,50000,100,1);
   
-  th.push_back(thread([&](){create_panorama(im,"2-3","2","3" ,3,0,0.05,11,7,5,50000,100,0);}));
-  th.push_back(thread([&](){create_panorama(im,"4-5","4","5" ,3,0,0.05,11,7,5,50000,100,1);}));
-  th.push_back(thread([&](){create_panorama(im,"6-7","6","7" ,3,0,0.05,11,7,5,50000,100,1);}));
-  for(auto&e1:th)e1.join();th.clear();
   
-  
-  th.push_back(thread([&](){create_panorama(im,"4--7", "4-5",  "6-7" ,3,0,0.05,11,7,5,50000,100,1);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"4--7", "4-5",  "6-7" ,3,0,0.05,11,7,5,50000,100,1);
   
   create_panorama(im,"all"   , "2-3",  "4--7" ,3,0,0.05,11,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -148,22 +227,17 @@ void do_helens(void)
   string indir="pano/helens/";
   string outdir="output/helens/";
   
-  image_map im;
-  load_images(im,indir,outdir,6,1,950);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
-  
-  vector < thread > th; 
+  panorama_jobs im(indir,outdir,6,1,950);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
-  
-  th.push_back(thread([&](){create_panorama(im,"0-1","0","1" ,2,0,0.05,11,7,5,150000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"2-3","2","3" ,2,0,0.05,11,7,5,150000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"4-5","4","5" ,2,0,0.05,11,7,5,150000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"0-1","0","1" ,2,0,0.05,11,7,5,150000,100,0.5);
+  create_panorama(im,"2-3","2","3" ,2,0,0.05,11,7,5,150000,100,0.5);
+  create_panorama(im,"4-5","4","5" ,2,0,0.05,11,7,5,150000,100,0.5);
   
   
   create_panorama(im,"0--3", "0-1",  "2-3" ,2,0,0.05,11,7,5,50000,100,0.5);
   create_panorama(im,"all" , "0--3", "4-5" ,2,0,0.05,11,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -174,20 +248,15 @@ void do_sun(void)
   string indir="pano/sun/";
   string outdir="output/sun/";
   
-  image_map im;
-  load_images(im,indir,outdir,5,1,1000);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
-  
-  vector < thread > th; 
-  
+  panorama_jobs im(indir,outdir,5,1,1000);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
-  th.push_back(thread([&](){create_panorama(im,"0-1","0","1" ,2,0,0.05,11,7,5,150000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"2-3","2","3" ,2,0,0.05,11,7,5,150000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"0-1","0","1" ,2,0,0.05,11,7,5,150000,100,0.5);
+  create_panorama(im,"2-3","2","3" ,2,0,0.05,11,7,5,150000,100,0.5);
   
   create_panorama(im,"2--4", "2-3",  "4"   ,2,0,0.05,11,7,5,50000,100,0.5);
   create_panorama(im,"all" , "0-1", "2--4" ,2,0,0.05,11,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -199,59 +268,33 @@ void do_white_wall(void)
   string indir="pano/wall/";
   string outdir="output/wall/";
   
-  image_map im;
-  load_images(im,indir,outdir,24);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
-  
-  vector < thread > th; 
-  
+  panorama_jobs im(indir,outdir,24);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
-  th.push_back(thread([&]()
-    {
-    create_panorama(im,"1--2","2"   ,"1" ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"0--2","1--2","0" ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"0--3","0--2","3" ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"0--4","0--3","4" ,2,0,0.05,11,7,5,50000,100,0.5);
-    }));
-  th.push_back(thread([&]()
-    {
-    create_panorama(im,"7--8" ,"7"   ,"8"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"5--6" ,"6"   ,"5"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"9--10","9"   ,"10"    ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"5--8" ,"5--6","7--8"  ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"5--10","5--8","9--10" ,2,0,0.05,11,7,5,50000,100,0.5);
-    }));
-  th.push_back(thread([&]()
-    {
-    create_panorama(im,"11--12" ,"12"   ,"11"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"13--14" ,"14"   ,"13"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"15--16" ,"15"   ,"16"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"13--16" ,"13--14","15--16",2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"11--16" ,"13--16","11--12",2,0,0.05,11,7,5,50000,100,0.5);
-    }));
-  th.push_back(thread([&]()
-    {
-    create_panorama(im,"11--12" ,"12"   ,"11"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"13--14" ,"14"   ,"13"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"15--16" ,"15"   ,"16"     ,2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"13--16" ,"13--14","15--16",2,0,0.05,11,7,5,50000,100,0.5);
-    create_panorama(im,"11--16" ,"13--16","11--12",2,0,0.05,11,7,5,50000,100,0.5);
-    }));
-  
-  th.push_back(thread([&]()
-    {
-    create_panorama(im,"17--18" ,"18"    ,"17"     ,2,0,0.02,11,7,5,50000,100,0.5);
-    create_panorama(im,"19--20" ,"20"    ,"19"     ,2,0,0.02,11,7,5,50000,100,0.5);
-    create_panorama(im,"21--22" ,"21"    ,"22"     ,2,0,0.02,11,7,5,50000,100,0.5);
-    create_panorama(im,"21--23" ,"21--22","23"     ,2,0,0.02,11,7,5,50000,100,0.5);
-    create_panorama(im,"17--20" ,"19--20","17--18" ,2,0,0.02,11,7,5,50000,100,0.5);
-    create_panorama(im,"17--23" ,"17--20","21--23" ,2,0,0.02,11,7,5,50000,100,0.5);
-    }));
+  create_panorama(im,"1--2","2"   ,"1" ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"0--2","1--2","0" ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"0--3","0--2","3" ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"0--4","0--3","4" ,2,0,0.05,11,7,5,50000,100,0.5);
   
+  create_panorama(im,"7--8" ,"7"   ,"8"     ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"5--6" ,"6"   ,"5"     ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"9--10","9"   ,"10"    ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"5--8" ,"5--6","7--8"  ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"5--10","5--8","9--10" ,2,0,0.05,11,7,5,50000,100,0.5);
   
+  create_panorama(im,"11--12" ,"12"   ,"11"     ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"13--14" ,"14"   ,"13"     ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"15--16" ,"15"   ,"16"     ,2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"13--16" ,"13--14","15--16",2,0,0.05,11,7,5,50000,100,0.5);
+  create_panorama(im,"11--16" ,"13--16","11--12",2,0,0.05,11,7,5,50000,100,0.5);
   
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"17--18" ,"18"    ,"17"     ,2,0,0.02,11,7,5,50000,100,0.5);
+  create_panorama(im,"19--20" ,"20"    ,"19"     ,2,0,0.02,11,7,5,50000,100,0.5);
+  create_panorama(im,"21--22" ,"21"    ,"22"     ,2,0,0.02,11,7,5,50000,100,0.5);
+  create_panorama(im,"21--23" ,"21--22","23"     ,2,0,0.02,11,7,5,50000,100,0.5);
+  create_panorama(im,"17--20" ,"19--20","17--18" ,2,0,0.02,11,7,5,50000,100,0.5);
+  create_panorama(im,"17--23" ,"17--20","21--23" ,2,0,0.02,11,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -262,37 +305,31 @@ void do_cse_glade(void)
   string indir="pano/cse/";
   string outdir="output/cse/";
   
-  image_map im;
-  load_images(im,indir,outdir,19,2,1310/1.6);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
-  
-  vector < thread > th; 
+  panorama_jobs im(indir,outdir,19,2,1310/1.6);  // im, dir, numpics (0..numpics-1),  PROJ_METHOD,  FOCAL_LEN
   
-  th.push_back(thread([&](){create_panorama(im,"1-2","1","2"     ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"3-4","3","4"     ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"5-6","5","6"     ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"7-8","7","8"     ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"9-10","9","10"   ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"11-12","11","12" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"13-14","13","14" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"15-16","15","16" ,2,0,0.05,7,7,5,50000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"1-2","1","2"     ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"3-4","3","4"     ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"5-6","5","6"     ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"7-8","7","8"     ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"9-10","9","10"   ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"11-12","11","12" ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"13-14","13","14" ,2,0,0.05,7,7,5,50000,100,0.5);
+  create_panorama(im,"15-16","15","16" ,2,0,0.05,7,7,5,50000,100,0.5);
   
   
   
-  th.push_back(thread([&](){create_panorama(im,"1--4" ,  "3-4", "1-2"    ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"5--8" ,  "7-8",  "5-6"   ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"9--12" , "11-12", "9-10" ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"13--16" ,"15-16","13-14" ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"1--4" ,  "3-4", "1-2"    ,2,0,0.04,11,7,5,50000,100,0.5);
+  create_panorama(im,"5--8" ,  "7-8",  "5-6"   ,2,0,0.04,11,7,5,50000,100,0.5);
+  create_panorama(im,"9--12" , "11-12", "9-10" ,2,0,0.04,11,7,5,50000,100,0.5);
+  create_panorama(im,"13--16" ,"15-16","13-14" ,2,0,0.04,11,7,5,50000,100,0.5);
   
   
-  th.push_back(thread([&](){create_panorama(im,"1--8" , "1--4", "5--8" ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  th.push_back(thread([&](){create_panorama(im,"9--16" ,"9--12","13--16" ,2,0,0.04,11,7,5,50000,100,0.5);}));
-  for(auto&e1:th)e1.join();th.clear();
+  create_panorama(im,"1--8" , "1--4", "5--8" ,2,0,0.04,11,7,5,50000,100,0.5);
+  create_panorama(im,"9--16" ,"9--12","13--16" ,2,0,0.04,11,7,5,50000,100,0.5);
   
   create_panorama(im,"1--16" , "9--16", "1--8" ,2,0,0.04,11,7,5,50000,100,0.5);
   
-  save_images(im,outdir);
+  im.run();
   
   }
 
@@ -300,12 +337,167 @@ void do_cse_glade(void)
 
 
 
+// Same datasets, registered all together instead of with a tree of pairwise merges.
+struct dataset
+  {
+  string name;
+  int numpics, PROJ_METHOD;
+  double FOCAL_LEN;
+  float thresh;
+  int window;
+  };
+
+const vector<dataset> datasets=
+  {
+  {"columbia",11,2,1310    ,0.05, 7},
+  {"rainier" , 6,0, 710    ,0.05, 7},
+  {"field"   , 8,1,1200    ,0.05,11},
+  {"helens"  , 6,1, 950    ,0.05,11},
+  {"sun"     , 5,1,1000    ,0.05,11},
+  {"wall"    ,24,0,1000    ,0.02,11},
+  {"cse"     ,19,2,1310/1.6,0.05, 7},
+  };
+
+// A frame flowing through the streaming pipeline of do_global.
+struct frame
+  {
+  int i=-1;
+  Image im;
+  };
+
+struct frame_features
+  {
+  int i=-1;
+  int w=0, h=0;
+  vector<Descriptor> d;
+  };
+
+// Registration of the whole dataset as a streaming pipeline:
+//   decode -> project -> detect -> pairs -> match+estimate -> collect
+// the images are decoded straight to luma (features are described on it), the pixels
+// are dropped as soon as the features are extracted, and pairs are matched while the
+// next images are still being decoded. Then the images are decoded again, in color,
+// streamed one at a time into the tiled canvas.
+// Queues are small, so the memory used depends on their size, not on the number of images.
+// direct: features are detected on the original images and their points are
+// projected analytically, the images are warped only once, while rendering.
+void do_global(const string& name, bool direct)
+  {
+  for(auto&e1:datasets)if(e1.name==name)
+    {
+    TIME(1);
+    const dataset& ds=e1;
+    string indir="pano/"+name+"/", outdir="output/"+name+"/";
+    Projection proj(ds.PROJ_METHOD,ds.FOCAL_LEN);
+    int n=ds.numpics;
+    // The stages together take as many threads as the pool has workers: the two light ones
+    // (pairs, collect) one each, decode a quarter of the rest, detect and match half each
+    // of what remains. Detection and matching also fan out on the pool from those threads.
+    int workers=ThreadPool::instance().workers();
+    int rest=max(3,workers-2);
+    int decoders=max(1,rest/4);
+    int detectors=max(1,(rest-decoders)/2);
+    int matchers=rest-decoders-detectors;
+    
+    // registration only needs the luma: it is decoded without building the RGB image
+    auto decode=[&](int q1, bool gray)
+      {
+      frame f;
+      f.i=q1;
+      f.im=gray ? load_image_gray(indir+to_string(q1)+".jpg") : load_image(indir+to_string(q1)+".jpg");
+      if(!direct && ds.PROJ_METHOD==1)f.im=cylindrical_project(f.im,ds.FOCAL_LEN);
+      if(!direct && ds.PROJ_METHOD==2)f.im=spherical_project(f.im,ds.FOCAL_LEN);
+      return f;
+      };
+    
+    vector<frame_features> features(n);
+    vector<PairwiseRegistration> pairs;
+      {
+      BoundedQueue<int> todo(n);
+      BoundedQueue<frame> decoded(2);
+      BoundedQueue<frame_features> detected(4);
+      BoundedQueue<pair<int,int>> matches(64);
+      BoundedQueue<PairwiseRegistration> registered(64);
+      for(int q1=0;q1<n;q1++)todo.push(q1);
+      todo.close();
+      
+      Pipeline p;
+      p.stage(decoders,todo,decoded,[&](int q1, BoundedQueue<frame>& out){ out.push(decode(q1,true)); });
+      p.stage(detectors,decoded,detected,[&](frame f, BoundedQueue<frame_features>& out)
+        {
+        frame_features r;
+        r.i=f.i; r.w=f.im.w; r.h=f.im.h;
+        r.d=orient_features(f.im,harris_corner_detector(f.im,2,ds.thresh,ds.window,7,0,feature_budget(),SELECT_ANMS),ds.window);
+        if(direct)project_features(r.d,proj,r.w,r.h);
+        printf("%d: %zu features\n",r.i,r.d.size());
+        out.push(move(r));
+        });
+      // the features are published before the pairs that use them
+      vector<int> seen;
+      p.stage(1,detected,matches,[&](frame_features f, BoundedQueue<pair<int,int>>& out)
+        {
+        int i=f.i;
+        features[i]=move(f);
+        for(int j:seen)out.push({min(i,j),max(i,j)});
+        seen.push_back(i);
+        });
+      p.stage(matchers,matches,registered,[&](pair<int,int> ab, BoundedQueue<PairwiseRegistration>& out)
+        {
+        out.push(register_pair(features[ab.first].d,features[ab.second].d,ab.first,ab.second,5,50000,100));
+        });
+      p.sink(1,registered,[&](PairwiseRegistration r)
+        {
+        if(r.inliers.size()<20)return;
+        printf("Pair %d-%d: %zu inliers\n",r.a,r.b,r.inliers.size());
+        pairs.push_back(move(r));
+        });
+      p.join();
+      }
+    sort(pairs.begin(),pairs.end(),[](const PairwiseRegistration& a, const PairwiseRegistration& b){ return make_pair(a.a,a.b)<make_pair(b.a,b.b); });
+    
+    int root=0;
+    vector<Matrix> Hr=spanning_tree_homographies(n,pairs,root);
+    bundle_adjust(Hr,pairs,root,features[root].w,features[root].h,30);
+    
+    // The canvas is tiled on disk, so the size of the panorama is not limited by memory.
+    // It has the channels of the files, read once from the header of the first one.
+    vector<pair<int,int>> sizes;
+    for(auto&e2:features)sizes.push_back({e2.w,e2.h});
+    int channels=image_channels(indir+"0.jpg");
+    if(!channels)channels=3;
+    TiledRenderer r(sizes,channels,Hr,direct?proj:Projection());
+      {
+      BoundedQueue<int> todo(n);
+      BoundedQueue<frame> decoded(2);
+      for(int q1=0;q1<n;q1++)if(Hr[q1].rows)todo.push(q1);
+      todo.close();
+      
+      Pipeline p;
+      p.stage(decoders,todo,decoded,[&](int q1, BoundedQueue<frame>& out){ out.push(decode(q1,false)); });
+      p.sink(1,decoded,[&](frame f){ r.add(f.i,f.im); });
+      p.join();
+      }
+    save_png(r.finish(),outdir+"global");
+    printf("%s saved!\n",(outdir+"global").c_str());
+    return;
+    }
+  printf("Unknown dataset %s\n",name.c_str());
+  }
+
+
+
 int main(int argc, char **argv)
   {
   
   if(argc<=1)
     {
-    printf("USAGE: ./make-panorama [name]=rainier/columbia/helens/field/sun/wall...\n");
+    printf("USAGE: ./make-panorama [name]=rainier/columbia/helens/field/sun/wall... [global [direct]]\n");
+    return 0;
+    }
+  
+  if(argc>2 && string(argv[2])=="global")
+    {
+    do_global(argv[1],argc>3 && string(argv[3])=="direct");
     return 0;
     }
   
@@ -1,6 +1,20 @@
 #include "../image.h"
 #include "../utils.h"
 #include "../matrix.h"
+#include "../tiled_image.h"
+#include "../image_writer.h"
+#include "../image_file.h"
+#include "../feature_cache.h"
+#include "../scale_space.h"
+#include "../fast_hessian.h"
+#include "../cornerness.h"
+#include "../feature_registry.h"
+#include "../fast_corners.h"
+#include "../orientation.h"
+#include "../remap.h"
+#include "../job_graph.h"
+#include "../artifact_store.h"
+#include "../pipeline.h"
 
 #include <string>
 
@@ -26,10 +40,645 @@ void test_cornerness(){
   TEST(same_image(c, gt));
 }
 
+void test_bundle_adjust(){
+  // Three views of a synthetic plane, the first one is the reference.
+  vector<Matrix> truth(3, Matrix::identity_homography());
+  truth[1](0,2)=-300; truth[1](1,2)=10; truth[1](2,0)=1e-5;
+  truth[2](0,2)=-600; truth[2](1,2)=-5; truth[2](0,1)=0.01;
+  
+  vector<PairwiseRegistration> pairs;
+  for(int a=0;a<3;a++)for(int b=a+1;b<3;b++)
+    {
+    PairwiseRegistration r;
+    r.a=a; r.b=b;
+    for(int q1=0;q1<60;q1++)
+      {
+      Point X(300*b+myrand()%400, myrand()%400);
+      r.inliers.push_back({project_point(truth[a],X),project_point(truth[b],X)});
+      }
+    pairs.push_back(r);
+    }
+  
+  vector<Matrix> Hr=truth;
+  Hr[1](0,2)+=4; Hr[1](1,1)+=0.01;
+  Hr[2](1,2)-=3; Hr[2](2,1)+=1e-5;
+  
+  double rms=bundle_adjust(Hr, pairs, 0, 640, 480, 50);
+  TEST(rms<0.01);
+  TEST(fabs(Hr[2](0,2)-truth[2](0,2))<0.1);
+}
+
+void test_tiled_canvas(){
+  Image a = load_image("data/dog.jpg");
+  Image b = bilinear_resize(a, a.w*3/4, a.h*3/4);
+  Matrix H = Matrix::translation_homography(-a.w/2, 10);
+  
+  TiledImage t = combine_images_tiled(a, b, H, 0.5);
+  int ox, oy;
+  Image c = combine_images(a, b, H, 0.5, ox, oy);
+  TEST(same_image(t.to_image(), c));
+  
+  // the pixels of a are pasted untouched, at the offset
+  int moved=0;
+  for(int j=0;j<a.h;j++)for(int i=0;i<a.w;i++)if(!a.is_empty(i,j))
+    for(int k=0;k<a.c;k++)moved+=c(i-ox,j-oy,k)!=a(i,j,k);
+  TEST(c.w>a.w && oy==-10 && moved==0);
+  
+  // wider than the old 15000 pixel limit
+  Image s(200, 200, 1);
+  for(int j=0;j<s.h;j++)for(int i=0;i<s.w;i++)s(i,j,0)=0.1f+0.8f*((i/10+j/10)%2);
+  Image wide = combine_images(s, s, Matrix::translation_homography(-16000, 0), 0.5);
+  TEST(wide.w>15000 && wide.h==200);
+  Image rw = render_panorama({s, s}, {Matrix::identity_homography(), Matrix::translation_homography(-16000, 0)});
+  TEST(rw.w>15000 && rw.h==200);
+  
+  // streaming PNG writer
+  save_png(t, "output/tiled_canvas");
+  TEST(same_image(load_image("output/tiled_canvas.png"), c));
+}
+
+void test_remap(){
+  Image a = load_image("data/dog.jpg");
+  float f = 300;
+  
+  // same as sampling the cylinder point by point
+  Image c = cylindrical_project(a, f);
+  Image r(a.w, a.h, a.c);
+  for(int j=0;j<a.h;j++)for(int i=0;i<a.w;i++){
+    float theta = (i - a.w/2) / f;
+    float x = f*tan(theta) + a.w/2;
+    float y = (j - a.h/2) / cos(theta) + a.h/2;
+    if(x>=0 && y>=0 && x<=a.w-1 && y<=a.h-1)for(int k=0;k<a.c;k++)r(i,j,k)=a.pixel_bilinear(x,y,k);
+  }
+  TEST(same_image(c, r));
+  
+  // maps are cached
+  TEST(projection_map(a.w, a.h, f, PROJ_CYLINDRICAL)==projection_map(a.w, a.h, f, PROJ_CYLINDRICAL));
+  
+  // but only the last few: a map not used for a while is freed
+  weak_ptr<const RemapMap> old = projection_map(16, 16, 100, PROJ_SPHERICAL);
+  for(int q1=1;q1<=4;q1++)projection_map(16, 16, 100+q1, PROJ_SPHERICAL);
+  TEST(old.expired());
+  
+  // points move to where the map samples them
+  Projection proj(PROJ_SPHERICAL, f);
+  Point p = proj.forward(Point(40, 200), a.w, a.h);
+  Point q = proj.inverse(p, a.w, a.h);
+  TEST(fabs(q.x-40)<1e-3 && fabs(q.y-200)<1e-3);
+  TEST(p.x>40 && p.y>200);
+  
+  // no distortion, no change
+  TEST(same_image(remap_image(a, undistortion_map(a.w, a.h, f, 0, 0)), a));
+}
+
+void test_thread_pool(){
+  // nested parallel loops
+  atomic<int> sum(0);
+  parallel_for(0, 16, [&](int i){ parallel_for(0, 100, [&](int j){ sum += j; }); });
+  TEST(sum==16*4950);
+  
+  // ranges cover the loop exactly once
+  vector<int> hit(1000, 0);
+  parallel_for_ranges(0, 1000, 7, [&](int lo, int hi){ for(int i=lo;i<hi;i++)hit[i]++; });
+  TEST(count(hit.begin(), hit.end(), 1)==1000);
+  
+  // exceptions reach the waiting thread
+  bool caught=false;
+  try { parallel_for(0, 10, [&](int i){ if(i==5)throw runtime_error("task failed"); }); }
+  catch(const runtime_error&) { caught=true; }
+  TEST(caught);
+}
+
+void test_job_graph(){
+  JobGraph g;
+  atomic<int> a(0), b(0), c(0);
+  TEST(g.add("a", {}, [&](){ a++; }));
+  TEST(!g.add("a", {}, [&](){ a++; }));
+  g.add("b", {"a"}, [&](){ b = a + 1; });
+  g.add("c", {"a", "b"}, [&](){ c = b + 1; });
+  g.run();
+  TEST(a==1 && b==2 && c==3);
+  
+  JobGraph cycle;
+  cycle.add("x", {"y"}, [](){});
+  cycle.add("y", {"x"}, [](){});
+  bool caught=false;
+  try { cycle.run(); } catch(const invalid_argument&) { caught=true; }
+  TEST(caught);
+}
+
+void test_artifact_store(){
+  ArtifactStore<vector<int>> store;
+  TEST(!store.get("a"));
+  
+  // readers keep their snapshot while the key is published again
+  parallel_for(0, 64, [&](int i){ store.publish(to_string(i%8), vector<int>(100, i)); });
+  auto v=store.get("3");
+  store.publish("3", vector<int>(1, -1));
+  TEST(v->size()==100 && (*v)[0]%8==3);
+  TEST(store.get("3")->size()==1);
+  TEST(store.snapshot().size()==8);
+}
+
+void test_pipeline(){
+  BoundedQueue<int> in(1024), squares(4);
+  for(int i=0;i<1000;i++)in.push(i);
+  in.close();
+  
+  long long sum=0;
+  Pipeline p;
+  p.stage(3, in, squares, [](int i, BoundedQueue<int>& out){ out.push(i*i); });
+  p.sink(1, squares, [&](int v){ sum+=v; });
+  p.join();
+  TEST(sum==332833500);
+  
+  // a failing stage stops the pipeline
+  BoundedQueue<int> a(1024), b(4);
+  for(int i=0;i<1000;i++)a.push(i);
+  a.close();
+  Pipeline q;
+  q.stage(2, a, b, [](int i, BoundedQueue<int>& out){ out.push(i); });
+  q.sink(1, b, [](int v){ if(v==10)throw runtime_error("sink failed"); });
+  bool caught=false;
+  try { q.join(); } catch(const runtime_error&) { caught=true; }
+  TEST(caught);
+}
+
+void test_load_image(){
+  Image a = load_image("data/dog.jpg");
+  TEST(same_image(load_image_gray("data/dog.jpg"), rgb_to_grayscale(a)));
+  TEST(image_channels("data/dog.jpg")==a.c && image_channels("data/missing.png")==0);
+  
+  vector<Image> ims = load_images({"data/dog.jpg", "data/dots.png", "data/dog.jpg"});
+  TEST(ims.size()==3 && same_image(ims[0], a) && same_image(ims[2], a));
+  
+  Image none;
+  string error;
+  TEST(!try_load_image("data/missing.png", none, 0, &error) && !error.empty());
+  bool caught=false;
+  try { load_image("data/missing.png"); } catch(const runtime_error&) { caught=true; }
+  TEST(caught);
+}
+
+void test_reduced_decode(){
+  Image a = load_image("pano/cse/1.jpg");
+  Image half = load_image("pano/cse/1.jpg", 2);
+  TEST(half.w==a.w/2 && half.h==a.h/2 && same_image(half, box_downsample(a, 2)));
+}
+
+void test_mosaic_windows(){
+  // mosaics detected with different windows are matched with the patches of one window
+  Image a = load_image("pano/cse/1.jpg");
+  Image b(a.w-60, a.h-40, a.c);
+  for(int k=0;k<a.c;k++)for(int y=0;y<b.h;y++)for(int x=0;x<b.w;x++)b(x,y,k)=a(x+60,y+40,k);
+  Mosaic ma = make_mosaic(a, 2, 0, 0.3, 7, 3);
+  Mosaic mb = make_mosaic(b, 2, 0, 0.3, 11, 3);
+  Mosaic ab = panorama_mosaic(ma, mb, 5, 1000, 50, 0.5);
+  bool sized = ab.window == 11 && !ab.d.empty();
+  for(auto&e1:ab.d)sized = sized && e1.data.size() == 11*11*3u;
+  TEST(sized && ab.im.w == a.w && ab.im.h == a.h);
+  
+  // and again, merging the merged mosaic with a smaller window
+  Mosaic mc = make_mosaic(b, 2, 0, 0.3, 5, 3);
+  Mosaic abc = panorama_mosaic(ab, mc, 5, 1000, 50, 0.5, 5);
+  sized = abc.window == 5 && !abc.d.empty();
+  for(auto&e1:abc.d)sized = sized && e1.data.size() == 5*5*3u;
+  TEST(sized && abc.im.w == a.w && abc.im.h == a.h);
+}
+
+void test_image_writer(){
+  Image a = load_image("pano/cse/1.jpg");
+  for(int level : {0, 1, 9})
+    {
+    save_png(a, "output/writer", level);
+    TEST(same_image(load_image("output/writer.png"), a));
+    }
+  
+  // written in the background, in bands that do not end on a strip
+  PngWriter png;
+  TEST(png.open("output/writer_bands.png", a.w, a.h, a.c));
+  for(int y=0;y<a.h;y+=333)png.write_rows(a, y, min(333, a.h-y));
+  TEST(png.close());
+  AsyncImageWriter writer(2);
+  auto p = make_shared<const Image>(load_image("output/writer_bands.png"));
+  for(int i=0;i<4;i++)writer.save(p, "output/writer_async"+to_string(i));
+  TEST(writer.wait());
+  TEST(same_image(load_image("output/writer_async3.png"), a));
+}
+
+void test_image_file(){
+  Image a = load_image("pano/cse/1.jpg");
+  for(int compress=0;compress<2;compress++)
+    {
+    TEST(write_binary(a, "output/binary.bin", BIN_F32, compress));
+    TEST(same_image(load_binary("output/binary.bin"), a));
+    TEST(write_binary(a, "output/binary.bin", BIN_F16, compress));
+    TEST(same_image(load_binary("output/binary.bin"), a));
+    TEST(write_binary(a, "output/binary.bin", BIN_U8, compress));
+    TEST(same_image(load_binary("output/binary.bin"), a));
+    }
+  
+  // uncompressed floats are used in place
+  save_binary(a, "output/binary.bin");
+  MappedImage m;
+  TEST(m.open("output/binary.bin", true) && m.is_mapped() && same_image(m.image(), a));
+  
+  // a flipped byte is caught by the checksum
+  FILE* f = fopen("output/binary.bin", "r+b");
+  fseek(f, 1000, SEEK_SET);
+  fputc(fgetc(f)^1, f);
+  fclose(f);
+  Image b;
+  string error;
+  TEST(!read_binary("output/binary.bin", b, &error) && error.find("checksum")!=string::npos);
+}
+
+void test_feature_cache(){
+  Image a = load_image("pano/rainier/0.jpg");
+  FeatureCache cache("output/feature_cache");
+  string k = FeatureCache::key(a, "harris", {2, 0.3, 7, 3, 0});
+  TEST(k != FeatureCache::key(a, "harris", {2, 0.3, 7, 5, 0}));
+  remove(cache.path(k).c_str());
+  
+  int computed = 0;
+  auto detect = [&](){ computed++; return harris_corner_detector(a, 2, 0.3, 7, 3, 0); };
+  vector<Descriptor> d1 = cache.get(a, "harris", {2, 0.3, 7, 3, 0}, detect);
+  vector<Descriptor> d2 = cache.get(a, "harris", {2, 0.3, 7, 3, 0}, detect);
+  TEST(computed == 1 && d1.size() == d2.size() && d1.size() > 0);
+  TEST(d1.back().p.x == d2.back().p.x && d1.back().data == d2.back().data);
+  
+  // oriented features keep their angle
+  OrientedPatchExtractor e(7);
+  vector<Descriptor> o = e.describe(a, d1);
+  string ko = FeatureCache::key(a, "oriented-patch", {2, 0.3, 7, 3, 0});
+  vector<Descriptor> o2;
+  TEST(cache.store(ko, o) && cache.load(ko, o2) && o2.size() == o.size());
+  int turned = 0, same = 0;
+  for(size_t q1=0;q1<o.size();q1++){ turned += o[q1].angle != 0; same += o2[q1].angle == o[q1].angle; }
+  TEST(turned > 0 && same == (int)o.size());
+
+  // a damaged entry is not used
+  FILE* f = fopen(cache.path(k).c_str(), "r+b");
+  fseek(f, 100, SEEK_SET);
+  int ch = fgetc(f);
+  fseek(f, 100, SEEK_SET);
+  fputc(ch^1, f);
+  fclose(f);
+  vector<Descriptor> d3;
+  TEST(!cache.load(k, d3));
+}
+
+void test_match_cache(){
+  Image a = load_image("pano/rainier/0.jpg");
+  Image b = load_image("pano/rainier/1.jpg");
+  vector<Descriptor> ad = harris_corner_detector(a, 2, 0.3, 7, 3, 0);
+  vector<Descriptor> bd = harris_corner_detector(b, 2, 0.3, 7, 3, 0);
+  
+  MatchCache cache("output/feature_cache");
+  string k = MatchCache::key(ad, bd, 5, 1000, 50);
+  TEST(k != MatchCache::key(ad, bd, 5, 1000, 50, 1) && k != MatchCache::key(bd, ad, 5, 1000, 50));
+  
+  vector<Match> m = match_descriptors(ad, bd);
+  Matrix H = RANSAC(m, 5, 1000, 50);
+  TEST(cache.store(k, ad, bd, m, H));
+  
+  // the matches point into the features they are loaded for
+  vector<Descriptor> ad2 = ad, bd2 = bd;
+  vector<Match> m2;
+  Matrix H2;
+  TEST(cache.load(k, ad2, bd2, m2, H2));
+  TEST(m2.size() == m.size() && m2[0].a == &ad2[m[0].a-ad.data()] && m2[0].b->p.x == m[0].b->p.x);
+  TEST(H2(0,2) == H(0,2) && H2(2,1) == H(2,1));
+}
+
+void test_scale_space(){
+  Image im = rgb_to_grayscale(load_image("data/dog.jpg"));
+  auto ss = ScaleSpace::get(im, 1.6, 3, 3);
+  TEST(ss->octaves() == 3 && ss->levels() == 6);
+  TEST(ss->level(1,0).w == im.w/2 && ss->level(2,0).h == im.h/4);
+  
+  // incremental blurs match blurring the image from scratch
+  float diff = 0, diff2 = 0;
+  Image s0 = smooth_image(im, 1.6), s3 = smooth_image(im, 1.6*pow(2., 1./3));
+  for(int y=20;y<im.h-20;y++)for(int x=20;x<im.w-20;x++){
+    diff = max(diff, fabsf(s0(x,y) - ss->level(0,0)(x,y)));
+    diff2 = max(diff2, fabsf(s3(x,y) - ss->level(0,1)(x,y)));
+  }
+  TEST(diff < 1e-5 && diff2 < 2e-3);
+  TEST(same_image(ss->dog(1,2), ss->level(1,3) - ss->level(1,2)));
+  TEST(fabsf(ss->sigma(1,3) - 6.4f) < 1e-5);
+  
+  // the detectors asking for it share one build
+  TEST(ScaleSpace::get(im, 1.6, 3, 2) == ss);
+  TEST(ScaleSpace::get(im, 1.5, 3, 2) != ss);
+}
+
+void test_dog_extrema(){
+  // a dark image with a gaussian blob of std t: one keypoint at its center, of blur t
+  for(float t : {3.f, 6.f}){
+    Image im(160, 160, 1);
+    for(int y=0;y<im.h;y++)for(int x=0;x<im.w;x++)
+      im(x,y) = expf(-(powf(x-70.3f,2)+powf(y-81.6f,2))/(2*t*t));
+    ScaleSpace ss(im, 1.6, 3);
+    vector<ScaleKeypoint> k = dog_extrema(ss, 0.02);
+    TEST(k.size() == 1);
+    if(k.empty())continue;
+    TEST(fabsf(k[0].x-70.3f) < 0.2f && fabsf(k[0].y-81.6f) < 0.2f);
+    TEST(fabsf(k[0].sigma/t-1) < 0.15f && k[0].response < 0);
+  }
+}
+
+void test_fast_hessian(){
+  Image im = rgb_to_grayscale(load_image("data/dog.jpg"));
+  IntegralImage ii(im);
+  double sum = 0;
+  for(int y=10;y<40;y++)for(int x=20;x<27;x++)sum += im(x,y);
+  TEST(fabs(ii.box(20,10,27,40) - sum) < 1e-3 && ii.box(-5,-5,0,100) == 0);
+  
+  // gaussian blobs of std 3 and 6: the strongest keypoint is at the center, with twice the blur for the larger one
+  float sigma[2];
+  for(int q1=0;q1<2;q1++){
+    float t = 3*(q1+1);
+    Image blob(200, 200, 1);
+    for(int y=0;y<blob.h;y++)for(int x=0;x<blob.w;x++)
+      blob(x,y) = expf(-(powf(x-90.f,2)+powf(y-102.f,2))/(2*t*t));
+    vector<ScaleKeypoint> k = fast_hessian_extrema(blob, 1.2, 0.001);
+    TEST(k.size() > 0);
+    if(k.empty())return;
+    auto best = max_element(k.begin(), k.end(), [](const ScaleKeypoint& a, const ScaleKeypoint& b){ return a.response < b.response; });
+    TEST(fabsf(best->x-90) <= 1 && fabsf(best->y-102) <= 1);
+    sigma[q1] = best->sigma;
+  }
+  TEST(sigma[1]/sigma[0] > 1.5 && sigma[1]/sigma[0] < 2.5);
+}
+
+void test_cornerness_measures(){
+  Image S(13, 5, 3);
+  for(int y=0;y<S.h;y++)for(int x=0;x<S.w;x++){
+    S(x,y,0) = (myrand()%1000)/1000.f;
+    S(x,y,1) = (myrand()%1000)/1000.f;
+    S(x,y,2) = (myrand()%1000)/1000.f-0.5f;
+  }
+  Image f = cornerness_sweep(S, ForstnerMeasure());
+  Image t = cornerness_sweep(S, ShiTomasiMeasure());
+  Image h = cornerness_sweep(S, HarrisMeasure(0.04f));
+  bool close = true;
+  for(int y=0;y<S.h;y++)for(int x=0;x<S.w;x++){
+    float a = S(x,y,0), b = S(x,y,1), c = S(x,y,2);
+    float l = (a+b)/2 - sqrtf((a-b)*(a-b)/4 + c*c);
+    close = close && fabsf(f(x,y) - (a*b-c*c)/(a+b)) < 1e-5f && fabsf(h(x,y) - (a*b-c*c-0.04f*(a+b)*(a+b))) < 1e-5f;
+    // the smallest eigenvalue
+    close = close && fabsf(t(x,y) - l) < 1e-5f && fabsf((a-l)*(b-l) - c*c) < 1e-5f;
+  }
+  TEST(close);
+  TEST(same_image(cornerness_response(S, 1), t));
+  
+  // a pixel gets the same result in any column, the end of a row included
+  Image U(13, 1, 3);
+  for(int x=0;x<U.w;x++){ U(x,0,0) = S(3,2,0); U(x,0,1) = S(3,2,1); U(x,0,2) = S(3,2,2); }
+  Image u = cornerness_sweep(U, HybridMeasure());
+  TEST(u(0,0) == u(12,0) && u(12,0) == cornerness_sweep(S, HybridMeasure())(3,2));
+}
+
+void test_fast_corners(){
+  // the vectorized segment test finds what the plain one does
+  Image im(45, 30, 1);
+  for(int i=0;i<im.size();i++)im.data[i] = (myrand()%256)/255.f;
+  const int circle[16][2] = {{0,-3},{1,-3},{2,-2},{3,-1},{3,0},{3,1},{2,2},{1,3},{0,3},{-1,3},{-2,2},{-3,1},{-3,0},{-3,-1},{-2,-2},{-1,-3}};
+  for(int arc : {9, 12}){
+    vector<Corner> c = fast_corners(im, 0.1f, arc);
+    vector<pair<int,int>> expected;
+    for(int y=3;y<im.h-3;y++)for(int x=3;x<im.w-3;x++){
+      int p = lroundf(im(x,y)*255), bright = 0, dark = 0;
+      bool corner = false;
+      for(int k=0;k<16+arc-1;k++){
+        int v = lroundf(im(x+circle[k%16][0], y+circle[k%16][1])*255);
+        bright = v > p+26 ? bright+1 : 0;
+        dark = v < p-26 ? dark+1 : 0;
+        corner = corner || bright >= arc || dark >= arc;
+      }
+      if(corner)expected.push_back({x,y});
+    }
+    bool same = c.size() == expected.size() && !c.empty();
+    for(size_t q1=0;same && q1<c.size();q1++)same = c[q1].x == expected[q1].first && c[q1].y == expected[q1].second && c[q1].response > 0;
+    TEST(same);
+  }
+  
+  // a dark square: its corners, and nothing along its sides
+  Image sq(40, 40, 1);
+  for(int y=0;y<40;y++)for(int x=0;x<40;x++)sq(x,y) = (x>=12 && x<28 && y>=12 && y<28) ? 0.2f : 0.8f;
+  for(bool harris : {false, true}){
+    vector<Descriptor> d = fast_detector(sq, 0.1f, 9, 5, 3, harris);
+    bool near = !d.empty();
+    int found[4] = {0, 0, 0, 0};
+    for(auto&e1:d){
+      int k = (e1.p.x > 20) + 2*(e1.p.y > 20);
+      double cx = k&1 ? 27.5 : 11.5, cy = k&2 ? 27.5 : 11.5;
+      near = near && fabs(e1.p.x-cx) < 3 && fabs(e1.p.y-cy) < 3;
+      found[k]++;
+    }
+    TEST(near && found[0] && found[1] && found[2] && found[3]);
+  }
+}
+
+void test_corner_selection(){
+  // strong corners crowded in the top left, weaker ones all over
+  vector<Corner> c;
+  for(int q1=0;q1<400;q1++){
+    Corner e;
+    bool crowd = q1 < 100;
+    e.x = crowd ? myrand()%20 : myrand()%200;
+    e.y = crowd ? myrand()%20 : myrand()%200;
+    e.response = crowd ? 1+(myrand()%1000)/1000.f : (myrand()%1000)/1000.f;
+    c.push_back(e);
+  }
+  
+  vector<Corner> s = strongest_corners(c, 50);
+  float weakest = INFINITY;
+  for(auto&e1:s)weakest = min(weakest, e1.response);
+  int stronger = 0;
+  for(auto&e1:c)stronger += e1.response > weakest;
+  TEST(s.size() == 50 && stronger < 50);
+  
+  // spread: the strongest corner stays, few come from the crowd (robust 1: with 0.9
+  // the corners within 10% of the strongest are never suppressed)
+  auto spread = [](const vector<Corner>& v){ int n = 0; for(auto&e1:v)n += e1.x < 20 && e1.y < 20; return n; };
+  vector<Corner> a = anms_corners(c, 50, 200, 200, 1.f);
+  vector<Corner> g = grid_corners(c, 50, 200, 200);
+  Corner best = *max_element(c.begin(), c.end(), [](const Corner& p, const Corner& q){ return p.response < q.response; });
+  bool has_best = false;
+  for(auto&e1:a)has_best = has_best || (e1.x == best.x && e1.y == best.y);
+  TEST(a.size() == 50 && has_best && spread(s) == 50 && spread(a) < 10);
+  TEST(g.size() == 50 && spread(g) < 10);
+  TEST(anms_corners(c, 500, 200, 200).size() == c.size());
+  
+  // a budget keeps some of the corners detect_corners finds
+  Image im = load_image("pano/rainier/0.jpg");
+  vector<Descriptor> all = harris_corner_detector(im, 2, 0.3, 7, 3, 0);
+  for(int e1 : {SELECT_STRONGEST, SELECT_ANMS, SELECT_GRID}){
+    vector<Descriptor> d = harris_corner_detector(im, 2, 0.3, 7, 3, 0, 100, e1);
+    bool subset = d.size() == 100 && all.size() > 100;
+    for(auto&e2:d){
+      bool found = false;
+      for(auto&e3:all)found = found || (e3.p.x == e2.p.x && e3.p.y == e2.p.y && e3.data == e2.data);
+      subset = subset && found;
+    }
+    TEST(subset);
+  }
+}
+
+void test_stream_nms(){
+  // the same corners as nms_image and corner_candidates, ties and borders included
+  for(int nms : {0, 1, 3, 10}){
+    Image R(37, 23, 1);
+    for(int i=0;i<R.size();i++)R.data[i] = (myrand()%50)/50.f;
+    vector<Corner> a = corner_candidates(nms_image(R, nms), 0.3f);
+    vector<Corner> b = stream_nms(R.w, R.h, nms, 0.3f, [&](int y, float* r){ memcpy(r, R.RowPtr(y,0), R.w*sizeof(float)); });
+    bool same = a.size() == b.size();
+    for(size_t q1=0;same && q1<a.size();q1++)same = a[q1].x == b[q1].x && a[q1].y == b[q1].y && a[q1].response == b[q1].response;
+    TEST(same);
+  }
+  
+  // the fused harris detector finds what the full-image stages find
+  Image im = load_image("pano/rainier/0.jpg");
+  for(int method : {0, 1}){
+    Image Rnms = nms_image(cornerness_response(structure_matrix(im, 2), method), 3);
+    TEST(features_hash(harris_corner_detector(im, 2, 0.3, 7, 3, method)) == features_hash(detect_corners(im, Rnms, 0.3, 7)));
+  }
+  
+  // and so does the scale-space detector: the maxima of nms_image over the whole responses
+  Image dog = load_image("data/dog.jpg");
+  auto ss = ScaleSpace::get(dog, 2, 3, 2);
+  vector<Descriptor> ref;
+  for(int o=0;o<min(2, ss->octaves());o++)for(int s=1;s<=3;s++){
+    Image R[3];
+    for(int q1=0;q1<3;q1++){
+      R[q1] = cornerness_response(structure_matrix(ss->level(o, s-1+q1), ss->level_sigma(s-1+q1)), 1);
+      float norm = powf(ss->level_sigma(s-1+q1) / 2, 2);
+      for(int i=0;i<R[q1].size();i++)R[q1].data[i] *= norm;
+    }
+    Image N = nms_image(R[1], 3);
+    for(int y=0;y<N.h;y++)for(int x=0;x<N.w;x++){
+      if(N(x,y,0) <= 0.0005f || N(x,y,0) <= R[0](x,y,0) || N(x,y,0) <= R[2](x,y,0))continue;
+      ref.push_back(describe_index(ss->level(o, s), x, y, 5));
+      ref.back().p = Point(x*(1<<o), y*(1<<o));
+    }
+  }
+  TEST(ref.size() > 0 && features_hash(detect_scale_space_keypoints(dog, 2, 0.0005, 5, 3, 2, 3)) == features_hash(ref));
+}
+
+void test_subpixel(){
+  // the peak of a quadratic response is found exactly, wherever the band of rows ends
+  Image R(200, 150, 1);
+  for(int y=0;y<R.h;y++)for(int x=0;x<R.w;x++)
+    R(x,y) = 1 - 0.01f*((x-10.3f)*(x-10.3f) + (y-70.8f)*(y-70.8f)) - 0.005f*(x-10.3f)*(y-70.8f);
+  vector<Corner> c = stream_nms(R.w, R.h, 2, 0.5f, [&](int y, float* r){ memcpy(r, R.RowPtr(y,0), R.w*sizeof(float)); });
+  TEST(c.size() == 1 && c[0].x == 10 && c[0].y == 71 && fabsf(c[0].ox-0.3f) < 1e-3f && fabsf(c[0].oy+0.2f) < 1e-3f);
+  
+  // a corner moved by a fraction of a pixel moves its refined point by about as much
+  auto corner_at = [](float cx, bool subpixel){
+    Image im(40, 40, 1);
+    for(int y=0;y<40;y++)for(int x=0;x<40;x++){
+      float cover = min(max(x+0.5f-cx, 0.f), 1.f) * (y >= 20);
+      im(x,y) = 0.1f + 0.8f*cover;
+    }
+    vector<Descriptor> d = harris_corner_detector(im, 2, 0.01, 5, 5, 0, 0, 0, subpixel);
+    return d.size() == 1 ? d[0].p.x : -1;
+  };
+  double err_pixel = 0, err_subpixel = 0;
+  for(int q1=1;q1<10;q1++){
+    float f = q1/10.f;
+    err_pixel += fabs(corner_at(20+f, false) - corner_at(20, false) - f);
+    err_subpixel += fabs(corner_at(20+f, true) - corner_at(20, true) - f);
+  }
+  TEST(err_subpixel < 0.1*9 && err_subpixel < err_pixel/2);
+}
+
+void test_oriented_patch(){
+  Image im(50, 40, 1);
+  for(int i=0;i<im.size();i++)im.data[i] = (myrand()%256)/255.f;
+  
+  // brighter towards +y: the centroid points down the y axis
+  Image ramp(30, 30, 1);
+  for(int y=0;y<30;y++)for(int x=0;x<30;x++)ramp(x,y) = y/30.f;
+  for(int method : {ORIENT_CENTROID, ORIENT_HISTOGRAM})
+    TEST(fabsf(OrientedPatchExtractor(7, method).orientation(ramp, 15, 15) - (float)M_PI/2) < 1e-3f);
+  
+  // with a single angle the patch is describe_index's, also at the border
+  OrientedPatchExtractor upright(7, ORIENT_CENTROID, 0, 1);
+  for(auto p : {Point(25, 20), Point(1, 38)})
+    TEST(upright.describe(im, Descriptor(p)).data == describe_index(im, p.x, p.y, 7).data);
+  
+  // turned by a right angle, the image turns the orientation and keeps the descriptor
+  Image turned(im.h, im.w, 1);
+  for(int y=0;y<im.h;y++)for(int x=0;x<im.w;x++)turned(im.h-1-y, x) = im(x,y);
+  for(int method : {ORIENT_CENTROID, ORIENT_HISTOGRAM}){
+    OrientedPatchExtractor e(7, method, 8);
+    bool same = true;
+    for(int y=12;y<28;y+=3)for(int x=12;x<38;x+=5){
+      Descriptor a = e.describe(im, Descriptor(Point(x, y)));
+      Descriptor b = e.describe(turned, Descriptor(Point(im.h-1-y, x)));
+      same = same && fabsf(remainderf(b.angle-a.angle-(float)M_PI/2, 2*(float)M_PI)) < 1e-3f && a.data.size() == b.data.size();
+      for(size_t q1=0;same && q1<a.data.size();q1++)same = fabsf(a.data[q1]-b.data[q1]) < 1e-5f;
+    }
+    TEST(same);
+  }
+  
+  vector<string> names = extractor_names();
+  TEST(find(names.begin(), names.end(), "oriented-patch") != names.end());
+}
+
+void test_feature_registry(){
+  vector<string> names = detector_names();
+  for(string e1 : {"harris", "shi-tomasi", "fhh", "log", "dog", "scale-space", "fast"})
+    TEST(find(names.begin(), names.end(), e1) != names.end());
+  
+  bool thrown = false;
+  try { make_detector("nope", DetectorParams()); } catch(const invalid_argument&) { thrown = true; }
+  TEST(thrown);
+  
+  Image a = load_image("pano/rainier/0.jpg");
+  Image b = load_image("pano/rainier/1.jpg");
+  DetectorParams p;
+  p.thresh = 0.3;
+  auto harris = make_detector("harris", p);
+  vector<vector<Descriptor>> d = harris->detect({&a, &b});
+  vector<Descriptor> ad = harris_corner_detector(a, 2, 0.3, 7, 3, 0);
+  vector<Descriptor> bd = harris_corner_detector(b, 2, 0.3, 7, 3, 0);
+  TEST(d.size() == 2 && features_hash(d[0]) == features_hash(ad) && features_hash(d[1]) == features_hash(bd));
+  
+  // the patch extractor gives the descriptors of the corner detectors
+  auto described = make_detector("harris", p, "patch");
+  TEST(features_hash(described->detect(a)) == features_hash(ad));
+}
 
 void run_tests(){
   test_structure();
   test_cornerness();
+  test_cornerness_measures();
+  test_bundle_adjust();
+  test_tiled_canvas();
+  test_remap();
+  test_thread_pool();
+  test_job_graph();
+  test_artifact_store();
+  test_pipeline();
+  test_load_image();
+  test_reduced_decode();
+  test_mosaic_windows();
+  test_image_writer();
+  test_image_file();
+  test_feature_cache();
+  test_match_cache();
+  test_scale_space();
+  test_dog_extrema();
+  test_fast_hessian();
+  test_feature_registry();
+  test_fast_corners();
+  test_corner_selection();
+  test_stream_nms();
+  test_subpixel();
+  test_oriented_patch();
   
   printf("%d tests, %d passed, %d failed\n", tests_total, tests_total-tests_fail, tests_fail);
 }
@@ -0,0 +1,131 @@
+#include <cstdlib>
+#include <cstdio>
+
+#include "thread_pool.h"
+
+using namespace std;
+
+// Index of the pool worker running on this thread, -1 elsewhere.
+static thread_local int worker_index=-1;
+static thread_local ThreadPool* worker_pool=nullptr;
+
+ThreadPool& ThreadPool::instance(void){
+  static ThreadPool pool([](){
+    const char* env=getenv("UWIMG_THREADS");
+    int n=env?atoi(env):0;
+    if(n<=0)n=thread::hardware_concurrency();
+    return max(1,n);
+  }());
+  return pool;
+}
+
+ThreadPool::ThreadPool(int workers){
+  for(int q1=0;q1<workers;q1++)queues.emplace_back(new Queue);
+  for(int q1=0;q1<workers;q1++)threads.emplace_back([this,q1](){ worker(q1); });
+}
+
+ThreadPool::~ThreadPool(){
+    {
+    lock_guard<mutex> LG(sleep_m);
+    stop=true;
+    }
+  sleep_cv.notify_all();
+  for(auto&e1:threads)e1.join();
+}
+
+// Workers push on their own deque, other threads spread the work round robin.
+void ThreadPool::push(function<void()> ticket){
+  int q=(worker_pool==this)?worker_index:(int)(next_queue++%queues.size());
+    {
+    lock_guard<mutex> LG(queues[q]->m);
+    queues[q]->q.push_back(move(ticket));
+    }
+    {
+    lock_guard<mutex> LG(sleep_m);
+    queued++;
+    }
+  sleep_cv.notify_one();
+}
+
+// Own work is taken newest first, stolen work oldest first.
+bool ThreadPool::pop(function<void()>& ticket, int self){
+  int n=queues.size();
+  for(int q1=0;q1<n;q1++){
+    Queue& q=*queues[(self+q1)%n];
+    lock_guard<mutex> LG(q.m);
+    if(q.q.empty())continue;
+    if(q1==0){ ticket=move(q.q.back()); q.q.pop_back(); }
+    else     { ticket=move(q.q.front()); q.q.pop_front(); }
+    queued--;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::worker(int self){
+  worker_index=self;
+  worker_pool=this;
+  function<void()> ticket;
+  while(true){
+    if(pop(ticket,self)){ ticket(); ticket=nullptr; continue; }
+    unique_lock<mutex> LG(sleep_m);
+    sleep_cv.wait(LG,[this](){ return stop || queued>0; });
+    if(stop)return;
+  }
+}
+
+
+bool TaskGroup::State::run_one(void){
+  function<void()> f;
+    {
+    lock_guard<mutex> LG(m);
+    if(tasks.empty())return false;
+    f=move(tasks.front());
+    tasks.pop_front();
+    }
+  exception_ptr e;
+  try { f(); } catch(...) { e=current_exception(); }
+  lock_guard<mutex> LG(m);
+  if(e && !error)error=e;
+  if(--unfinished==0)done.notify_all();
+  return true;
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool) : pool(pool), state(make_shared<State>()) {}
+
+TaskGroup::~TaskGroup(){
+  try { wait(); } catch(...) {}
+}
+
+void TaskGroup::run(function<void()> f){
+    {
+    lock_guard<mutex> LG(state->m);
+    state->tasks.push_back(move(f));
+    state->unfinished++;
+    }
+  state->done.notify_all();
+  // The ticket keeps the state alive: it may run after the group is gone,
+  // finding nothing left to do.
+  shared_ptr<State> s=state;
+  pool.push([s](){ s->run_one(); });
+}
+
+// Tasks may add more tasks to the group while it is waited for: the
+// waiting thread wakes up to run them too.
+void TaskGroup::wait(void){
+  unique_lock<mutex> LG(state->m);
+  while(state->unfinished){
+    if(!state->tasks.empty()){
+      LG.unlock();
+      while(state->run_one());
+      LG.lock();
+      continue;
+    }
+    state->done.wait(LG,[this](){ return state->unfinished==0 || !state->tasks.empty(); });
+  }
+  if(state->error){
+    exception_ptr e=state->error;
+    state->error=nullptr;
+    rethrow_exception(e);
+  }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Process-wide work-stealing thread pool.
+//
+// Every worker owns a deque: it pushes and pops its own work at the back and,
+// when it runs dry, steals from the front of the others. The work items are
+// tickets of task groups: a ticket runs the next pending task of its group.
+// A thread waiting for a group runs the group's tasks itself instead of
+// blocking, so nested parallelism (a task that forks and waits) never
+// deadlocks and never needs more threads than the workers.
+//
+// The number of workers is the UWIMG_THREADS environment variable,
+// or the number of hardware threads when it is not set.
+class TaskGroup;
+
+class ThreadPool
+  {
+  public:
+
+  static ThreadPool& instance(void);
+
+  explicit ThreadPool(int workers);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int workers(void) const { return (int)queues.size(); }
+
+  private:
+
+  friend class TaskGroup;
+
+  struct Queue
+    {
+    mutex m;
+    deque<function<void()>> q;
+    };
+
+  void push(function<void()> ticket);
+  bool pop(function<void()>& ticket, int self);
+  void worker(int self);
+
+  vector<unique_ptr<Queue>> queues;
+  vector<thread> threads;
+  atomic<int> queued{0};
+  atomic<unsigned> next_queue{0};
+  atomic<bool> stop{false};
+  mutex sleep_m;
+  condition_variable sleep_cv;
+  };
+
+// A set of tasks that can be waited for. The first exception thrown by a
+// task is rethrown by wait().
+class TaskGroup
+  {
+  public:
+
+  explicit TaskGroup(ThreadPool& pool=ThreadPool::instance());
+  ~TaskGroup();
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  void run(function<void()> f);
+
+  // Runs the pending tasks of the group on this thread and waits for the
+  // ones already started by the workers.
+  void wait(void);
+
+  private:
+
+  struct State
+    {
+    mutex m;
+    condition_variable done;
+    deque<function<void()>> tasks;
+    int unfinished=0;
+    exception_ptr error;
+
+    // returns: false if there was no task left to run.
+    bool run_one(void);
+    };
+
+  ThreadPool& pool;
+  shared_ptr<State> state;
+  };
+
+// Runs 'f(lo,hi)' on consecutive ranges of at most 'grain' elements covering [begin,end).
+template<typename F>
+void parallel_for_ranges(int begin, int end, int grain, F f)
+  {
+  int n=end-begin;
+  if(n<=0)return;
+  grain=max(1,grain);
+  ThreadPool& pool=ThreadPool::instance();
+  int tasks=min((n+grain-1)/grain,pool.workers()+1);
+  if(tasks<=1){ f(begin,end); return; }
+
+  atomic<int> next(begin);
+  auto body=[&](){ for(int lo;(lo=next.fetch_add(grain))<end;)f(lo,min(end,lo+grain)); };
+  TaskGroup g(pool);
+  for(int q1=1;q1<tasks;q1++)g.run(body);
+  body();
+  g.wait();
+  }
+
+// Runs 'f(i)' for i in [begin,end) on the pool.
+template<typename F>
+void parallel_for(int begin, int end, F f)
+  {
+  parallel_for_ranges(begin,end,1,[&](int lo, int hi){ for(int i=lo;i<hi;i++)f(i); });
+  }
@@ -0,0 +1,274 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <cstdint>
+
+#include "image.h"
+#include "tiled_image.h"
+#include "image_writer.h"
+#include "stb_image_write.h"
+
+using namespace std;
+
+static const int TILE=TiledImage::TILE;
+
+Image TiledImage::get_rows(int y, int rows) const {
+  assert(y>=0 && y+rows<=h);
+  Image r(w, rows, c);
+  for(int k=0;k<c;k++)for(int j=0;j<rows;j++){
+    int gy=y0+y+j;
+    float* out=r.RowPtr(j,k);
+    for(int x=0;x<w;){
+      int gx=x0+x;
+      int n=min(w-x,TILE-gx%TILE);
+      memcpy(out+x,tile(gx/TILE,gy/TILE)+k*TILE*TILE+(gy%TILE)*TILE+gx%TILE,sizeof(float)*n);
+      x+=n;
+    }
+  }
+  return r;
+}
+
+// Rows are converted and compressed one band of tiles at a time.
+void TiledImage::save_png(const string& name, int level) const {
+  string file=name+".png";
+  PngWriter png;
+  bool ok=png.open(file,w,h,c,level);
+  for(int y=0;ok && y<h;){
+    int rows=min(h-y,TILE-(y0+y)%TILE);
+    png.write_rows(get_rows(y,rows));
+    for(int tx=0;tx<tiles_x;tx++)release(tx,(y0+y)/TILE);
+    y+=rows;
+  }
+  if(!png.close() || !ok)fprintf(stderr, "Failed to write image %s\n", file.c_str());
+}
+
+// stb needs the whole 8 bit image: it is built row by row in a mapped scratch
+// file, whose pages the kernel can drop while the encoder walks through them.
+void TiledImage::save_image(const string& name) const {
+  string file=name+".jpg";
+  MappedFile scratch;
+  bool ok=scratch.create_scratch((size_t)w*h*c);
+  for(int y=0;ok && y<h;){
+    int rows=min(h-y,TILE-(y0+y)%TILE);
+    Image r=get_rows(y,rows);
+    for(int j=0;j<rows;j++)row_to_uint8(r,j,scratch.data+(size_t)(y+j)*w*c);
+    for(int tx=0;tx<tiles_x;tx++)release(tx,(y0+y)/TILE);
+    y+=rows;
+  }
+  if(ok)ok=stbi_write_jpg(file.c_str(), w, h, c, scratch.data, 100);
+  if(!ok)fprintf(stderr, "Failed to write image %s\n", file.c_str());
+}
+
+
+// Bounding box of the non-empty pixels, merged across tiles.
+struct Bounds {
+  int minx=INT32_MAX, miny=INT32_MAX, maxx=-1, maxy=-1;
+  mutex m;
+  void add(int x0, int y0, int x1, int y1){
+    lock_guard<mutex> LG(m);
+    minx=min(minx,x0); miny=min(miny,y0);
+    maxx=max(maxx,x1); maxy=max(maxy,y1);
+  }
+  void crop(TiledImage& t){ if(maxx>=minx && maxy>=miny)t.crop(minx,miny,maxx-minx+1,maxy-miny+1); }
+};
+
+// Same as combine_images, but the canvas is tiled and lives on disk:
+// every tile is pasted/warped independently and then released.
+// int& ox, oy: set to the position of the result in the coordinates of image a.
+TiledImage combine_images_tiled(const Image& a, const Image& b, const Matrix& Hba, float ablendcoeff, int& ox, int& oy){
+  Matrix Hinv=Hba.inverse();
+
+  // Project the corners of image b into image a coordinates.
+  Point c1 = project_point(Hinv, Point(0,0));
+  Point c2 = project_point(Hinv, Point(b.w-1, 0));
+  Point c3 = project_point(Hinv, Point(0, b.h-1));
+  Point c4 = project_point(Hinv, Point(b.w-1, b.h-1));
+
+  // Find top left and bottom right corners of image b warped into image a.
+  Point topleft, botright;
+  botright.x = max(c1.x, max(c2.x, max(c3.x, c4.x)));
+  botright.y = max(c1.y, max(c2.y, max(c3.y, c4.y)));
+  topleft.x = min(c1.x, min(c2.x, min(c3.x, c4.x)));
+  topleft.y = min(c1.y, min(c2.y, min(c3.y, c4.y)));
+
+  // Find how big our new image should be and the offsets from image a.
+  int dx = min(0, (int)topleft.x);
+  int dy = min(0, (int)topleft.y);
+  int w = max(a.w, (int)botright.x) - dx;
+  int h = max(a.h, (int)botright.y) - dy;
+
+  // There is no size limit any more, but a canvas much bigger than
+  // the inputs usually means there was an error in calculating H.
+  if((double)w*h > 64.0*((double)a.w*a.h+(double)b.w*b.h))
+    {
+    printf("Can't make such big panorama :/ (%d %d)\n",w,h);
+    ox=oy=0;
+    return TiledImage(100,100,1);
+    }
+
+  TiledImage c(w, h, a.c);
+  Bounds bounds;
+
+  parallel_for(0,c.tiles_x*c.tiles_y,[&](int t){
+    int tx=t%c.tiles_x, ty=t/c.tiles_x;
+    float* tile=c.tile(tx,ty);
+    int bx0=INT32_MAX, by0=INT32_MAX, bx1=-1, by1=-1;
+
+    for(int j=ty*TILE;j<min(h,(ty+1)*TILE);j++)for(int i=tx*TILE;i<min(w,(tx+1)*TILE);i++){
+      float* px=tile+(j%TILE)*TILE+i%TILE;
+      int ai=i+dx, aj=j+dy;
+      bool filled=false;
+
+      // Paste image a into the new image offset by dx and dy.
+      if(ai>=0 && aj>=0 && ai<a.w && aj<a.h && !a.is_empty(ai,aj)){
+        for(int k=0;k<a.c;k++)px[k*TILE*TILE]=a(ai,aj,k);
+        filled=true;
+      } else {
+        Point projected = project_point(Hba, Point(i + dx, j + dy));
+        if (projected.x >= 0 && projected.y >= 0 && projected.x < b.w && projected.y < b.h) {
+          for (int k = 0; k < b.c; k++) {
+            float prev = px[k*TILE*TILE];
+            float pixel = b.pixel_bilinear(projected.x, projected.y, k);
+            if (prev > 0) px[k*TILE*TILE] = ablendcoeff * prev + (1 - ablendcoeff) * pixel;
+            else px[k*TILE*TILE] = pixel;
+            filled|=pixel!=0;
+          }
+        }
+      }
+
+      if(filled){ bx0=min(bx0,i); by0=min(by0,j); bx1=max(bx1,i); by1=max(by1,j); }
+    }
+
+    if(bx1>=0)bounds.add(bx0,by0,bx1,by1);
+    c.release(tx,ty);
+  });
+
+  bounds.crop(c);
+  ox=c.x0+dx;
+  oy=c.y0+dy;
+  return c;
+}
+
+TiledImage combine_images_tiled(const Image& a, const Image& b, const Matrix& Hba, float ablendcoeff){
+  int ox, oy;
+  return combine_images_tiled(a, b, Hba, ablendcoeff, ox, oy);
+}
+
+
+TiledRenderer::TiledRenderer(const vector<pair<int,int>>& sizes, int channels, const vector<Matrix>& Hr, const Projection& proj)
+  : channels(channels), Hr(Hr), proj(proj), boxes(sizes.size()) {
+  assert(sizes.size()==Hr.size());
+
+  double minx=1e30, miny=1e30, maxx=-1e30, maxy=-1e30;
+  double input_area=0;
+  for(int q1=0;q1<(int)sizes.size();q1++)if(Hr[q1].rows){
+    int iw=sizes[q1].first, ih=sizes[q1].second;
+    Matrix Hinv=Hr[q1].inverse();
+    Box& b=boxes[q1];
+    b.x0=b.y0=INT32_MAX; b.x1=b.y1=INT32_MIN;
+    for(Point e:{Point(0,0),Point(iw-1,0),Point(0,ih-1),Point(iw-1,ih-1)}){
+      Point c=project_point(Hinv,e);
+      minx=min(minx,c.x); maxx=max(maxx,c.x);
+      miny=min(miny,c.y); maxy=max(maxy,c.y);
+      b.x0=min(b.x0,(int)floor(c.x)); b.x1=max(b.x1,(int)ceil(c.x));
+      b.y0=min(b.y0,(int)floor(c.y)); b.y1=max(b.y1,(int)ceil(c.y));
+    }
+    input_area+=(double)iw*ih;
+  }
+  if(!input_area){ channels=0; return; }
+
+  dx=floor(minx);
+  dy=floor(miny);
+  int w=ceil(maxx)-dx+1;
+  int h=ceil(maxy)-dy+1;
+
+  // Usually this means there was an error in calculating H.
+  if((double)w*h > 64.0*input_area)
+    {
+    printf("Can't make such big panorama :/ (%d %d)\n",w,h);
+    channels=-1;
+    return;
+    }
+
+  // the last channel is the total weight
+  acc=TiledImage(w, h, channels+1);
+}
+
+// Every tile is touched by one task only; the tiles are released as soon as they are done.
+void TiledRenderer::add(int i, const Image& im){
+  if(channels<=0 || !Hr[i].rows)return;
+  const Box& b=boxes[i];
+  int tx0=max(0,b.x0-dx)/TILE, tx1=min(acc.w-1,b.x1-dx)/TILE;
+  int ty0=max(0,b.y0-dy)/TILE, ty1=min(acc.h-1,b.y1-dy)/TILE;
+  int ntx=tx1-tx0+1;
+  const Matrix& H=Hr[i];
+
+  parallel_for(0,ntx*(ty1-ty0+1),[&](int t){
+    int tx=tx0+t%ntx, ty=ty0+t/ntx;
+    float* tile=acc.tile(tx,ty);
+    float* weight=tile+channels*TILE*TILE;
+    int x0=max(tx*TILE,b.x0-dx), x1=min(min(acc.w,(tx+1)*TILE)-1,b.x1-dx);
+    int y0=max(ty*TILE,b.y0-dy), y1=min(min(acc.h,(ty+1)*TILE)-1,b.y1-dy);
+    for(int j=y0;j<=y1;j++)for(int i=x0;i<=x1;i++){
+      Point q=project_point(H, Point(i + dx, j + dy));
+      if(!im.contains(q.x,q.y))continue;
+      Point s=proj.inverse(q,im.w,im.h);
+      if(!im.contains(s.x,s.y))continue;
+      if(im.is_empty(min((int)lround(s.x),im.w-1),min((int)lround(s.y),im.h-1)))continue;
+
+      // Feathering: weight grows with the distance from the image border.
+      float f=min(min(q.x,im.w-1-q.x),min(q.y,im.h-1-q.y))+1;
+      int o=(j%TILE)*TILE+i%TILE;
+      for(int k=0;k<channels;k++)tile[k*TILE*TILE+o]+=f*im.pixel_bilinear(s.x,s.y,min(k,im.c-1));
+      weight[o]+=f;
+    }
+    acc.release(tx,ty);
+  });
+}
+
+TiledImage TiledRenderer::finish(void){
+  if(channels==0)return TiledImage();
+  if(channels<0)return TiledImage(100,100,1);
+
+  TiledImage c(acc.w, acc.h, channels);
+  Bounds bounds;
+
+  parallel_for(0,c.tiles_x*c.tiles_y,[&](int t){
+    int tx=t%c.tiles_x, ty=t/c.tiles_x;
+    const float* in=acc.tile(tx,ty);
+    const float* weight=in+channels*TILE*TILE;
+    float* out=c.tile(tx,ty);
+
+    int bx0=INT32_MAX, by0=INT32_MAX, bx1=-1, by1=-1;
+    for(int j=ty*TILE;j<min(c.h,(ty+1)*TILE);j++)for(int i=tx*TILE;i<min(c.w,(tx+1)*TILE);i++){
+      int o=(j%TILE)*TILE+i%TILE;
+      if(weight[o]<=0)continue;
+      for(int k=0;k<channels;k++)out[k*TILE*TILE+o]=in[k*TILE*TILE+o]/weight[o];
+      bx0=min(bx0,i); by0=min(by0,j); bx1=max(bx1,i); by1=max(by1,j);
+    }
+
+    if(bx1>=0)bounds.add(bx0,by0,bx1,by1);
+    acc.release(tx,ty);
+    c.release(tx,ty);
+  });
+
+  acc=TiledImage();
+  bounds.crop(c);
+  return c;
+}
+
+
+// Same as render_panorama, but the canvas is tiled and lives on disk.
+TiledImage render_panorama_tiled(const vector<Image>& ims, const vector<Matrix>& Hr, const Projection& proj){
+  vector<pair<int,int>> sizes;
+  int channels=0;
+  for(int q1=0;q1<(int)ims.size();q1++){
+    sizes.push_back({ims[q1].w,ims[q1].h});
+    if(Hr[q1].rows)channels=max(channels,ims[q1].c);
+  }
+  TiledRenderer r(sizes, channels, Hr, proj);
+  for(int q1=0;q1<(int)ims.size();q1++)r.add(q1, ims[q1]);
+  return r.finish();
+}
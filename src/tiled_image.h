@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cassert>
+#include <cstring>
+
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "mapped_file.h"
+#include "remap.h"
+
+using namespace std;
+
+// An image too big to live in memory, used as canvas for big panoramas.
+// Pixels are stored in TILExTILE tiles (planar inside each tile) in a memory
+// mapped scratch file, so that only the tiles being worked on are resident.
+// A view window (x0,y0,w,h) crops the canvas without copying it.
+struct TiledImage
+  {
+  static constexpr int TILE=256;
+
+  int w=0;
+  int h=0;
+  int c=0;
+
+  // full canvas, the view is [x0,x0+w)x[y0,y0+h)
+  int W=0, H=0;
+  int x0=0, y0=0;
+  int tiles_x=0, tiles_y=0;
+
+  MappedFile storage;
+
+  TiledImage() = default;
+  TiledImage(int w, int h, int c) : w(w), h(h), c(c), W(w), H(h)
+    {
+    tiles_x=(w+TILE-1)/TILE;
+    tiles_y=(h+TILE-1)/TILE;
+    if(!storage.create_scratch(tile_bytes()*tiles_x*tiles_y))
+      throw runtime_error("Cannot allocate tiled image scratch file");
+    }
+
+  size_t tile_bytes(void) const { return sizeof(float)*TILE*TILE*c; }
+
+  // TILExTILExc floats of tile (tx,ty), planar.
+        float* tile(int tx, int ty)       { return (float*)(storage.data+tile_bytes()*(ty*tiles_x+tx)); }
+  const float* tile(int tx, int ty) const { return (const float*)(storage.data+tile_bytes()*(ty*tiles_x+tx)); }
+
+  // Drops the tile from the resident memory (its content is preserved).
+  void release(int tx, int ty) const
+    {
+    const_cast<MappedFile&>(storage).release(tile_bytes()*(ty*tiles_x+tx),tile_bytes());
+    }
+
+  // pixel access in view coordinates
+  float& operator()(int x, int y, int ch)
+    {
+    assert(ch<c && ch>=0 && x<w && x>=0 && y<h && y>=0 && "access out of bounds");
+    x+=x0; y+=y0;
+    return tile(x/TILE,y/TILE)[ch*TILE*TILE+(y%TILE)*TILE+x%TILE];
+    }
+
+  const float& operator()(int x, int y, int ch) const
+    {
+    assert(ch<c && ch>=0 && x<w && x>=0 && y<h && y>=0 && "access out of bounds");
+    x+=x0; y+=y0;
+    return tile(x/TILE,y/TILE)[ch*TILE*TILE+(y%TILE)*TILE+x%TILE];
+    }
+
+  // Restricts the view to [x,x+w)x[y,y+h) of the current view.
+  void crop(int x, int y, int cw, int ch)
+    {
+    assert(x>=0 && y>=0 && x+cw<=w && y+ch<=h);
+    x0+=x; y0+=y; w=cw; h=ch;
+    }
+
+  // returns: rows [y,y+rows) of the view as a regular image.
+  Image get_rows(int y, int rows) const;
+
+  // returns: the view as a regular image (only for views that fit in memory).
+  Image to_image(void) const { return get_rows(0,h); }
+
+  void save_png  (const string& filename, int level=6) const;
+  void save_image(const string& filename) const;
+  };
+
+inline void save_png  (const TiledImage& im, const string& filename, int level=6) { im.save_png(filename, level); }
+inline void save_image(const TiledImage& im, const string& filename) { im.save_image(filename); }
+
+TiledImage combine_images_tiled(const Image& a, const Image& b, const Matrix& Hba, float acoeff);
+TiledImage combine_images_tiled(const Image& a, const Image& b, const Matrix& Hba, float acoeff, int& ox, int& oy);
+
+// Renders a panorama into a tiled canvas one image at a time (feather-blended, as
+// render_panorama), so that only the image being added has to be in memory.
+// sizes[i]: size of image i, Hr[i]: panorama->image homography (empty Matrix: image skipped).
+// proj: projection the homographies refer to, the images being unprojected
+// originals; the only resampling is the one done while rendering.
+class TiledRenderer
+  {
+  public:
+
+  TiledRenderer(const vector<pair<int,int>>& sizes, int channels, const vector<Matrix>& Hr, const Projection& proj=Projection());
+
+  // Adds image i; images are added one at a time, in any order.
+  void add(int i, const Image& im);
+
+  // returns: the panorama, cropped to the rendered pixels.
+  TiledImage finish(void);
+
+  private:
+
+  struct Box { int x0=0, y0=0, x1=-1, y1=-1; };
+
+  int channels;
+  vector<Matrix> Hr;
+  Projection proj;
+  vector<Box> boxes;  // bounding box of every image, panorama coordinates
+  int dx=0, dy=0;     // panorama coordinates of the canvas origin
+  TiledImage acc;     // weighted sums, the last channel is the total weight
+  };
+
+TiledImage render_panorama_tiled(const vector<Image>& ims, const vector<Matrix>& Hr, const Projection& proj=Projection());
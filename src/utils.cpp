@@ -8,6 +8,23 @@
 int tests_total = 0;
 int tests_fail = 0;
 
+// 8 bytes at a time, multiply and fold.
+unsigned long long hash_bytes(const void* data, size_t n, unsigned long long seed)
+  {
+  const unsigned char* p=(const unsigned char*)data;
+  unsigned long long h=0x9e3779b97f4a7c15ull^n^seed;
+  size_t q1=0;
+  for(;q1+8<=n;q1+=8)
+    {
+    unsigned long long v;
+    memcpy(&v,p+q1,8);
+    h=(h^v)*0xff51afd7ed558ccdull;
+    h^=h>>32;
+    }
+  for(;q1<n;q1++)h=(h^p[q1])*0x100000001b3ull;
+  return h^(h>>29);
+  }
+
 int same_image(const Image& a, const Image& b) { return a==b; }
 
 bool operator ==(const Image& a, const Image& b)
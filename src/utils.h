@@ -7,6 +7,9 @@
 #include <mutex>
 
 #include <random>
+#include <algorithm>
+
+#include "thread_pool.h"
 
 using namespace std;
 
@@ -62,6 +65,9 @@ __ProfileScopeClass(int line,const std::string& fname,int level,const std::strin
 
 inline unsigned int myrand() { static std::mt19937 mt; return mt(); }
 
+// Fast 64 bit hash of n bytes (checksums, cache keys): not cryptographic.
+unsigned long long hash_bytes(const void* data, size_t n, unsigned long long seed=0);
+
 #define COMBINE1(X,Y) X##Y
 #define COMBINE(X,Y) COMBINE1(X,Y)
 